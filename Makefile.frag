@@ -0,0 +1,18 @@
+
+# 开销测试, 结果写到 bench-results.json; 参数见 bench/run.php, 例如
+#   make bench BENCH_ARGS="--sizes=100 --depths=1 --calls=500000"
+bench: all
+	$(PHP_EXECUTABLE) -n $(top_srcdir)/bench/run.php --php=$(PHP_EXECUTABLE) --ext=$(top_builddir)/modules/xhprof.so $(BENCH_ARGS)
+
+.PHONY: bench
+
+# 合并 xhprof.dump 文件的命令行工具, 不依赖 PHP, 见 tools/xhprof_agg.c
+xhprof_agg: $(top_srcdir)/tools/xhprof_agg.c $(top_srcdir)/hist.h
+	$(CC) -O2 -pthread -o $@ $(top_srcdir)/tools/xhprof_agg.c
+
+# 新旧两种字典树布局的内存和每次查找耗时, 不依赖 PHP, 见 bench/trie_layout.c
+trie-bench: $(top_srcdir)/bench/trie_layout.c $(top_srcdir)/trie.h
+	$(CC) -O2 -o trie_layout $(top_srcdir)/bench/trie_layout.c
+	./trie_layout $(TRIE_BENCH_ARGS)
+
+.PHONY: trie-bench
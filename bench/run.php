@@ -0,0 +1,128 @@
+<?php
+/**
+ * Overhead benchmark, run by `make bench`.
+ *
+ * Runs bench/workload.php in a fresh process for every combination of mode
+ * (no extension, enabled with an empty list, HASH, TRIE, PHF, AUTO), track
+ * list size, call depth and function vs method names, repeats each run and
+ * keeps the median. Prints a table and writes all results as JSON so two
+ * builds can be compared.
+ *
+ * Options:
+ *   --php=PATH          PHP binary (default: the one running this script)
+ *   --ext=PATH          xhprof.so to load
+ *   --json=FILE         where to write the results (default: bench-results.json)
+ *   --modes=a,b         subset of none,empty,hash,trie,phf,auto
+ *   --sizes=1,100,10000 track list sizes
+ *   --depths=1,10       call chain depths
+ *   --kinds=function,method
+ *   --calls=N           calls per run (default 2000000)
+ *   --repeat=N          runs per combination, the median is kept (default 3)
+ *   --observer=0|1      xhprof.observer on PHP 8 (default: the INI default)
+ */
+
+$opts = getopt('', ['php:', 'ext:', 'json:', 'modes:', 'sizes:', 'depths:', 'kinds:', 'calls:', 'repeat:', 'observer:']);
+
+$php      = isset($opts['php']) ? $opts['php'] : PHP_BINARY;
+$ext      = isset($opts['ext']) ? $opts['ext'] : __DIR__ . '/../modules/xhprof.so';
+$json     = isset($opts['json']) ? $opts['json'] : 'bench-results.json';
+$modes    = explode(',', isset($opts['modes']) ? $opts['modes'] : 'none,empty,hash,trie,phf,auto');
+$sizes    = array_map('intval', explode(',', isset($opts['sizes']) ? $opts['sizes'] : '1,100,10000'));
+$depths   = array_map('intval', explode(',', isset($opts['depths']) ? $opts['depths'] : '1,10'));
+$kinds    = explode(',', isset($opts['kinds']) ? $opts['kinds'] : 'function,method');
+$calls    = isset($opts['calls']) ? (int)$opts['calls'] : 2000000;
+$repeat   = max(1, isset($opts['repeat']) ? (int)$opts['repeat'] : 3);
+
+if (!is_file($ext)) {
+    fwrite(STDERR, "xhprof extension not found: $ext (build it first or pass --ext)\n");
+    exit(1);
+}
+
+$ext_args = '-d ' . escapeshellarg('extension=' . realpath($ext));
+if (isset($opts['observer'])) {
+    $ext_args .= ' -d xhprof.observer=' . (int)$opts['observer'];
+}
+
+function bench_run($cmd) {
+    $out = shell_exec($cmd);
+    $row = json_decode(trim((string)$out), true);
+    if (!is_array($row)) {
+        fwrite(STDERR, "run failed: $cmd\n$out\n");
+        exit(1);
+    }
+    return $row;
+}
+
+function bench_median(array $values) {
+    sort($values);
+    return $values[intdiv(count($values), 2)];
+}
+
+$results = [];
+$baseline = [];
+
+printf("%-6s %6s %5s %-8s %10s %12s %9s\n", 'mode', 'size', 'depth', 'kind', 'ns/call', 'overhead ns', 'rss KB');
+
+foreach ($kinds as $kind) {
+    foreach ($depths as $depth) {
+        $iterations = max(1, intdiv($calls, $depth));
+
+        foreach ($modes as $mode) {
+            //没有函数列表的模式不随列表大小变化, 只跑一次
+            foreach (in_array($mode, ['none', 'empty']) ? [0] : $sizes as $size) {
+                $cmd = sprintf('%s -n %s %s %s %d %d %s %d 2>&1',
+                        escapeshellarg($php), $mode === 'none' ? '' : $ext_args,
+                        escapeshellarg(__DIR__ . '/workload.php'), $mode, $size, $depth, $kind, $iterations);
+
+                $ns = [];
+                $rss = [];
+                for ($r = 0; $r < $repeat; $r++) {
+                    $row = bench_run($cmd);
+                    $ns[] = $row['elapsed_ns'] / $row['calls'];
+                    $rss[] = $row['rss_kb'];
+
+                    if (!in_array($mode, ['none', 'empty']) && $row['tracked'] != $iterations) {
+                        fwrite(STDERR, "$mode/$size/$depth/$kind: tracked {$row['tracked']} calls, expected $iterations\n");
+                        exit(1);
+                    }
+                }
+
+                $result = [
+                    'mode'        => $mode,
+                    'list_size'   => $size,
+                    'depth'       => $depth,
+                    'kind'        => $kind,
+                    'calls'       => $iterations * $depth,
+                    'ns_per_call' => round(bench_median($ns), 2),
+                    'rss_kb'      => bench_median($rss),
+                ];
+
+                if ($mode === 'none') {
+                    $baseline["$kind/$depth"] = $result['ns_per_call'];
+                }
+                $result['overhead_ns'] = isset($baseline["$kind/$depth"])
+                    ? round($result['ns_per_call'] - $baseline["$kind/$depth"], 2) : null;
+
+                $results[] = $result;
+
+                printf("%-6s %6d %5d %-8s %10.2f %12s %9d\n", $mode, $size, $depth, $kind,
+                        $result['ns_per_call'], $result['overhead_ns'] === null ? '-' : sprintf('%.2f', $result['overhead_ns']),
+                        $result['rss_kb']);
+            }
+        }
+    }
+}
+
+$version = trim((string)shell_exec(escapeshellarg($php) . ' -n -r "echo PHP_VERSION;"'));
+
+file_put_contents($json, json_encode([
+    'php'       => $version,
+    'extension' => realpath($ext),
+    'date'      => date('c'),
+    'host'      => php_uname('n'),
+    'calls'     => $calls,
+    'repeat'    => $repeat,
+    'results'   => $results,
+], JSON_PRETTY_PRINT) . "\n");
+
+echo "results written to $json\n";
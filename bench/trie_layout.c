@@ -0,0 +1,274 @@
+/*
+ * trie_layout: memory and lookup time of the radix trie in trie.h against
+ * the trie it replaced (one malloc'd node per byte, 127 child pointers per
+ * node), both built from the same track list.
+ *
+ *     cc -O2 -o trie_layout bench/trie_layout.c
+ *     trie_layout [KEYS ...]          (default: 100 1000 5000)
+ *
+ * Keys look like "App\ModuleN\Repository\EntityNRepository:findOneByN".
+ * Lookups go through the same class / ':' / function walk the extension
+ * does, in a shuffled order; half of them miss on the method name. Sizes
+ * are the bytes asked from the allocator, without its own overhead.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* trie.h 是扩展里用的, 这里补上它用到的几个 Zend 定义 */
+#define zend_always_inline inline __attribute__((always_inline))
+#define ZEND_MM_ALIGNED_SIZE(size) (((size) + 7) & ~(size_t)7)
+#define pemalloc(size, persistent) malloc(size)
+#define pefree(ptr, persistent) free(ptr)
+#define ZSTR_VAL(zstr) ((zstr)->val)
+#define ZSTR_LEN(zstr) ((zstr)->len)
+typedef long zend_long;
+typedef struct zend_string {
+    size_t  len;
+    char   *val;
+} zend_string;
+
+#include "../trie.h"
+
+#define HP_BENCH_SPLIT_CHAR  ':'
+#define HP_BENCH_LOOKUPS     2000000
+
+/* ------------------------------------------------------------------------
+ * 替换之前的布局, 除了 emalloc 换成 malloc 以外照抄
+ * ------------------------------------------------------------------------ */
+
+#define HP_OLD_SUB_NODE_COUNT 127
+
+typedef struct hp_old_node {
+    struct hp_old_node *children[HP_OLD_SUB_NODE_COUNT];
+    int                 flag;
+    char                character;
+    zend_long           func_hash_index;
+} hp_old_node;
+
+static size_t hp_old_bytes;
+
+static hp_old_node *hp_old_node_create(char c) {
+    hp_old_node *n = (hp_old_node *)calloc(1, sizeof(hp_old_node));
+
+    n->character = c;
+    hp_old_bytes += sizeof(hp_old_node);
+    return n;
+}
+
+static void hp_old_add(hp_old_node *root, const char *str, zend_long func_hash_index) {
+    hp_old_node *ptr = root;
+
+    for (; *str; str++) {
+        if (!ptr->children[(int)*str]) {
+            ptr->children[(int)*str] = hp_old_node_create(*str);
+        }
+        ptr = ptr->children[(int)*str];
+    }
+    ptr->flag = 1;
+    ptr->func_hash_index = func_hash_index;
+}
+
+static zend_long hp_old_check_func(hp_old_node *root, zend_string *class_name, char split_char, zend_string *function_name) {
+    hp_old_node *ptr = root;
+    size_t i;
+
+    if (class_name != NULL) {
+        for (i = 0; i < ZSTR_LEN(class_name); i++) {
+            if (!ptr) {
+                return 0;
+            }
+            ptr = ptr->children[(int)class_name->val[i]];
+        }
+        if (!ptr) {
+            return 0;
+        }
+        ptr = ptr->children[(int)split_char];
+    }
+
+    for (i = 0; i < ZSTR_LEN(function_name); i++) {
+        if (!ptr) {
+            return 0;
+        }
+        ptr = ptr->children[(int)function_name->val[i]];
+    }
+
+    return (ptr && ptr->flag) ? ptr->func_hash_index : 0;
+}
+
+static void hp_old_free(hp_old_node *n) {
+    int i;
+
+    for (i = 0; i < HP_OLD_SUB_NODE_COUNT; i++) {
+        if (n->children[i]) {
+            hp_old_free(n->children[i]);
+        }
+    }
+    free(n);
+}
+
+/* ------------------------------------------------------------------------ */
+
+typedef struct hp_bench_lookup {
+    zend_string class_name;
+    zend_string function_name;
+} hp_bench_lookup;
+
+static uint64_t hp_bench_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static char *hp_bench_strdup(const char *fmt, uint32_t n) {
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf), fmt, n, n);
+
+    return strndup(buf, (size_t)len);
+}
+
+static void hp_bench_run(uint32_t key_num) {
+    char **keys = (char **)malloc(sizeof(char *) * key_num);
+    hp_trie_key *trie_keys = (hp_trie_key *)malloc(sizeof(hp_trie_key) * key_num);
+    hp_bench_lookup *lookups = (hp_bench_lookup *)malloc(sizeof(hp_bench_lookup) * key_num * 2);
+    char **names = (char **)malloc(sizeof(char *) * key_num * 3);
+    uint32_t lookup_num = key_num * 2;
+    hp_old_node *old_root;
+    hp_trie *trie;
+    uint64_t start, old_ns, new_ns;
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    zend_long sink = 0;
+    uint32_t i, round, rounds;
+
+    old_root = hp_old_node_create('$');
+    hp_old_bytes = sizeof(hp_old_node);
+
+    for (i = 0; i < key_num; i++) {
+        char *class_name = hp_bench_strdup("App\\Module%u\\Repository\\Entity%uRepository", i);
+        char *hit = hp_bench_strdup("findOneBy%u", i);
+        char *miss = hp_bench_strdup("findAllBy%u", i);
+        size_t class_len = strlen(class_name), hit_len = strlen(hit);
+
+        names[i * 3] = class_name;
+        names[i * 3 + 1] = hit;
+        names[i * 3 + 2] = miss;
+
+        keys[i] = (char *)malloc(class_len + 1 + hit_len + 1);
+        memcpy(keys[i], class_name, class_len);
+        keys[i][class_len] = HP_BENCH_SPLIT_CHAR;
+        memcpy(keys[i] + class_len + 1, hit, hit_len + 1);
+
+        trie_keys[i].str = keys[i];
+        trie_keys[i].len = class_len + 1 + hit_len;
+        trie_keys[i].func_hash_index = i + 1;
+        trie_keys[i].prefix = 0;
+        hp_old_add(old_root, keys[i], i + 1);
+
+        lookups[i * 2].class_name.val = class_name;
+        lookups[i * 2].class_name.len = class_len;
+        lookups[i * 2].function_name.val = hit;
+        lookups[i * 2].function_name.len = hit_len;
+        lookups[i * 2 + 1].class_name = lookups[i * 2].class_name;
+        lookups[i * 2 + 1].function_name.val = miss;
+        lookups[i * 2 + 1].function_name.len = strlen(miss);
+    }
+
+    trie = hp_trie_build(trie_keys, key_num, 1);
+    if (!trie) {
+        fprintf(stderr, "trie_layout: out of memory\n");
+        exit(1);
+    }
+
+    //打乱查找顺序, 免得按构建顺序访问节点
+    for (i = lookup_num - 1; i > 0; i--) {
+        uint32_t j;
+        hp_bench_lookup tmp;
+
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        j = (uint32_t)((seed >> 33) % (i + 1));
+        tmp = lookups[i];
+        lookups[i] = lookups[j];
+        lookups[j] = tmp;
+    }
+
+    //两边结果一致才有比较的意义
+    for (i = 0; i < lookup_num; i++) {
+        if (hp_old_check_func(old_root, &lookups[i].class_name, HP_BENCH_SPLIT_CHAR, &lookups[i].function_name)
+                != hp_trie_check_func(trie, &lookups[i].class_name, HP_BENCH_SPLIT_CHAR, &lookups[i].function_name)) {
+            fprintf(stderr, "trie_layout: layouts disagree on %s:%s\n",
+                    lookups[i].class_name.val, lookups[i].function_name.val);
+            exit(1);
+        }
+    }
+
+    rounds = HP_BENCH_LOOKUPS / lookup_num + 1;
+
+    start = hp_bench_now();
+    for (round = 0; round < rounds; round++) {
+        for (i = 0; i < lookup_num; i++) {
+            sink += hp_old_check_func(old_root, &lookups[i].class_name, HP_BENCH_SPLIT_CHAR, &lookups[i].function_name);
+        }
+    }
+    old_ns = hp_bench_now() - start;
+
+    start = hp_bench_now();
+    for (round = 0; round < rounds; round++) {
+        for (i = 0; i < lookup_num; i++) {
+            sink += hp_trie_check_func(trie, &lookups[i].class_name, HP_BENCH_SPLIT_CHAR, &lookups[i].function_name);
+        }
+    }
+    new_ns = hp_bench_now() - start;
+
+    printf("%6u %12zu %14.1f %12zu %14.1f\n", key_num,
+            hp_old_bytes, (double)old_ns / ((double)rounds * lookup_num),
+            trie->size, (double)new_ns / ((double)rounds * lookup_num));
+
+    if (sink == 42) {
+        printf("\n");
+    }
+
+    hp_old_free(old_root);
+    hp_trie_free(trie);
+    for (i = 0; i < key_num; i++) {
+        free(keys[i]);
+    }
+    for (i = 0; i < key_num * 3; i++) {
+        free(names[i]);
+    }
+    free(keys);
+    free(names);
+    free(trie_keys);
+    free(lookups);
+}
+
+int main(int argc, char **argv) {
+    static const uint32_t defaults[] = {100, 1000, 5000};
+    int i;
+
+    printf("%6s %12s %14s %12s %14s\n", "keys", "old bytes", "old ns/lookup", "new bytes", "new ns/lookup");
+
+    if (argc < 2) {
+        for (i = 0; i < (int)(sizeof(defaults) / sizeof(defaults[0])); i++) {
+            hp_bench_run(defaults[i]);
+        }
+        return 0;
+    }
+
+    for (i = 1; i < argc; i++) {
+        long key_num = strtol(argv[i], NULL, 10);
+
+        if (key_num <= 0) {
+            fprintf(stderr, "usage: trie_layout [KEYS ...]\n");
+            return 1;
+        }
+        hp_bench_run((uint32_t)key_num);
+    }
+
+    return 0;
+}
@@ -0,0 +1,80 @@
+<?php
+/**
+ * One benchmark run, started by bench/run.php in a fresh PHP process:
+ *
+ *   php workload.php <mode> <list_size> <depth> <kind> <iterations>
+ *
+ * Each iteration walks a chain of <depth> calls, functions bench_d0..bench_dN
+ * or methods BenchChain:d0..dN for kind "method". Only the innermost call is
+ * in the track list; the list is padded with names that are never called up
+ * to <list_size>, so the other calls exercise the untracked path.
+ *
+ * Prints one JSON object: elapsed ns, calls made, peak RSS.
+ */
+
+list(, $mode, $size, $depth, $kind, $iterations) = $argv;
+$size = (int)$size;
+$depth = max(1, (int)$depth);
+$iterations = (int)$iterations;
+
+$code = '';
+for ($i = 0; $i < $depth; $i++) {
+    $next = $i + 1 < $depth ? ($kind === 'method' ? "\$this->d" . ($i + 1) . "()" : "bench_d" . ($i + 1) . "()") : "1";
+    if ($kind === 'method') {
+        $code .= "public function d$i() { return $next; }\n";
+    } else {
+        $code .= "function bench_d$i() { return $next; }\n";
+    }
+}
+eval($kind === 'method' ? "class BenchChain {\n$code}" : $code);
+
+$leaf = $depth - 1;
+$functions = [$kind === 'method' ? "BenchChain:d$leaf" : "bench_d$leaf"];
+for ($i = 1; $i < $size; $i++) {
+    //一半函数一半方法, 和真实的列表差不多
+    $functions[] = $i % 2 ? "bench_fill_$i" : "BenchFill$i:run";
+}
+
+//none: 没有加载扩展, 作为基准
+if ($mode !== 'none') {
+    $algorithms = [
+        'empty' => XHPROF_ALGORITHM_HASH,
+        'hash'  => XHPROF_ALGORITHM_HASH,
+        'trie'  => XHPROF_ALGORITHM_TRIE,
+        'phf'   => defined('XHPROF_ALGORITHM_PHF') ? XHPROF_ALGORITHM_PHF : XHPROF_ALGORITHM_HASH,
+        'auto'  => defined('XHPROF_ALGORITHM_AUTO') ? XHPROF_ALGORITHM_AUTO : XHPROF_ALGORITHM_HASH,
+    ];
+
+    //empty: 抓取打开, 但没有任何函数要抓
+    xhprof_enable($algorithms[$mode], $mode === 'empty' ? [] : ['track_functions' => $functions]);
+}
+
+$obj = $kind === 'method' ? new BenchChain() : null;
+$clock = function_exists('hrtime') ? function () { return hrtime(true); } : function () { return (int)(microtime(true) * 1e9); };
+
+$start = $clock();
+if ($obj) {
+    for ($i = 0; $i < $iterations; $i++) {
+        $obj->d0();
+    }
+} else {
+    for ($i = 0; $i < $iterations; $i++) {
+        bench_d0();
+    }
+}
+$elapsed = $clock() - $start;
+
+$tracked = 0;
+if ($mode !== 'none') {
+    $data = xhprof_disable();
+    $tracked = isset($data[$functions[0]]['ct']) ? $data[$functions[0]]['ct'] : 0;
+}
+
+$usage = getrusage();
+
+echo json_encode([
+    'elapsed_ns' => $elapsed,
+    'calls'      => $iterations * $depth,
+    'tracked'    => $tracked,
+    'rss_kb'     => $usage['ru_maxrss'],
+]), "\n";
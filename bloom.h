@@ -0,0 +1,140 @@
+
+#ifndef PHP_XHPROF_BLOOM
+#define PHP_XHPROF_BLOOM
+
+#include <stdint.h>
+#include <string.h>
+
+/* 编译时带 -mavx2 (或 -march=native) 用 AVX2, 否则 x86-64 上用 SSE2 */
+#if defined(__AVX2__)
+# include <immintrin.h>
+# define HP_BLOOM_AVX2 1
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+# define HP_BLOOM_SSE2 1
+#endif
+
+/* 每个 key 16 位, 误判率约 0.1% */
+#define HP_BLOOM_BITS_PER_KEY 16
+/* 最多 16KB, 半个 L1d, 更多的 key 只会让误判率升高 */
+#define HP_BLOOM_MAX_BLOCKS   512
+
+/**
+ * Split block Bloom filter over 64 bit keys (the layout Impala and Parquet
+ * use).
+ *
+ * The filter is an array of 256 bit blocks; the high half of a key picks a
+ * block and the low half sets one bit in each of its eight 32 bit words, the
+ * bit number being the top 5 bits of the low half times a per-word odd salt.
+ * A query therefore touches a single 32 byte, cache line aligned block and
+ * is eight multiplies, shifts and one all-bits-set test, which is one
+ * instruction each with AVX2.
+ *
+ * There are no false negatives, so a "no" is final; a "maybe" goes on to
+ * the real lookup.
+ */
+typedef struct hp_bloom_block {
+    uint32_t    words[8];
+} hp_bloom_block;
+
+typedef struct hp_bloom {
+    uint32_t        block_mask;     /* 块数 - 1, 块数是 2 的幂 */
+    int             persistent;
+    void           *raw;            /* 对齐前的地址, 用于释放 */
+    hp_bloom_block *blocks;         /* 按 cache line 对齐 */
+} hp_bloom;
+
+static const uint32_t hp_bloom_salt[8] __attribute__((aligned(32))) = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+static zend_always_inline const hp_bloom_block *hp_bloom_block_of(const hp_bloom *bloom, uint64_t key) {
+    return &bloom->blocks[(uint32_t)(key >> 32) & bloom->block_mask];
+}
+
+static hp_bloom *hp_bloom_create(uint32_t key_num, int persistent) {
+    hp_bloom *bloom;
+    uint32_t block_num = 1;
+
+    while (block_num < HP_BLOOM_MAX_BLOCKS && (uint64_t)block_num * 256 < (uint64_t)key_num * HP_BLOOM_BITS_PER_KEY) {
+        block_num <<= 1;
+    }
+
+    bloom = (hp_bloom *)pemalloc(sizeof(hp_bloom), persistent);
+    bloom->persistent = persistent;
+    bloom->block_mask = block_num - 1;
+    bloom->raw = pecalloc(1, sizeof(hp_bloom_block) * block_num + 63, persistent);
+    bloom->blocks = (hp_bloom_block *)(((uintptr_t)bloom->raw + 63) & ~(uintptr_t)63);
+
+    return bloom;
+}
+
+static void hp_bloom_add(hp_bloom *bloom, uint64_t key) {
+    hp_bloom_block *block = (hp_bloom_block *)hp_bloom_block_of(bloom, key);
+    uint32_t h = (uint32_t)key;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        block->words[i] |= (uint32_t)1 << ((h * hp_bloom_salt[i]) >> 27);
+    }
+}
+
+/* 0: key 一定不在集合里 */
+static zend_always_inline int hp_bloom_maybe(const hp_bloom *bloom, uint64_t key) {
+    const hp_bloom_block *block = hp_bloom_block_of(bloom, key);
+
+#if defined(HP_BLOOM_AVX2)
+    __m256i h = _mm256_set1_epi32((int)(uint32_t)key);
+    __m256i bit = _mm256_srli_epi32(_mm256_mullo_epi32(h, _mm256_load_si256((const __m256i *)hp_bloom_salt)), 27);
+    __m256i mask = _mm256_sllv_epi32(_mm256_set1_epi32(1), bit);
+
+    //(~block & mask) == 0
+    return _mm256_testc_si256(_mm256_load_si256((const __m256i *)block), mask);
+
+#elif defined(HP_BLOOM_SSE2)
+    //SSE2 没有 32 位的 mullo 和按元素移位: 乘法拆成奇偶两次 _mm_mul_epu32,
+    //1 << bit 用浮点数的指数得到 (2^31 转换溢出得到的 0x80000000 正好也对)
+    __m128i h = _mm_set1_epi32((int)(uint32_t)key);
+    __m128i miss = _mm_setzero_si128();
+    int half;
+
+    for (half = 0; half < 2; half++) {
+        __m128i salt = _mm_load_si128((const __m128i *)(hp_bloom_salt + half * 4));
+        __m128i even = _mm_mul_epu32(h, salt);
+        __m128i odd = _mm_mul_epu32(h, _mm_srli_epi64(salt, 32));
+        __m128i prod = _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+        __m128i bit = _mm_srli_epi32(prod, 27);
+        __m128i mask = _mm_cvttps_epi32(_mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(bit, _mm_set1_epi32(127)), 23)));
+
+        miss = _mm_or_si128(miss, _mm_andnot_si128(_mm_load_si128((const __m128i *)(block->words + half * 4)), mask));
+    }
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi32(miss, _mm_setzero_si128())) == 0xFFFF;
+
+#else
+    uint32_t h = (uint32_t)key;
+    uint32_t miss = 0;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        uint32_t m = (uint32_t)1 << ((h * hp_bloom_salt[i]) >> 27);
+        miss |= m & ~block->words[i];
+    }
+
+    return miss == 0;
+#endif
+}
+
+static void hp_bloom_free(hp_bloom *bloom) {
+    if (bloom) {
+        pefree(bloom->raw, bloom->persistent);
+        pefree(bloom, bloom->persistent);
+    }
+}
+
+#undef HP_BLOOM_BITS_PER_KEY
+#undef HP_BLOOM_MAX_BLOCKS
+
+#endif
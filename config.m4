@@ -3,6 +3,30 @@ PHP_ARG_ENABLE(xhprof, whether to enable xhprof support,
 
 if test "$PHP_XHPROF" != "no"; then
   PHP_NEW_EXTENSION(xhprof, xhprof.c, $ext_shared)
+
+  dnl xhprof_sample_enable() 用 timer_create(), 老的 glibc 在 librt 里
+  AC_CHECK_FUNC(timer_create, [
+    AC_DEFINE(HAVE_TIMER_CREATE, 1, [Whether timer_create() is available])
+  ], [
+    PHP_CHECK_LIBRARY(rt, timer_create, [
+      PHP_ADD_LIBRARY(rt, 1, XHPROF_SHARED_LIBADD)
+      AC_DEFINE(HAVE_TIMER_CREATE, 1, [Whether timer_create() is available])
+    ])
+  ])
+
+  dnl xhprof.dump 的写线程, 新的 glibc 在 libc 里
+  AC_CHECK_FUNC(pthread_create, [
+    AC_DEFINE(HAVE_PTHREAD_CREATE, 1, [Whether pthread_create() is available])
+  ], [
+    PHP_CHECK_LIBRARY(pthread, pthread_create, [
+      PHP_ADD_LIBRARY(pthread, 1, XHPROF_SHARED_LIBADD)
+      AC_DEFINE(HAVE_PTHREAD_CREATE, 1, [Whether pthread_create() is available])
+    ])
+  ])
+  PHP_SUBST(XHPROF_SHARED_LIBADD)
+
+  dnl make bench
+  PHP_ADD_MAKEFRAGMENT
 fi
 
 if test -z "$PHP_DEBUG" ; then
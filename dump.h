@@ -0,0 +1,653 @@
+
+#ifndef PHP_XHPROF_DUMP
+#define PHP_XHPROF_DUMP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* 文件格式的版本, 改格式时加一 */
+#define HP_DUMP_VERSION      1
+/* 攒够这么多字节或者等了 HP_DUMP_FLUSH_MS 之后写一次 */
+#define HP_DUMP_BATCH_BYTES  (64 * 1024)
+#define HP_DUMP_FLUSH_MS     1000
+/* 写线程跟不上时最多积压这么多字节, 再多的请求直接丢弃, 请求从不等待 */
+#define HP_DUMP_QUEUE_MAX    (16 * 1024 * 1024)
+
+/**
+ * Binary dump of per request counters (xhprof.dump).
+ *
+ * The request thread only copies its rows, names included, into one
+ * malloc'd hp_dump_batch and queues it (hp_dump_submit()); a writer thread,
+ * one per process, does the encoding and appends to
+ * <output_dir>/xhprof.<pid>.xhpb. Nothing on the request path encodes,
+ * allocates from the Zend heap, takes a lock for longer than a list push,
+ * or touches the file.
+ *
+ * File layout, all integers are unsigned LEB128 varints, signed values are
+ * zigzag encoded first:
+ *
+ *     file    := session*
+ *     session := "XHPB" version:u8 key_num (len bytes){key_num} record*
+ *     record  := 'S' count (len bytes){count}
+ *              | 'R' time_us flags key_mask row_num row{row_num}
+ *     row     := name_id zigzag(value){popcount(key_mask)}
+ *
+ * A session starts whenever a process opens the file, so a file appended
+ * to by several processes (pid reuse) stays readable. The session header
+ * names the metrics; bit i of key_mask is the i-th of them. Names are
+ * numbered from 0 in the order of the 'S' records of the session, every
+ * name is written once per session, before the first 'R' using it.
+ *
+ * tools/xhprof_agg.c reads this format; keep the two in step.
+ */
+typedef struct hp_dump_batch {
+    struct hp_dump_batch   *next;
+    size_t                  len;        /* data 里已用的字节 */
+    size_t                  cap;
+    uint64_t                time_us;
+    uint32_t                flags;
+    uint32_t                row_num;
+    /* row_num 个: uint32 name_len, name, int64 values[key_num] (不对齐) */
+    char                    data[1];
+} hp_dump_batch;
+
+/* 变长的输出缓冲区, 写线程里用, 不能用 Zend 的内存分配 */
+typedef struct hp_dump_buf {
+    char       *data;
+    size_t      len;
+    size_t      cap;
+    int         oom;            /* 扩容失败过, 之后的写入都被忽略 */
+} hp_dump_buf;
+
+/* 写线程的字符串表: 名字 => 编号, 开放寻址 */
+typedef struct hp_dump_name {
+    uint64_t    hash;
+    char       *name;           /* NULL 为空槽位 */
+    uint32_t    len;
+    uint32_t    id;
+} hp_dump_name;
+
+typedef struct hp_dump_state {
+    pid_t               pid;            /* 写线程所在的进程, fork 之后不相等 */
+    int                 running;
+    int                 stop;
+    pthread_t           thread;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+    hp_dump_batch      *head;           /* 待写的请求, 先进先出 */
+    hp_dump_batch      *tail;
+    size_t              pending_bytes;
+    uint64_t            dropped;        /* 积压太多、内存不够或写文件出错丢弃的请求数, 用 hp_dump_drop() 加 */
+
+    /* 配置, MINIT 时设置 */
+    char               *dir;
+    uint32_t            key_num;
+    char              **key_names;
+
+    /* 以下只有写线程访问 */
+    int                 fd;
+    hp_dump_name       *names;
+    uint32_t            name_mask;      /* 槽位数 - 1 */
+    uint32_t            name_num;
+} hp_dump_state;
+
+static hp_dump_state hp_dump;
+/* 只保护 hp_dump_submit() 里 fork 之后的重新初始化, ZTS 下可能几个线程同时遇到 */
+static pthread_mutex_t hp_dump_start_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* 请求线程和写线程都会丢弃, 不一定拿着 hp_dump.mutex */
+static void hp_dump_drop(uint64_t num) {
+    __atomic_fetch_add(&hp_dump.dropped, num, __ATOMIC_RELAXED);
+}
+
+/* 返回 0 时 buf 没有变, 并且标记 oom */
+static int hp_dump_buf_reserve(hp_dump_buf *buf, size_t more) {
+    if (buf->oom) {
+        return 0;
+    }
+    if (buf->len + more > buf->cap) {
+        size_t cap = buf->cap ? buf->cap * 2 : 4096;
+        char *data;
+
+        while (cap < buf->len + more) {
+            cap *= 2;
+        }
+        data = (char *)realloc(buf->data, cap);
+        if (!data) {
+            buf->oom = 1;
+            return 0;
+        }
+        buf->data = data;
+        buf->cap = cap;
+    }
+    return 1;
+}
+
+static zend_always_inline void hp_dump_varint(hp_dump_buf *buf, uint64_t v) {
+    if (!hp_dump_buf_reserve(buf, 10)) {
+        return;
+    }
+    while (v >= 0x80) {
+        buf->data[buf->len++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    buf->data[buf->len++] = (char)v;
+}
+
+static zend_always_inline void hp_dump_zigzag(hp_dump_buf *buf, int64_t v) {
+    hp_dump_varint(buf, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static void hp_dump_bytes(hp_dump_buf *buf, const char *str, size_t len) {
+    hp_dump_varint(buf, len);
+    if (!hp_dump_buf_reserve(buf, len)) {
+        return;
+    }
+    memcpy(buf->data + buf->len, str, len);
+    buf->len += len;
+}
+
+static void hp_dump_config_free() {
+    uint32_t i;
+
+    if (hp_dump.key_names) {
+        for (i = 0; i < hp_dump.key_num; i++) {
+            free(hp_dump.key_names[i]);
+        }
+        free(hp_dump.key_names);
+    }
+    free(hp_dump.dir);
+    hp_dump.key_names = NULL;
+    hp_dump.key_num = 0;
+    hp_dump.dir = NULL;
+}
+
+/**
+ * Called from MINIT: remember where and what to write. The thread is
+ * started by the first hp_dump_submit() of each process, after the fork.
+ *
+ * @return 0 when out of memory, the dump stays off
+ */
+static int hp_dump_init(const char *dir, const char **key_names, uint32_t key_num) {
+    uint32_t i;
+
+    memset(&hp_dump, 0, sizeof(hp_dump));
+    hp_dump.fd = -1;
+    hp_dump.dir = strdup(dir);
+    hp_dump.key_num = key_num;
+    hp_dump.key_names = (char **)calloc(key_num, sizeof(char *));
+    if (!hp_dump.dir || !hp_dump.key_names) {
+        hp_dump_config_free();
+        return 0;
+    }
+    for (i = 0; i < key_num; i++) {
+        hp_dump.key_names[i] = strdup(key_names[i]);
+        if (!hp_dump.key_names[i]) {
+            hp_dump_config_free();
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* 批量的原始数据, 请求线程里用; 内存不够时返回 NULL, 这个请求记为丢弃 */
+static hp_dump_batch *hp_dump_batch_new(size_t cap, uint32_t flags) {
+    hp_dump_batch *batch = (hp_dump_batch *)malloc(sizeof(hp_dump_batch) + cap);
+    struct timeval now;
+
+    if (!batch) {
+        hp_dump_drop(1);
+        return NULL;
+    }
+
+    gettimeofday(&now, NULL);
+    batch->next = NULL;
+    batch->len = 0;
+    batch->cap = cap;
+    batch->time_us = (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+    batch->flags = flags;
+    batch->row_num = 0;
+
+    return batch;
+}
+
+/* 可能换地址, 用返回值; 内存不够时释放 batch, 记为丢弃, 返回 NULL */
+static hp_dump_batch *hp_dump_batch_row(hp_dump_batch *batch, const char *name, uint32_t len, const zend_long *values) {
+    size_t need = sizeof(uint32_t) + len + sizeof(int64_t) * hp_dump.key_num;
+    uint32_t i;
+    char *p;
+
+    if (batch->len + need > batch->cap) {
+        size_t cap = (batch->len + need) * 2;
+        hp_dump_batch *grown = (hp_dump_batch *)realloc(batch, sizeof(hp_dump_batch) + cap);
+
+        if (!grown) {
+            free(batch);
+            hp_dump_drop(1);
+            return NULL;
+        }
+        batch = grown;
+        batch->cap = cap;
+    }
+
+    p = batch->data + batch->len;
+    memcpy(p, &len, sizeof(uint32_t));
+    memcpy(p + sizeof(uint32_t), name, len);
+    p += sizeof(uint32_t) + len;
+    for (i = 0; i < hp_dump.key_num; i++) {
+        int64_t v = (int64_t)values[i];
+        memcpy(p + i * sizeof(int64_t), &v, sizeof(int64_t));
+    }
+
+    batch->len += need;
+    batch->row_num++;
+
+    return batch;
+}
+
+/* 写线程: 名字的编号, 新名字追加到 strings 里; 内存不够时标记 strings->oom */
+static uint32_t hp_dump_intern(const char *name, uint32_t len, hp_dump_buf *strings, uint32_t *new_num) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    uint32_t i, pos;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 0x100000001b3ULL;
+    }
+
+    if (!hp_dump.names || hp_dump.name_num * 2 >= hp_dump.name_mask + 1) {
+        //扩容, 最多一半满
+        uint32_t old_size = hp_dump.names ? hp_dump.name_mask + 1 : 0;
+        uint32_t size = old_size ? old_size * 2 : 256;
+        hp_dump_name *old = hp_dump.names;
+        hp_dump_name *names = (hp_dump_name *)calloc(size, sizeof(hp_dump_name));
+
+        if (!names) {
+            strings->oom = 1;
+            return 0;
+        }
+        hp_dump.names = names;
+        hp_dump.name_mask = size - 1;
+        for (i = 0; i < old_size; i++) {
+            if (old[i].name) {
+                pos = (uint32_t)old[i].hash & hp_dump.name_mask;
+                while (hp_dump.names[pos].name) {
+                    pos = (pos + 1) & hp_dump.name_mask;
+                }
+                hp_dump.names[pos] = old[i];
+            }
+        }
+        free(old);
+    }
+
+    pos = (uint32_t)hash & hp_dump.name_mask;
+    while (hp_dump.names[pos].name) {
+        hp_dump_name *slot = &hp_dump.names[pos];
+
+        if (slot->hash == hash && slot->len == len && memcmp(slot->name, name, len) == 0) {
+            return slot->id;
+        }
+        pos = (pos + 1) & hp_dump.name_mask;
+    }
+
+    hp_dump.names[pos].name = (char *)malloc(len ? len : 1);
+    if (!hp_dump.names[pos].name) {
+        strings->oom = 1;
+        return 0;
+    }
+    hp_dump.names[pos].hash = hash;
+    memcpy(hp_dump.names[pos].name, name, len);
+    hp_dump.names[pos].len = len;
+    hp_dump.names[pos].id = hp_dump.name_num++;
+
+    hp_dump_bytes(strings, name, len);
+    (*new_num)++;
+
+    return hp_dump.names[pos].id;
+}
+
+static void hp_dump_names_reset() {
+    uint32_t i;
+
+    if (hp_dump.names) {
+        for (i = 0; i <= hp_dump.name_mask; i++) {
+            free(hp_dump.names[i].name);
+        }
+        free(hp_dump.names);
+    }
+    hp_dump.names = NULL;
+    hp_dump.name_mask = 0;
+    hp_dump.name_num = 0;
+}
+
+/* 写线程: 结束当前 session, 下一个请求重新打开文件, 重新登记名字 */
+static void hp_dump_close() {
+    if (hp_dump.fd >= 0) {
+        close(hp_dump.fd);
+        hp_dump.fd = -1;
+    }
+    hp_dump_names_reset();
+}
+
+/* 写线程: 打开文件, 开始一个 session */
+static int hp_dump_open(hp_dump_buf *out) {
+    char path[4096];
+    uint32_t i;
+
+    snprintf(path, sizeof(path), "%s/xhprof.%d.xhpb", hp_dump.dir, (int)getpid());
+    hp_dump.fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (hp_dump.fd < 0) {
+        return 0;
+    }
+
+    hp_dump_names_reset();
+
+    if (!hp_dump_buf_reserve(out, 5)) {
+        return 1;
+    }
+    memcpy(out->data + out->len, "XHPB", 4);
+    out->data[out->len + 4] = HP_DUMP_VERSION;
+    out->len += 5;
+    hp_dump_varint(out, hp_dump.key_num);
+    for (i = 0; i < hp_dump.key_num; i++) {
+        hp_dump_bytes(out, hp_dump.key_names[i], strlen(hp_dump.key_names[i]));
+    }
+
+    return 1;
+}
+
+/* 写线程: 编码一个请求, 新出现的名字先写一条 'S' */
+static void hp_dump_encode(hp_dump_buf *out, const hp_dump_batch *batch, hp_dump_buf *strings, hp_dump_buf *rows) {
+    uint64_t mask = 0;
+    uint32_t new_num = 0, r, i;
+    const char *p;
+
+    strings->len = 0;
+    rows->len = 0;
+
+    //只写有值的指标
+    for (p = batch->data, r = 0; r < batch->row_num; r++) {
+        uint32_t len;
+
+        memcpy(&len, p, sizeof(uint32_t));
+        p += sizeof(uint32_t) + len;
+        for (i = 0; i < hp_dump.key_num && i < 64; i++) {
+            int64_t v;
+
+            memcpy(&v, p + i * sizeof(int64_t), sizeof(int64_t));
+            if (v) {
+                mask |= (uint64_t)1 << i;
+            }
+        }
+        p += sizeof(int64_t) * hp_dump.key_num;
+    }
+
+    for (p = batch->data, r = 0; r < batch->row_num; r++) {
+        uint32_t len;
+
+        memcpy(&len, p, sizeof(uint32_t));
+        hp_dump_varint(rows, hp_dump_intern(p + sizeof(uint32_t), len, strings, &new_num));
+        p += sizeof(uint32_t) + len;
+        for (i = 0; i < hp_dump.key_num && i < 64; i++) {
+            if (mask & ((uint64_t)1 << i)) {
+                int64_t v;
+
+                memcpy(&v, p + i * sizeof(int64_t), sizeof(int64_t));
+                hp_dump_zigzag(rows, v);
+            }
+        }
+        p += sizeof(int64_t) * hp_dump.key_num;
+    }
+
+    //名字表或中间缓冲区分配失败, 由调用方丢弃这个请求
+    if (strings->oom || rows->oom) {
+        out->oom = 1;
+        return;
+    }
+
+    if (new_num) {
+        if (!hp_dump_buf_reserve(out, 1)) {
+            return;
+        }
+        out->data[out->len++] = 'S';
+        hp_dump_varint(out, new_num);
+        if (!hp_dump_buf_reserve(out, strings->len)) {
+            return;
+        }
+        memcpy(out->data + out->len, strings->data, strings->len);
+        out->len += strings->len;
+    }
+
+    if (!hp_dump_buf_reserve(out, 1)) {
+        return;
+    }
+    out->data[out->len++] = 'R';
+    hp_dump_varint(out, batch->time_us);
+    hp_dump_varint(out, batch->flags);
+    hp_dump_varint(out, mask);
+    hp_dump_varint(out, batch->row_num);
+    if (!hp_dump_buf_reserve(out, rows->len)) {
+        return;
+    }
+    memcpy(out->data + out->len, rows->data, rows->len);
+    out->len += rows->len;
+}
+
+/**
+ * Write the num requests encoded in out. On an error other than EINTR
+ * (disk full, ...) the file is cut back to where this write started and
+ * the session is closed: the names these requests interned never reached
+ * the file, so the next request starts a new session instead of pointing
+ * at name_ids the reader has not seen. The num requests count as dropped.
+ */
+static void hp_dump_write(const hp_dump_buf *out, uint32_t num) {
+    size_t done = 0;
+    off_t start;
+
+    if (!out->len) {
+        return;
+    }
+
+    start = lseek(hp_dump.fd, 0, SEEK_END);
+
+    while (done < out->len) {
+        ssize_t n = write(hp_dump.fd, out->data + done, out->len - done);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            //截不回去 (很少见) 时文件停在写了一半的请求上, 读取端把它当成截断的结尾
+            if (start >= 0 && ftruncate(hp_dump.fd, start) < 0) {
+                start = -1;
+            }
+            hp_dump_close();
+            hp_dump_drop(num);
+            return;
+        }
+        done += (size_t)n;
+    }
+}
+
+static void *hp_dump_thread(void *arg) {
+    hp_dump_buf out = {NULL, 0, 0}, strings = {NULL, 0, 0}, rows = {NULL, 0, 0};
+    uint32_t out_num;
+
+    pthread_mutex_lock(&hp_dump.mutex);
+
+    for (;;) {
+        hp_dump_batch *batch;
+        struct timespec until;
+        int waiting = 0;
+
+        //攒一批再写, 退出时把剩下的写完; 从队列里有第一个请求开始最多等 HP_DUMP_FLUSH_MS
+        while (!hp_dump.stop && hp_dump.pending_bytes < HP_DUMP_BATCH_BYTES) {
+            if (!hp_dump.head) {
+                pthread_cond_wait(&hp_dump.cond, &hp_dump.mutex);
+                continue;
+            }
+
+            if (!waiting) {
+                struct timeval now;
+
+                gettimeofday(&now, NULL);
+                until.tv_sec = now.tv_sec + HP_DUMP_FLUSH_MS / 1000;
+                until.tv_nsec = now.tv_usec * 1000 + (HP_DUMP_FLUSH_MS % 1000) * 1000000;
+                if (until.tv_nsec >= 1000000000) {
+                    until.tv_sec++;
+                    until.tv_nsec -= 1000000000;
+                }
+                waiting = 1;
+            }
+            if (pthread_cond_timedwait(&hp_dump.cond, &hp_dump.mutex, &until) == ETIMEDOUT) {
+                break;
+            }
+        }
+
+        batch = hp_dump.head;
+        hp_dump.head = hp_dump.tail = NULL;
+        hp_dump.pending_bytes = 0;
+
+        if (!batch && hp_dump.stop) {
+            break;
+        }
+
+        pthread_mutex_unlock(&hp_dump.mutex);
+
+        out.len = 0;
+        out_num = 0;
+        while (batch) {
+            hp_dump_batch *next = batch->next;
+            size_t mark = out.len;
+
+            if (hp_dump.fd < 0 && !hp_dump_open(&out)) {
+                hp_dump_drop(1);
+            } else {
+                hp_dump_encode(&out, batch, &strings, &rows);
+
+                if (out.oom || strings.oom || rows.oom) {
+                    //名字表里可能已经有没写出去的名字: 写完之前的请求, 关掉文件, 下一个请求从新的 session 开始
+                    out.len = mark;
+                    out.oom = strings.oom = rows.oom = 0;
+                    hp_dump_write(&out, out_num);
+                    out.len = 0;
+                    out_num = 0;
+                    hp_dump_close();
+                    hp_dump_drop(1);
+                } else {
+                    out_num++;
+                }
+            }
+
+            free(batch);
+            batch = next;
+        }
+        if (hp_dump.fd >= 0) {
+            hp_dump_write(&out, out_num);
+        }
+
+        pthread_mutex_lock(&hp_dump.mutex);
+    }
+
+    pthread_mutex_unlock(&hp_dump.mutex);
+
+    hp_dump_close();
+    free(out.data);
+    free(strings.data);
+    free(rows.data);
+
+    return NULL;
+}
+
+/**
+ * Start the writer of this process. Also run in a forked child, which
+ * inherits the parent's queue, file and lock state but not its thread.
+ */
+static void hp_dump_start(pid_t pid) {
+    hp_dump_batch *old = hp_dump.head;
+
+    while (old) {
+        hp_dump_batch *next = old->next;
+        free(old);
+        old = next;
+    }
+    hp_dump_close();
+    hp_dump.head = hp_dump.tail = NULL;
+    hp_dump.pending_bytes = 0;
+    hp_dump.stop = 0;
+    hp_dump.running = 0;
+
+    pthread_mutex_init(&hp_dump.mutex, NULL);
+    pthread_cond_init(&hp_dump.cond, NULL);
+    if (pthread_create(&hp_dump.thread, NULL, hp_dump_thread, NULL) == 0) {
+        hp_dump.running = 1;
+    }
+
+    __atomic_store_n(&hp_dump.pid, pid, __ATOMIC_RELEASE);
+}
+
+/**
+ * Queue one request's batch; takes ownership of it. Starts the writer
+ * thread on the first call of the process. Never waits for I/O: when the
+ * writer is behind by HP_DUMP_QUEUE_MAX bytes the batch is dropped.
+ */
+static void hp_dump_submit(hp_dump_batch *batch) {
+    pid_t pid = getpid();
+
+    if (__atomic_load_n(&hp_dump.pid, __ATOMIC_ACQUIRE) != pid) {
+        pthread_mutex_lock(&hp_dump_start_mutex);
+        if (hp_dump.pid != pid) {
+            hp_dump_start(pid);
+        }
+        pthread_mutex_unlock(&hp_dump_start_mutex);
+    }
+
+    if (!hp_dump.running) {
+        free(batch);
+        return;
+    }
+
+    pthread_mutex_lock(&hp_dump.mutex);
+    if (hp_dump.pending_bytes + batch->len > HP_DUMP_QUEUE_MAX) {
+        hp_dump_drop(1);
+        pthread_mutex_unlock(&hp_dump.mutex);
+        free(batch);
+        return;
+    }
+    if (hp_dump.tail) {
+        hp_dump.tail->next = batch;
+    } else {
+        hp_dump.head = batch;
+    }
+    hp_dump.tail = batch;
+    hp_dump.pending_bytes += batch->len;
+    pthread_cond_signal(&hp_dump.cond);
+    pthread_mutex_unlock(&hp_dump.mutex);
+}
+
+/* MSHUTDOWN: 写完积压的请求, 停掉写线程 */
+static void hp_dump_shutdown() {
+    if (hp_dump.running && hp_dump.pid == getpid()) {
+        pthread_mutex_lock(&hp_dump.mutex);
+        hp_dump.stop = 1;
+        pthread_cond_signal(&hp_dump.cond);
+        pthread_mutex_unlock(&hp_dump.mutex);
+        pthread_join(hp_dump.thread, NULL);
+        hp_dump.running = 0;
+    }
+
+    hp_dump_config_free();
+}
+
+#undef HP_DUMP_BATCH_BYTES
+#undef HP_DUMP_FLUSH_MS
+#undef HP_DUMP_QUEUE_MAX
+
+#endif
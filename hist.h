@@ -0,0 +1,99 @@
+
+#ifndef PHP_XHPROF_HIST
+#define PHP_XHPROF_HIST
+
+#include <stdint.h>
+#include <string.h>
+
+/* 每个 2 的幂区间分成 16 个线性子桶, 相对误差不超过 1/16 */
+#define HP_HIST_SUB_BITS   4
+#define HP_HIST_SUB_COUNT  (1 << HP_HIST_SUB_BITS)
+/* 能区分的最大值 2^42 (纳秒约 73 分钟), 更大的值记在最后一个桶 */
+#define HP_HIST_MAX_BITS   42
+#define HP_HIST_BUCKETS    ((HP_HIST_MAX_BITS - HP_HIST_SUB_BITS + 1) * HP_HIST_SUB_COUNT)
+
+/**
+ * Log-linear (HDR style) histogram of non-negative integer values.
+ *
+ * Values below HP_HIST_SUB_COUNT get a bucket each; above that every power
+ * of two [2^e, 2^(e+1)) is split into HP_HIST_SUB_COUNT equal buckets. The
+ * bucket index is the position of the highest set bit plus the next
+ * HP_HIST_SUB_BITS bits, so recording is a 'clz', a shift and an increment.
+ *
+ * Bucket boundaries don't depend on the data, so histograms of the same
+ * layout are merged by adding counts bucket by bucket.
+ */
+typedef struct hp_hist {
+    uint64_t    total;                      /* 记录的值的个数 */
+    uint64_t    max;                        /* 精确的最大值 */
+    uint32_t    counts[HP_HIST_BUCKETS];
+} hp_hist;
+
+static zend_always_inline uint32_t hp_hist_index(uint64_t value) {
+    uint32_t e, index;
+
+    if (value < HP_HIST_SUB_COUNT) {
+        return (uint32_t)value;
+    }
+
+    e = 63 - (uint32_t)__builtin_clzll(value);
+    index = ((e - HP_HIST_SUB_BITS + 1) << HP_HIST_SUB_BITS)
+        + (uint32_t)((value >> (e - HP_HIST_SUB_BITS)) & (HP_HIST_SUB_COUNT - 1));
+
+    return index < HP_HIST_BUCKETS ? index : HP_HIST_BUCKETS - 1;
+}
+
+/* 桶的下界 (包含) */
+static zend_always_inline uint64_t hp_hist_lower(uint32_t index) {
+    uint32_t group = index >> HP_HIST_SUB_BITS;
+
+    if (!group) {
+        return index;
+    }
+    return (uint64_t)(HP_HIST_SUB_COUNT + (index & (HP_HIST_SUB_COUNT - 1))) << (group - 1);
+}
+
+/* 桶的上界 (不包含) */
+static zend_always_inline uint64_t hp_hist_upper(uint32_t index) {
+    uint32_t group = index >> HP_HIST_SUB_BITS;
+
+    return hp_hist_lower(index) + (group ? (uint64_t)1 << (group - 1) : 1);
+}
+
+static zend_always_inline void hp_hist_record(hp_hist *hist, uint64_t value) {
+    hist->counts[hp_hist_index(value)]++;
+    hist->total++;
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+/**
+ * Value at quantile q (0 < q <= 1): the largest value of the bucket holding
+ * the ceil(q * total)-th smallest value, capped by the exact maximum.
+ */
+static uint64_t hp_hist_percentile(const hp_hist *hist, double q) {
+    uint64_t rank, seen = 0;
+    uint32_t i;
+
+    if (!hist->total) {
+        return 0;
+    }
+
+    rank = (uint64_t)(q * (double)hist->total + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    for (i = 0; i < HP_HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            uint64_t value = hp_hist_upper(i) - 1;
+            return value < hist->max ? value : hist->max;
+        }
+    }
+
+    return hist->max;
+}
+
+#endif
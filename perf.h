@@ -0,0 +1,208 @@
+
+#ifndef PHP_XHPROF_PERF
+#define PHP_XHPROF_PERF
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+# include <linux/perf_event.h>
+# include <sys/syscall.h>
+# include <sys/mman.h>
+# include <sys/ioctl.h>
+# define HP_HAVE_PERF 1
+#endif
+
+#define hp_perf_barrier() __asm__ __volatile__("" ::: "memory")
+
+/* XHPROF_FLAGS_PERF 统计的硬件计数器个数, 见 hp_perf_counter_open() */
+#define HP_PERF_COUNTER_NUM 4
+
+/**
+ * A perf event opened for the calling thread, with its first mmap page.
+ *
+ * The page lets a thread read its own counters without a syscall: the
+ * kernel publishes time_enabled plus a TSC based extrapolation for time
+ * (cap_user_time), and the hardware counter index for 'rdpmc'
+ * (cap_user_rdpmc). Both are read under the page's seqlock.
+ */
+typedef struct hp_perf_event {
+    int     fd;
+    void   *page;     /* struct perf_event_mmap_page */
+} hp_perf_event;
+
+static zend_always_inline uint64_t hp_perf_rdtsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+#else
+    return 0;
+#endif
+}
+
+static zend_always_inline uint64_t hp_perf_rdpmc(uint32_t counter) {
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdpmc" : "=a" (lo), "=d" (hi) : "c" (counter));
+    return ((uint64_t)hi << 32) | lo;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Open a counting event (type/config as in perf_event_attr) on the calling
+ * thread. Returns 0 on success, -1 when perf events are unavailable
+ * (kernel.perf_event_paranoid, seccomp in containers, no PMU...).
+ */
+static int hp_perf_event_open(hp_perf_event *ev, uint32_t type, uint64_t config) {
+#ifdef HP_HAVE_PERF
+    struct perf_event_attr attr;
+    void *page;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+    if (page == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    ev->fd = fd;
+    ev->page = page;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+static void hp_perf_event_close(hp_perf_event *ev) {
+#ifdef HP_HAVE_PERF
+    if (ev->page) {
+        munmap(ev->page, sysconf(_SC_PAGESIZE));
+    }
+    if (ev->fd >= 0) {
+        close(ev->fd);
+    }
+#endif
+    ev->fd = -1;
+    ev->page = NULL;
+}
+
+/**
+ * Nanoseconds the event has been enabled, extrapolated with the TSC up to
+ * now. For an event bound to the calling thread the context clock only
+ * runs while the thread is on a CPU, so this is the thread's CPU time.
+ * Returns 0 when the kernel doesn't offer cap_user_time.
+ */
+static zend_always_inline uint64_t hp_perf_time_enabled(const hp_perf_event *ev) {
+#ifdef HP_HAVE_PERF
+    volatile struct perf_event_mmap_page *pc = (volatile struct perf_event_mmap_page *)ev->page;
+    uint64_t enabled, cyc, quot, rem;
+    uint32_t seq, mult;
+    uint16_t shift;
+
+    do {
+        seq = pc->lock;
+        hp_perf_barrier();
+
+        if (!pc->cap_user_time) {
+            return 0;
+        }
+
+        enabled = pc->time_enabled;
+        mult = pc->time_mult;
+        shift = pc->time_shift;
+        cyc = hp_perf_rdtsc();
+        quot = cyc >> shift;
+        rem = cyc & (((uint64_t)1 << shift) - 1);
+        enabled += pc->time_offset + quot * mult + ((rem * mult) >> shift);
+
+        hp_perf_barrier();
+    } while (pc->lock != seq);
+
+    return enabled;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Open hardware counter number counter (0 .. HP_PERF_COUNTER_NUM - 1):
+ * instructions, cycles, last level cache misses, branch misses.
+ */
+static int hp_perf_counter_open(hp_perf_event *ev, int counter) {
+#ifdef HP_HAVE_PERF
+    static const uint64_t configs[HP_PERF_COUNTER_NUM] = {
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES,
+    };
+
+    return hp_perf_event_open(ev, PERF_TYPE_HARDWARE, configs[counter]);
+#else
+    return -1;
+#endif
+}
+
+/**
+ * Current value of a counting event. Uses 'rdpmc' while the event sits on
+ * a hardware counter and the kernel allows it (cap_user_rdpmc), otherwise
+ * falls back to read(). Returns 0 for an event that isn't open.
+ */
+static zend_always_inline uint64_t hp_perf_read_count(const hp_perf_event *ev) {
+#ifdef HP_HAVE_PERF
+    volatile struct perf_event_mmap_page *pc = (volatile struct perf_event_mmap_page *)ev->page;
+    uint64_t count;
+    int64_t pmc;
+    uint32_t seq, idx;
+    uint16_t width;
+
+    if (!pc) {
+        return 0;
+    }
+
+    do {
+        seq = pc->lock;
+        hp_perf_barrier();
+
+        idx = pc->index;
+        if (!pc->cap_user_rdpmc || !idx) {
+            if (read(ev->fd, &count, sizeof(count)) != sizeof(count)) {
+                return 0;
+            }
+            return count;
+        }
+
+        count = pc->offset;
+        width = pc->pmc_width;
+        pmc = (int64_t)hp_perf_rdpmc(idx - 1);
+        //计数器只有 pmc_width 位, 符号扩展
+        pmc <<= 64 - width;
+        pmc >>= 64 - width;
+        count += pmc;
+
+        hp_perf_barrier();
+    } while (pc->lock != seq);
+
+    return count;
+#else
+    return 0;
+#endif
+}
+
+#endif
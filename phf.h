@@ -0,0 +1,216 @@
+
+#ifndef PHP_XHPROF_PHF
+#define PHP_XHPROF_PHF
+
+#include <stdint.h>
+#include <string.h>
+
+/* 平均每个桶的 key 数, 越大表越小, 构建越慢 */
+#define HP_PHF_BUCKET_LOAD 4
+/* 一个桶试过所有 16 位的 pilot 还放不下时换一个 seed 重来 */
+#define HP_PHF_PILOT_MAX   0xffff
+#define HP_PHF_SEED_MAX    8
+
+/**
+ * Minimal perfect hash over a set of distinct 64 bit keys (PTHash, a
+ * variant of CHD).
+ *
+ * Keys are split into key_num / HP_PHF_BUCKET_LOAD buckets by their high
+ * half. Each bucket has a 16 bit pilot, and a key of the bucket goes to
+ * position hp_phf_pos(key, pilot) in 0..key_num-1. The builder places the
+ * largest buckets first, each with the smallest pilot that sends all of
+ * its keys to free positions, so the keys end up on a permutation of
+ * 0..key_num-1: no empty slots, no collisions, no chains.
+ *
+ * A lookup is a multiply-shift for the bucket, one load of the pilot, one
+ * mix for the position. Keys outside the set land on some position as
+ * well, the caller compares the key it stored there.
+ *
+ * The whole structure is one block, [hp_phf][pilots ...], about half a
+ * byte per key. Use hp_phf_build() and hp_phf_free().
+ */
+typedef struct hp_phf {
+    uint32_t    key_num;
+    uint32_t    bucket_num;
+    uint64_t    seed;
+    int         persistent;
+    uint16_t   *pilots;
+} hp_phf;
+
+static zend_always_inline uint32_t hp_phf_bucket(const hp_phf *phf, uint64_t key) {
+    return (uint32_t)(((key >> 32) * phf->bucket_num) >> 32);
+}
+
+static zend_always_inline uint32_t hp_phf_pos(const hp_phf *phf, uint64_t key, uint32_t pilot) {
+    uint64_t h = key ^ ((phf->seed + pilot) * 0x9E3779B97F4A7C15ULL);
+
+    //key 的每一位都要影响结果, 只差在低位或高位的 key 也能被 pilot 分开
+    h ^= h >> 32;
+    h *= 0xD6E8FEB86659FD93ULL;
+    h ^= h >> 32;
+
+    return (uint32_t)(((h & 0xffffffff) * phf->key_num) >> 32);
+}
+
+/* key 在表里的位置, key 不在集合里时也返回一个位置 */
+static zend_always_inline uint32_t hp_phf_lookup(const hp_phf *phf, uint64_t key) {
+    return hp_phf_pos(phf, key, phf->pilots[hp_phf_bucket(phf, key)]);
+}
+
+/**
+ * Try to place every bucket with the current seed.
+ *
+ * @param order   key indexes grouped by bucket, largest buckets first
+ * @param starts  starts[i]..starts[i+1] is the i-th group in order
+ * @return 1 on success
+ */
+static int hp_phf_place(hp_phf *phf, const uint64_t *keys, const uint32_t *order, const uint32_t *starts,
+        uint32_t group_num, uint8_t *taken, uint32_t *pos) {
+    uint32_t g;
+
+    memset(taken, 0, phf->key_num);
+
+    for (g = 0; g < group_num; g++) {
+        uint32_t lo = starts[g], hi = starts[g + 1];
+        uint32_t bucket = hp_phf_bucket(phf, keys[order[lo]]);
+        uint32_t pilot, i, j;
+
+        for (pilot = 0; pilot <= HP_PHF_PILOT_MAX; pilot++) {
+            for (i = lo; i < hi; i++) {
+                pos[i - lo] = hp_phf_pos(phf, keys[order[i]], pilot);
+                if (taken[pos[i - lo]]) {
+                    break;
+                }
+                for (j = 0; j < i - lo; j++) {
+                    if (pos[j] == pos[i - lo]) {
+                        break;
+                    }
+                }
+                if (j < i - lo) {
+                    break;
+                }
+            }
+            if (i == hi) {
+                break;
+            }
+        }
+
+        if (pilot > HP_PHF_PILOT_MAX) {
+            return 0;
+        }
+
+        for (i = 0; i < hi - lo; i++) {
+            taken[pos[i]] = 1;
+        }
+        phf->pilots[bucket] = (uint16_t)pilot;
+    }
+
+    return 1;
+}
+
+/**
+ * Build a minimal perfect hash over key_num distinct keys. Returns NULL
+ * when no seed works, which in practice only happens for duplicate keys;
+ * the caller then keeps using its ordinary table.
+ */
+static hp_phf *hp_phf_build(const uint64_t *keys, uint32_t key_num, int persistent) {
+    hp_phf *phf;
+    uint32_t bucket_num, i, max_size = 0, group_num = 0;
+    uint32_t *bucket_of, *bucket_size, *order, *starts, *fill, *by_size, *pos;
+    uint8_t *taken;
+    uint64_t seed;
+    int ok = 0;
+
+    if (!key_num) {
+        return NULL;
+    }
+
+    bucket_num = key_num / HP_PHF_BUCKET_LOAD + 1;
+
+    phf = (hp_phf *)pemalloc(sizeof(hp_phf) + sizeof(uint16_t) * bucket_num, persistent);
+    phf->key_num = key_num;
+    phf->bucket_num = bucket_num;
+    phf->persistent = persistent;
+    phf->pilots = (uint16_t *)(phf + 1);
+    memset(phf->pilots, 0, sizeof(uint16_t) * bucket_num);
+
+    bucket_of = (uint32_t *)pemalloc(sizeof(uint32_t) * key_num, persistent);
+    bucket_size = (uint32_t *)pemalloc(sizeof(uint32_t) * bucket_num, persistent);
+    fill = (uint32_t *)pemalloc(sizeof(uint32_t) * bucket_num, persistent);
+    order = (uint32_t *)pemalloc(sizeof(uint32_t) * key_num, persistent);
+    starts = (uint32_t *)pemalloc(sizeof(uint32_t) * (bucket_num + 1), persistent);
+    taken = (uint8_t *)pemalloc(key_num, persistent);
+
+    //桶只由 key 的高位决定, 和 seed 无关, 只需要分一次
+    memset(bucket_size, 0, sizeof(uint32_t) * bucket_num);
+    for (i = 0; i < key_num; i++) {
+        bucket_of[i] = hp_phf_bucket(phf, keys[i]);
+        if (++bucket_size[bucket_of[i]] > max_size) {
+            max_size = bucket_size[bucket_of[i]];
+        }
+    }
+
+    //按桶的大小计数排序, 大的在前: by_size[s] 先是大小为 s 的桶的个数, 再变成它们在 order 中的起点
+    by_size = (uint32_t *)pecalloc(max_size + 1, sizeof(uint32_t), persistent);
+    for (i = 0; i < bucket_num; i++) {
+        by_size[bucket_size[i]]++;
+    }
+    {
+        uint32_t s, k, off = 0;
+
+        for (s = max_size; s > 0; s--) {
+            uint32_t n = by_size[s];
+
+            by_size[s] = off;
+            for (k = 0; k < n; k++) {
+                starts[group_num++] = off;
+                off += s;
+            }
+        }
+    }
+    for (i = 0; i < bucket_num; i++) {
+        if (bucket_size[i]) {
+            fill[i] = by_size[bucket_size[i]];
+            by_size[bucket_size[i]] += bucket_size[i];
+        }
+    }
+    for (i = 0; i < key_num; i++) {
+        order[fill[bucket_of[i]]++] = i;
+    }
+    starts[group_num] = key_num;
+
+    pos = (uint32_t *)pemalloc(sizeof(uint32_t) * max_size, persistent);
+
+    for (seed = 0; seed < HP_PHF_SEED_MAX && !ok; seed++) {
+        phf->seed = seed * 0xC2B2AE3D27D4EB4FULL;
+        ok = hp_phf_place(phf, keys, order, starts, group_num, taken, pos);
+    }
+
+    pefree(pos, persistent);
+    pefree(by_size, persistent);
+    pefree(taken, persistent);
+    pefree(starts, persistent);
+    pefree(order, persistent);
+    pefree(fill, persistent);
+    pefree(bucket_size, persistent);
+    pefree(bucket_of, persistent);
+
+    if (!ok) {
+        pefree(phf, persistent);
+        return NULL;
+    }
+
+    return phf;
+}
+
+static void hp_phf_free(hp_phf *phf) {
+    if (phf) {
+        pefree(phf, phf->persistent);
+    }
+}
+
+#undef HP_PHF_BUCKET_LOAD
+#undef HP_PHF_PILOT_MAX
+#undef HP_PHF_SEED_MAX
+
+#endif
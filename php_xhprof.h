@@ -31,6 +31,19 @@ extern zend_module_entry xhprof_module_entry;
 #include "TSRM.h"
 #endif
 
+#if defined(ZTS) && defined(COMPILE_DL_XHPROF)
+ZEND_TSRMLS_CACHE_EXTERN()
+#endif
+
+/* PHP 8 去掉了 TSRMLS_* 宏 */
+#ifndef TSRMLS_D
+#define TSRMLS_D void
+#define TSRMLS_DC
+#define TSRMLS_C
+#define TSRMLS_CC
+#define TSRMLS_FETCH()
+#endif
+
 //打印zval
 void display_zval(zval *value) {
     if (value == NULL) {
@@ -150,5 +163,8 @@ PHP_MINFO_FUNCTION(xhprof);
 PHP_FUNCTION(xhprof_test);
 PHP_FUNCTION(xhprof_enable);
 PHP_FUNCTION(xhprof_disable);
+PHP_FUNCTION(xhprof_sample_enable);
+PHP_FUNCTION(xhprof_sample_disable);
+PHP_FUNCTION(xhprof_shm_stats);
 
 #endif /* PHP_XHPROF_H */
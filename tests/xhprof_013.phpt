@@ -0,0 +1,64 @@
+--TEST--
+XHProf: track_functions result array
+--FILE--
+<?php
+
+function bar() {
+  return 1;
+}
+
+function foo($x) {
+  $sum = 0;
+  for ($idx = 0; $idx < 3; $idx++) {
+     $sum += bar();
+  }
+  return $sum;
+}
+
+class Repo {
+  public function find() {
+    return bar();
+  }
+}
+
+function print_result($output) {
+  ksort($output);
+  foreach ($output as $func => $metrics) {
+    ksort($metrics);
+    echo str_pad($func, 20) . ": " . implode(",", array_keys($metrics))
+      . "; ct=" . $metrics['ct'] . "\n";
+  }
+}
+
+$options = ['track_functions' => ['foo', 'bar', 'Repo:find', 'never_called', 'bar']];
+
+// 1: trie lookup, default flags
+xhprof_enable(XHPROF_ALGORITHM_TRIE, $options);
+foo(1);
+(new Repo)->find();
+$output = xhprof_disable();
+
+echo "Part 1: Trie\n";
+print_result($output);
+
+// 2: hash lookup with cpu and memory
+xhprof_enable(XHPROF_ALGORITHM_HASH, $options, XHPROF_FLAGS_CPU | XHPROF_FLAGS_MEMORY);
+foo(1);
+$output = xhprof_disable();
+
+echo "Part 2: Hash, CPU & Memory\n";
+print_result($output);
+
+// 3: disabled profiler returns null
+var_dump(xhprof_disable());
+
+?>
+--EXPECT--
+Part 1: Trie
+Repo:find           : ct,wt; ct=1
+bar                 : ct,wt; ct=4
+foo                 : ct,wt; ct=1
+Part 2: Hash, CPU & Memory
+bar                 : cpu,ct,mu,pmu,wt; ct=3
+foo                 : cpu,ct,mu,pmu,wt; ct=1
+NULL
@@ -0,0 +1,56 @@
+--TEST--
+XHProf: timer driven stack sampling
+--SKIPIF--
+<?php
+if (PHP_OS_FAMILY !== 'Linux') die('skip Linux only');
+?>
+--FILE--
+<?php
+
+function leaf() {
+  $x = 0;
+  for ($i = 0; $i < 1000; $i++) {
+    $x += $i;
+  }
+  return $x;
+}
+
+class Worker {
+  public function run() {
+    $start = microtime(true);
+    while (microtime(true) - $start < 0.2) {
+      leaf();
+    }
+  }
+}
+
+var_dump(xhprof_sample_disable());
+
+var_dump(xhprof_sample_enable(1000));
+(new Worker)->run();
+$samples = xhprof_sample_disable();
+
+$ticks = 0;
+$seen = false;
+foreach ($samples as $stack => $ct) {
+  $ticks += $ct;
+  if (strpos($stack, 'main()==>Worker:run') === 0) {
+    $seen = true;
+  }
+}
+echo "ticks > 0: " . ($ticks > 0 ? "yes" : "no") . "\n";
+echo "Worker:run sampled: " . ($seen ? "yes" : "no") . "\n";
+
+// sampling can be restarted in the same request
+var_dump(xhprof_sample_enable());
+var_dump(is_array(xhprof_sample_disable()));
+var_dump(xhprof_sample_disable());
+?>
+--EXPECT--
+NULL
+bool(true)
+ticks > 0: yes
+Worker:run sampled: yes
+bool(true)
+bool(true)
+NULL
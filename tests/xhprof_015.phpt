@@ -0,0 +1,32 @@
+--TEST--
+XHProf: automatic profiling started in RINIT by the trigger
+--INI--
+xhprof.track_functions=foo, bar
+xhprof.trigger=XHPROF_PROFILE
+xhprof.trigger_value=yes
+--ENV--
+XHPROF_PROFILE=yes
+--FILE--
+<?php
+
+function bar() {
+  return 1;
+}
+
+function foo() {
+  return bar() + bar();
+}
+
+// no xhprof_enable(): the request was selected before the script started
+foo();
+$output = xhprof_disable();
+ksort($output);
+foreach ($output as $func => $metrics) {
+  echo $func . ": ct=" . $metrics['ct'] . "\n";
+}
+var_dump(xhprof_disable());
+?>
+--EXPECT--
+bar: ct=2
+foo: ct=1
+NULL
@@ -0,0 +1,40 @@
+--TEST--
+XHProf: counters of the INI track list aggregated in shared memory
+--INI--
+xhprof.track_functions=foo, bar
+xhprof.shm_slabs=4
+--FILE--
+<?php
+
+function bar() {
+  return 1;
+}
+
+function foo() {
+  return bar() + bar();
+}
+
+var_dump(xhprof_shm_stats());
+
+for ($run = 0; $run < 3; $run++) {
+  xhprof_enable();
+  foo();
+  xhprof_disable();
+}
+
+// a per-request list has its own rows and is not aggregated
+xhprof_enable(XHPROF_ALGORITHM_TRIE, ['track_functions' => ['bar']]);
+foo();
+xhprof_disable();
+
+$stats = xhprof_shm_stats();
+ksort($stats);
+foreach ($stats as $func => $metrics) {
+  echo $func . ": ct=" . $metrics['ct'] . ", has wt: " . (isset($metrics['wt']) ? "yes" : "no") . "\n";
+}
+?>
+--EXPECT--
+array(0) {
+}
+bar: ct=6, has wt: yes
+foo: ct=3, has wt: yes
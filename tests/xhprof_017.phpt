@@ -0,0 +1,54 @@
+--TEST--
+XHProf: wall time histograms (XHPROF_FLAGS_HISTOGRAM)
+--FILE--
+<?php
+
+function fast() {
+  return 1;
+}
+
+function slow($us) {
+  usleep($us);
+}
+
+xhprof_enable(XHPROF_ALGORITHM_TRIE, ['track_functions' => ['fast', 'slow']], XHPROF_FLAGS_HISTOGRAM);
+for ($i = 0; $i < 100; $i++) {
+  fast();
+}
+for ($i = 0; $i < 20; $i++) {
+  slow($i == 19 ? 20000 : 100);
+}
+$output = xhprof_disable();
+
+foreach (['fast', 'slow'] as $func) {
+  $m = $output[$func];
+  echo $func . ": " . implode(",", array_keys($m)) . "\n";
+  echo "  buckets sum to ct: " . (array_sum($m['wt_hist']) == $m['ct'] ? "yes" : "no") . "\n";
+  echo "  ordered: " . ($m['wt_p50'] <= $m['wt_p90'] && $m['wt_p90'] <= $m['wt_p99']
+      && $m['wt_p99'] <= $m['wt_max'] ? "yes" : "no") . "\n";
+}
+
+$slow = $output['slow'];
+echo "slow p50 < 10ms: " . ($slow['wt_p50'] < 10000 ? "yes" : "no") . "\n";
+echo "slow max >= 20ms: " . ($slow['wt_max'] >= 20000 ? "yes" : "no") . "\n";
+
+// without the flag there is no histogram
+xhprof_enable(XHPROF_ALGORITHM_TRIE, ['track_functions' => ['fast']]);
+fast();
+var_dump(array_keys(xhprof_disable()['fast']));
+?>
+--EXPECT--
+fast: ct,wt,wt_p50,wt_p90,wt_p99,wt_max,wt_hist
+  buckets sum to ct: yes
+  ordered: yes
+slow: ct,wt,wt_p50,wt_p90,wt_p99,wt_max,wt_hist
+  buckets sum to ct: yes
+  ordered: yes
+slow p50 < 10ms: yes
+slow max >= 20ms: yes
+array(2) {
+  [0]=>
+  string(2) "ct"
+  [1]=>
+  string(2) "wt"
+}
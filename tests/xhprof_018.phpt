@@ -0,0 +1,60 @@
+--TEST--
+XHProf: exclusive time and recursion counted once
+--FILE--
+<?php
+
+class Repo {
+  public function find() {
+    usleep(20000);
+  }
+}
+
+class Controller {
+  public function handle() {
+    usleep(10000);
+    (new Repo)->find();
+    (new Repo)->find();
+  }
+}
+
+function rec($n) {
+  usleep(2000);
+  if ($n > 0) {
+    rec($n - 1);
+  }
+}
+
+$start = microtime(true);
+xhprof_enable(XHPROF_ALGORITHM_TRIE,
+  ['track_functions' => ['Controller:handle', 'Repo:find', 'rec']],
+  XHPROF_FLAGS_EXCLUSIVE | XHPROF_FLAGS_CPU);
+(new Controller)->handle();
+rec(9);
+$output = xhprof_disable();
+$elapsed = (microtime(true) - $start) * 1000000;
+
+$handle = $output['Controller:handle'];
+$find = $output['Repo:find'];
+$rec = $output['rec'];
+
+echo implode(",", array_keys($handle)) . "\n";
+
+// no overlap: the parent's exclusive time plus its tracked children is its inclusive time
+$diff = abs($handle['ewt'] + $find['wt'] - $handle['wt']);
+echo "ewt + children == wt: " . ($diff <= 2 ? "yes" : "no ($diff)") . "\n";
+echo "handle ewt < 20ms: " . ($handle['ewt'] < 20000 ? "yes" : "no") . "\n";
+echo "find ewt == wt: " . (abs($find['ewt'] - $find['wt']) <= 2 ? "yes" : "no") . "\n";
+
+// 10 nested calls of rec: ct counts every call, wt only the outermost
+echo "rec ct: " . $rec['ct'] . "\n";
+echo "rec wt <= elapsed: " . ($rec['wt'] <= $elapsed ? "yes" : "no") . "\n";
+echo "rec ewt ~ wt: " . (abs($rec['ewt'] - $rec['wt']) <= 20 ? "yes" : "no") . "\n";
+?>
+--EXPECT--
+ct,wt,cpu,ewt,ecpu
+ewt + children == wt: yes
+handle ewt < 20ms: yes
+find ewt == wt: yes
+rec ct: 10
+rec wt <= elapsed: yes
+rec ewt ~ wt: yes
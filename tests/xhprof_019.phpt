@@ -0,0 +1,35 @@
+--TEST--
+XHProf: caller==>callee edges between tracked functions (XHPROF_FLAGS_EDGES)
+--FILE--
+<?php
+
+function bar() {
+  return 1;
+}
+
+function untracked() {
+  return bar();
+}
+
+function foo() {
+  // bar() reached through an untracked function still has foo as its caller
+  return bar() + untracked();
+}
+
+xhprof_enable(XHPROF_ALGORITHM_TRIE, ['track_functions' => ['foo', 'bar']], XHPROF_FLAGS_EDGES);
+foo();
+foo();
+bar();
+$output = xhprof_disable();
+
+ksort($output);
+foreach ($output as $key => $metrics) {
+  echo $key . ": ct=" . $metrics['ct'] . ", wt " . (isset($metrics['wt']) ? "set" : "missing") . "\n";
+}
+?>
+--EXPECT--
+bar: ct=5, wt set
+foo: ct=2, wt set
+foo==>bar: ct=4, wt set
+main()==>bar: ct=1, wt set
+main()==>foo: ct=2, wt set
@@ -0,0 +1,82 @@
+--TEST--
+XHProf: wildcard and prefix patterns in track_functions
+--FILE--
+<?php
+
+namespace App\Repository {
+  function helper() {
+    return 1;
+  }
+}
+
+namespace {
+
+class Foo {
+  public function __construct() {
+  }
+  public function a() {
+    // Foo:b nested in Foo:a: the pattern row counts the wall time once
+    return $this->b();
+  }
+  public function b() {
+    return 2;
+  }
+  public function exact() {
+    return 3;
+  }
+}
+
+class Bar {
+  public function __construct() {
+  }
+}
+
+function dump($output) {
+  ksort($output);
+  foreach ($output as $key => $metrics) {
+    echo $key . ": ct=" . $metrics['ct'] . "\n";
+  }
+}
+
+$options = ['track_functions' => ['Foo:*', 'Foo:exact', '*:__construct', 'App\\Repository\\*']];
+
+foreach ([XHPROF_ALGORITHM_TRIE, XHPROF_ALGORITHM_HASH] as $algorithm) {
+  xhprof_enable($algorithm, $options);
+  $foo = new Foo();
+  $foo->a();
+  $foo->exact();
+  new Bar();
+  App\Repository\helper();
+  App\Repository\helper();
+  dump(xhprof_disable());
+}
+
+echo "-- detail\n";
+xhprof_enable(XHPROF_ALGORITHM_TRIE, $options, XHPROF_FLAGS_PATTERN_DETAIL);
+$foo = new Foo();
+$foo->a();
+$foo->a();
+new Bar();
+$output = xhprof_disable();
+dump($output);
+var_dump($output['Foo:*']['wt'] == $output['Foo:a']['wt']);
+
+}
+?>
+--EXPECT--
+*:__construct: ct=2
+App\Repository\*: ct=2
+Foo:*: ct=2
+Foo:exact: ct=1
+*:__construct: ct=2
+App\Repository\*: ct=2
+Foo:*: ct=2
+Foo:exact: ct=1
+-- detail
+*:__construct: ct=2
+Bar:__construct: ct=1
+Foo:*: ct=4
+Foo:__construct: ct=1
+Foo:a: ct=2
+Foo:b: ct=2
+bool(true)
@@ -0,0 +1,27 @@
+--TEST--
+XHProf: XHPROF_ALGORITHM_HASH with long namespaced class names
+--FILE--
+<?php
+
+// longer than the 1024 byte name buffer the hash lookup used to copy into
+$ns = 'Vendor\\' . str_repeat('Package', 200);
+eval("namespace $ns; class Repo { public function find() { return 1; } public function save() { return 2; } } function helper() { return 3; }");
+
+$class = "$ns\\Repo";
+$repo = new $class();
+
+xhprof_enable(XHPROF_ALGORITHM_HASH, ['track_functions' => ["$class:find", "$ns\\helper", 'Repo:find', 'find']]);
+$repo->find();
+$repo->find();
+$repo->save();
+call_user_func("$ns\\helper");
+$output = xhprof_disable();
+
+echo count($output), "\n";
+echo $output["$class:find"]['ct'], "\n";
+echo $output["$ns\\helper"]['ct'], "\n";
+?>
+--EXPECT--
+2
+2
+1
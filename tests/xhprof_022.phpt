@@ -0,0 +1,42 @@
+--TEST--
+XHProf: repeated enable/disable, and xhprof_disable() inside a tracked function
+--FILE--
+<?php
+
+function foo() {
+  return str_repeat("a", 2);
+}
+
+function stop_inside() {
+  foo();
+  return xhprof_disable();
+}
+
+function start_inside() {
+  xhprof_enable(XHPROF_ALGORITHM_TRIE, ['track_functions' => ['foo', 'start_inside']]);
+  foo();
+}
+
+for ($i = 0; $i < 3; $i++) {
+  xhprof_enable(XHPROF_ALGORITHM_TRIE, ['track_functions' => ['foo', 'str_repeat']]);
+  foo();
+  $output = xhprof_disable();
+  echo "round $i: foo ct=" . $output['foo']['ct'] . ", str_repeat ct=" . $output['str_repeat']['ct'] . "\n";
+}
+
+xhprof_enable(XHPROF_ALGORITHM_TRIE, ['track_functions' => ['foo', 'stop_inside']]);
+$output = stop_inside();
+echo "stop_inside: ct=" . $output['stop_inside']['ct'] . ", foo ct=" . $output['foo']['ct'] . "\n";
+foo();
+
+start_inside();
+foo();
+$output = xhprof_disable();
+echo "start_inside: " . (isset($output['start_inside']) ? "present" : "absent") . ", foo ct=" . $output['foo']['ct'] . "\n";
+?>
+--EXPECT--
+round 0: foo ct=1, str_repeat ct=1
+round 1: foo ct=1, str_repeat ct=1
+round 2: foo ct=1, str_repeat ct=1
+stop_inside: ct=1, foo ct=1
+start_inside: absent, foo ct=2
@@ -0,0 +1,37 @@
+--TEST--
+XHProf: XHPROF_ALGORITHM_PHF and XHPROF_ALGORITHM_AUTO
+--FILE--
+<?php
+
+class Repo {
+    public function find() { return 1; }
+    public function save() { return 2; }
+}
+
+$functions = ['Repo:find', 'Repo:save*', 'str_repeat'];
+for ($i = 0; $i < 40; $i++) {
+    eval("function f$i() { return $i; }");
+    $functions[] = "f$i";
+}
+
+foreach ([XHPROF_ALGORITHM_PHF, XHPROF_ALGORITHM_AUTO] as $algorithm) {
+    xhprof_enable($algorithm, ['track_functions' => $functions]);
+
+    $repo = new Repo();
+    $repo->find();
+    $repo->save();
+    $repo->save();
+    for ($i = 0; $i < 40; $i += 3) {
+        call_user_func("f$i");
+    }
+    f39();
+    str_repeat('a', 3);
+    $output = xhprof_disable();
+
+    echo count($output), " ", $output['Repo:find']['ct'], " ", $output['Repo:save*']['ct'], " ",
+        $output['f0']['ct'], " ", $output['f39']['ct'], " ", $output['str_repeat']['ct'], "\n";
+}
+?>
+--EXPECT--
+17 1 2 1 2 1
+17 1 2 1 2 1
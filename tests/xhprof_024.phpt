@@ -0,0 +1,94 @@
+--TEST--
+XHProf: xhprof.dump writes counters from a background thread
+--SKIPIF--
+<?php
+if (PHP_OS_FAMILY !== 'Linux') die('skip Linux only');
+?>
+--INI--
+xhprof.dump=1
+xhprof.output_dir={PWD}
+--FILE--
+<?php
+
+function foo() { return 1; }
+function bar() { return foo() + 1; }
+function unused() { return 0; }
+
+function varint($data, &$pos) {
+    $value = 0;
+    $shift = 0;
+    do {
+        $byte = ord($data[$pos++]);
+        $value |= ($byte & 0x7f) << $shift;
+        $shift += 7;
+    } while ($byte & 0x80);
+    return $value;
+}
+
+function bytes($data, &$pos) {
+    $len = varint($data, $pos);
+    $pos += $len;
+    return substr($data, $pos - $len, $len);
+}
+
+for ($r = 0; $r < 2; $r++) {
+    xhprof_enable(XHPROF_ALGORITHM_HASH, ['track_functions' => ['foo', 'bar', 'unused']]);
+    for ($i = 0; $i <= $r; $i++) {
+        bar();
+    }
+    foo();
+    xhprof_disable();
+}
+
+//写线程最多攒 1 秒
+usleep(1500000);
+
+$data = file_get_contents(__DIR__ . '/xhprof.' . getmypid() . '.xhpb');
+$pos = 4;
+echo substr($data, 0, 4), " ", ord($data[$pos++]), "\n";
+
+$keys = [];
+for ($n = varint($data, $pos); $n > 0; $n--) {
+    $keys[] = bytes($data, $pos);
+}
+echo implode(",", array_slice($keys, 0, 2)), "\n";
+
+$names = [];
+while ($pos < strlen($data)) {
+    $type = $data[$pos++];
+    if ($type === 'S') {
+        for ($n = varint($data, $pos); $n > 0; $n--) {
+            $names[] = bytes($data, $pos);
+        }
+        continue;
+    }
+    varint($data, $pos);
+    $flags = varint($data, $pos);
+    $mask = varint($data, $pos);
+    $row = [];
+    for ($n = varint($data, $pos); $n > 0; $n--) {
+        $name = $names[varint($data, $pos)];
+        for ($key = 0; $key < count($keys); $key++) {
+            if ($mask & (1 << $key)) {
+                $value = varint($data, $pos);
+                if ($key == 0) {
+                    $row[] = "$name=" . (($value >> 1) ^ -($value & 1));
+                }
+            }
+        }
+    }
+    echo $type, " ", implode(" ", $row), "\n";
+}
+?>
+--CLEAN--
+<?php
+foreach (glob(__DIR__ . '/xhprof.*.xhpb') as $file) {
+    unlink($file);
+}
+@unlink(__DIR__ . '/xhprof_tsc.cache');
+?>
+--EXPECT--
+XHPB 1
+ct,wt
+R foo=2 bar=1
+R foo=3 bar=2
@@ -0,0 +1,55 @@
+--TEST--
+XHProf: observer handlers only for the INI list and functions first called while profiling
+--SKIPIF--
+<?php
+if (PHP_VERSION_ID < 80000) die('skip observer API needs PHP 8');
+?>
+--INI--
+xhprof.observer=1
+xhprof.track_functions=foo
+--FILE--
+<?php
+
+function foo() { return 1; }
+function bar() { return 2; }
+function baz() { return 3; }
+
+//第一次调用在 xhprof_enable() 之前: foo 在 INI 函数列表里, bar 不在, 这个请求内 bar 都没有 observer
+foo();
+bar();
+
+xhprof_enable(XHPROF_ALGORITHM_HASH, ['track_functions' => ['bar', 'baz']]);
+foo();
+bar();
+baz();
+$output = xhprof_disable();
+ksort($output);
+foreach ($output as $name => $metrics) {
+    echo $name, " ", $metrics['ct'], "\n";
+}
+
+//换一个函数列表: 是否抓取仍然每次调用时判断
+xhprof_enable(XHPROF_ALGORITHM_TRIE, ['track_functions' => ['foo']]);
+foo();
+foo();
+bar();
+baz();
+$output = xhprof_disable();
+foreach ($output as $name => $metrics) {
+    echo $name, " ", $metrics['ct'], "\n";
+}
+
+//INI 函数列表
+xhprof_enable();
+foo();
+bar();
+baz();
+$output = xhprof_disable();
+foreach ($output as $name => $metrics) {
+    echo $name, " ", $metrics['ct'], "\n";
+}
+?>
+--EXPECT--
+baz 1
+foo 2
+foo 1
@@ -0,0 +1,70 @@
+--TEST--
+XHProf: xhprof_enable() while profiling restarts with the new flags and list
+--FILE--
+<?php
+
+function foo() {
+  return 1;
+}
+
+function bar() {
+  return foo() + foo();
+}
+
+function baz() {
+  return bar();
+}
+
+function outer() {
+  bar();
+  // what an app does when RINIT already started a profile
+  xhprof_enable(XHPROF_ALGORITHM_HASH, ['track_functions' => ['baz', 'foo']],
+    XHPROF_FLAGS_CPU | XHPROF_FLAGS_MEMORY | XHPROF_FLAGS_EXCLUSIVE | XHPROF_FLAGS_HISTOGRAM);
+  baz();
+}
+
+function print_result($name, $output) {
+  ksort($output);
+  echo $name . "\n";
+  foreach ($output as $func => $metrics) {
+    $keys = array_keys($metrics);
+    sort($keys);
+    echo "  " . $func . ": ct=" . $metrics['ct'] . " " . implode(",", $keys) . "\n";
+  }
+}
+
+// 1: at the top level, the second list and flags are larger than the first
+xhprof_enable(XHPROF_ALGORITHM_TRIE, ['track_functions' => ['foo']]);
+foo();
+xhprof_enable(XHPROF_ALGORITHM_TRIE, ['track_functions' => ['bar', 'baz', 'foo']],
+  XHPROF_FLAGS_CPU | XHPROF_FLAGS_MEMORY | XHPROF_FLAGS_EXCLUSIVE | XHPROF_FLAGS_HISTOGRAM);
+baz();
+print_result("Part 1: top level", xhprof_disable());
+
+// 2: inside a tracked function, whose frame belongs to the first profile
+xhprof_enable(XHPROF_ALGORITHM_TRIE, ['track_functions' => ['outer', 'bar', 'foo']], XHPROF_FLAGS_CPU);
+outer();
+foo();
+print_result("Part 2: inside outer()", xhprof_disable());
+
+// 3: fewer flags than the running profile
+xhprof_enable(XHPROF_ALGORITHM_TRIE, ['track_functions' => ['bar', 'foo']],
+  XHPROF_FLAGS_CPU | XHPROF_FLAGS_MEMORY | XHPROF_FLAGS_EXCLUSIVE);
+bar();
+xhprof_enable(XHPROF_ALGORITHM_TRIE, ['track_functions' => ['foo']]);
+bar();
+print_result("Part 3: fewer flags", xhprof_disable());
+
+var_dump(xhprof_disable());
+?>
+--EXPECT--
+Part 1: top level
+  bar: ct=1 cpu,ct,ecpu,ewt,mu,pmu,wt,wt_hist,wt_max,wt_p50,wt_p90,wt_p99
+  baz: ct=1 cpu,ct,ecpu,ewt,mu,pmu,wt,wt_hist,wt_max,wt_p50,wt_p90,wt_p99
+  foo: ct=2 cpu,ct,ecpu,ewt,mu,pmu,wt,wt_hist,wt_max,wt_p50,wt_p90,wt_p99
+Part 2: inside outer()
+  baz: ct=1 cpu,ct,ecpu,ewt,mu,pmu,wt,wt_hist,wt_max,wt_p50,wt_p90,wt_p99
+  foo: ct=3 cpu,ct,ecpu,ewt,mu,pmu,wt,wt_hist,wt_max,wt_p50,wt_p90,wt_p99
+Part 3: fewer flags
+  foo: ct=2 ct,wt
+NULL
@@ -0,0 +1,64 @@
+--TEST--
+XHProf: frame stack grows past xhprof.stack_depth
+--INI--
+xhprof.stack_depth=16
+--FILE--
+<?php
+
+function leaf() {
+  return 1;
+}
+
+function ping($n) {
+  leaf();
+  return $n > 0 ? pong($n - 1) : 0;
+}
+
+function pong($n) {
+  leaf();
+  return $n > 0 ? ping($n - 1) : 0;
+}
+
+$flags = XHPROF_FLAGS_CPU | XHPROF_FLAGS_MEMORY | XHPROF_FLAGS_EXCLUSIVE;
+
+// the second round starts with the stack grown by the first
+foreach ([300, 1000] as $depth) {
+  $start = microtime(true);
+  xhprof_enable(XHPROF_ALGORITHM_TRIE, ['track_functions' => ['ping', 'pong', 'leaf']], $flags);
+  ping($depth - 1);
+  $output = xhprof_disable();
+  $elapsed = (microtime(true) - $start) * 1000000;
+
+  $ping = $output['ping'];
+  $pong = $output['pong'];
+  $leaf = $output['leaf'];
+  $keys = array_keys($ping);
+  sort($keys);
+
+  echo "depth $depth: " . implode(",", $keys) . "\n";
+  echo "  ct: ping=" . $ping['ct'] . " pong=" . $pong['ct'] . " leaf=" . $leaf['ct'] . "\n";
+  echo "  ping wt <= elapsed: " . ($ping['wt'] <= $elapsed ? "yes" : "no") . "\n";
+  echo "  leaf wt <= ping wt: " . ($leaf['wt'] <= $ping['wt'] ? "yes" : "no") . "\n";
+  echo "  ewt <= wt: " . ($ping['ewt'] <= $ping['wt'] && $leaf['ewt'] <= $leaf['wt'] ? "yes" : "no") . "\n";
+  echo "  cpu >= 0: " . ($ping['cpu'] >= 0 && $leaf['ecpu'] >= 0 ? "yes" : "no") . "\n";
+}
+
+// untracked frames are not pushed, only leaf() is on the stack
+xhprof_enable(XHPROF_ALGORITHM_TRIE, ['track_functions' => ['leaf']], $flags);
+ping(500);
+echo "leaf only: ct=" . xhprof_disable()['leaf']['ct'] . "\n";
+?>
+--EXPECT--
+depth 300: cpu,ct,ecpu,ewt,mu,pmu,wt
+  ct: ping=150 pong=150 leaf=300
+  ping wt <= elapsed: yes
+  leaf wt <= ping wt: yes
+  ewt <= wt: yes
+  cpu >= 0: yes
+depth 1000: cpu,ct,ecpu,ewt,mu,pmu,wt
+  ct: ping=500 pong=500 leaf=1000
+  ping wt <= elapsed: yes
+  leaf wt <= ping wt: yes
+  ewt <= wt: yes
+  cpu >= 0: yes
+leaf only: ct=501
@@ -0,0 +1,68 @@
+--TEST--
+XHProf: tools/xhprof_agg merges xhprof.dump files and skips a truncated request
+--SKIPIF--
+<?php
+if (PHP_OS_FAMILY !== 'Linux') die('skip Linux only');
+if (!function_exists('shell_exec') || !trim((string)shell_exec('command -v cc 2>/dev/null'))) die('skip no C compiler');
+?>
+--INI--
+xhprof.dump=1
+xhprof.output_dir={PWD}
+--FILE--
+<?php
+
+function foo() { return 1; }
+function bar() { return foo() + 1; }
+
+for ($r = 0; $r < 2; $r++) {
+    xhprof_enable(XHPROF_ALGORITHM_TRIE, ['track_functions' => ['foo', 'bar']]);
+    for ($i = 0; $i <= $r; $i++) {
+        bar();
+    }
+    foo();
+    xhprof_disable();
+}
+
+//写线程最多攒 1 秒
+usleep(1500000);
+
+$bin = __DIR__ . '/xhprof_agg_028';
+$src = __DIR__ . '/../tools/xhprof_agg.c';
+$out = shell_exec('cc -O2 -pthread -o ' . escapeshellarg($bin) . ' ' . escapeshellarg($src) . ' 2>&1');
+if (!is_file($bin)) {
+    die("cc failed: $out");
+}
+
+function agg($bin, $file) {
+    $result = json_decode(shell_exec(escapeshellarg($bin) . ' --json ' . escapeshellarg($file)), true);
+    ksort($result);
+    foreach ($result as $name => $metrics) {
+        echo "  $name: requests=", $metrics['requests'], " ct=", $metrics['ct'], "\n";
+    }
+}
+
+$dump = __DIR__ . '/xhprof.' . getmypid() . '.xhpb';
+echo "dump\n";
+agg($bin, $dump);
+
+//写到一半被杀掉的请求: 第二行没写出来, 第一行的值不能算进去
+$truncated = __DIR__ . '/xhprof.028.truncated.xhpb';
+file_put_contents($truncated, file_get_contents($dump) . "R\x01\x00\x01\x02\x00\x14");
+echo "truncated\n";
+agg($bin, $truncated);
+?>
+--CLEAN--
+<?php
+foreach (glob(__DIR__ . '/xhprof.*.xhpb') as $file) {
+    unlink($file);
+}
+@unlink(__DIR__ . '/xhprof_agg_028');
+@unlink(__DIR__ . '/xhprof_tsc.cache');
+?>
+--EXPECT--
+dump
+  bar: requests=2 ct=3
+  foo: requests=2 ct=5
+truncated
+  bar: requests=2 ct=3
+  foo: requests=2 ct=5
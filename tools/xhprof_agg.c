@@ -0,0 +1,1138 @@
+/*
+ * xhprof_agg: merge xhprof.dump files (and xhprof_disable() results saved as
+ * JSON) into per-function totals, means and percentiles.
+ *
+ *     cc -O2 -pthread -o xhprof_agg tools/xhprof_agg.c
+ *     xhprof_agg [options] FILE|DIR ...
+ *
+ * Every input file is mmap'd and parsed by one of N worker threads; each
+ * worker accumulates into its own function table, and the tables are
+ * reduced into one at the end, so workers never share a cache line while
+ * parsing. A directory stands for the *.xhpb and *.json files in it.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* hist.h 是扩展里用的, 只依赖这一个宏 */
+#define zend_always_inline inline __attribute__((always_inline))
+#include "../hist.h"
+
+/* 和 dump.h 的 HP_DUMP_VERSION 一致 */
+#define HP_AGG_DUMP_VERSION  1
+/* 所有文件里出现的不同指标名的上限, 扩展自己只有 11 个 */
+#define HP_AGG_MAX_KEYS      32
+#define HP_AGG_MAX_PCT       8
+
+typedef struct hp_agg_func {
+    char       *name;
+    uint32_t    len;
+    uint64_t    hash;
+    uint64_t    requests;               /* 出现过的请求数 */
+    int64_t     sums[HP_AGG_MAX_KEYS];
+    hp_hist    *hist;                   /* 排序指标每个请求的值, 第一次用到时分配 */
+} hp_agg_func;
+
+/* 一个线程的函数表: funcs 是数组, slots 是开放寻址的下标 + 1 */
+typedef struct hp_agg_table {
+    hp_agg_func    *funcs;
+    uint32_t        func_num;
+    uint32_t        func_cap;
+    uint32_t       *slots;
+    uint32_t        slot_mask;
+} hp_agg_table;
+
+typedef struct hp_agg_file {
+    char       *path;
+    off_t       size;
+} hp_agg_file;
+
+typedef struct hp_agg_worker {
+    pthread_t       thread;
+    hp_agg_table    table;
+    uint64_t        requests;
+    uint64_t        bytes;
+    uint64_t        bad_files;
+    uint64_t        time_min;
+    uint64_t        time_max;
+    uint32_t       *name_map;           /* 当前 session 的 name_id => funcs 下标 */
+    uint32_t        name_num;
+    uint32_t        name_cap;
+    int64_t        *rows;               /* 当前 'R' 记录解码出的行: funcs 下标, 排序指标, 各列的值 */
+    size_t          rows_cap;
+} hp_agg_worker;
+
+/* 全局的指标名, 各文件里的指标按名字对应到这里的编号 */
+static struct {
+    pthread_mutex_t     mutex;
+    uint32_t            key_num;
+    char               *names[HP_AGG_MAX_KEYS];
+} hp_agg_keys = {PTHREAD_MUTEX_INITIALIZER, 0, {NULL}};
+
+static hp_agg_file     *hp_agg_files;
+static uint32_t         hp_agg_file_num;
+static uint32_t         hp_agg_file_next;
+
+/* 排序和百分位用的指标, 注册时最先注册, 编号是 0 */
+#define HP_AGG_SORT_KEY 0
+static const char      *hp_agg_sort_name = "wt";
+static int              hp_agg_sort_mean = 0;
+static double           hp_agg_pct[HP_AGG_MAX_PCT] = {0.5, 0.9, 0.99};
+static uint32_t         hp_agg_pct_num = 3;
+
+static uint64_t hp_agg_hash(const char *s, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)s[i]) * 0x100000001b3ULL;
+    }
+    return hash ^ (hash >> 29);
+}
+
+/* 指标名 => 全局编号, 超过上限返回 -1 */
+static int hp_agg_key_id(const char *name, size_t len) {
+    uint32_t i;
+    int id = -1;
+
+    pthread_mutex_lock(&hp_agg_keys.mutex);
+    for (i = 0; i < hp_agg_keys.key_num; i++) {
+        if (strlen(hp_agg_keys.names[i]) == len && memcmp(hp_agg_keys.names[i], name, len) == 0) {
+            id = (int)i;
+            break;
+        }
+    }
+    if (id < 0 && hp_agg_keys.key_num < HP_AGG_MAX_KEYS) {
+        id = (int)hp_agg_keys.key_num++;
+        hp_agg_keys.names[id] = strndup(name, len);
+    }
+    pthread_mutex_unlock(&hp_agg_keys.mutex);
+
+    return id;
+}
+
+static void hp_agg_table_grow(hp_agg_table *table) {
+    uint32_t size = table->slots ? (table->slot_mask + 1) * 2 : 1024;
+    uint32_t i;
+
+    free(table->slots);
+    table->slots = (uint32_t *)calloc(size, sizeof(uint32_t));
+    table->slot_mask = size - 1;
+
+    for (i = 0; i < table->func_num; i++) {
+        uint32_t pos = (uint32_t)table->funcs[i].hash & table->slot_mask;
+
+        while (table->slots[pos]) {
+            pos = (pos + 1) & table->slot_mask;
+        }
+        table->slots[pos] = i + 1;
+    }
+}
+
+/* 函数名 => funcs 下标, 没有时新建; 名字会被复制 */
+static uint32_t hp_agg_table_find(hp_agg_table *table, const char *name, uint32_t len, uint64_t hash) {
+    uint32_t pos;
+    hp_agg_func *func;
+
+    if (!table->slots || table->func_num * 2 >= table->slot_mask + 1) {
+        hp_agg_table_grow(table);
+    }
+
+    pos = (uint32_t)hash & table->slot_mask;
+    while (table->slots[pos]) {
+        func = &table->funcs[table->slots[pos] - 1];
+        if (func->hash == hash && func->len == len && memcmp(func->name, name, len) == 0) {
+            return table->slots[pos] - 1;
+        }
+        pos = (pos + 1) & table->slot_mask;
+    }
+
+    if (table->func_num == table->func_cap) {
+        table->func_cap = table->func_cap ? table->func_cap * 2 : 256;
+        table->funcs = (hp_agg_func *)realloc(table->funcs, sizeof(hp_agg_func) * table->func_cap);
+    }
+
+    func = &table->funcs[table->func_num];
+    memset(func, 0, sizeof(hp_agg_func));
+    func->name = (char *)malloc(len + 1);
+    memcpy(func->name, name, len);
+    func->name[len] = '\0';
+    func->len = len;
+    func->hash = hash;
+    table->slots[pos] = ++table->func_num;
+
+    return table->func_num - 1;
+}
+
+/* 函数在一个请求里出现了一次; 百分位只统计排序指标 */
+static inline void hp_agg_func_seen(hp_agg_func *func, int64_t sort_value) {
+    func->requests++;
+    if (!func->hist) {
+        func->hist = (hp_hist *)calloc(1, sizeof(hp_hist));
+    }
+    hp_hist_record(func->hist, sort_value > 0 ? (uint64_t)sort_value : 0);
+}
+
+static void hp_agg_time(hp_agg_worker *worker, uint64_t time_us) {
+    if (!worker->time_min || time_us < worker->time_min) {
+        worker->time_min = time_us;
+    }
+    if (time_us > worker->time_max) {
+        worker->time_max = time_us;
+    }
+}
+
+/* ------------------------------------------------------------------------
+ * xhprof.dump 文件, 格式见 dump.h
+ * ------------------------------------------------------------------------ */
+
+typedef struct hp_agg_reader {
+    const unsigned char *p;
+    const unsigned char *end;
+    int                  bad;           /* 越界或格式错误之后所有读取都返回 0 */
+} hp_agg_reader;
+
+static inline uint64_t hp_agg_varint(hp_agg_reader *r) {
+    uint64_t v = 0;
+    uint32_t shift = 0;
+
+    //大部分值一个字节
+    if (r->p < r->end && *r->p < 0x80) {
+        return *r->p++;
+    }
+
+    while (r->p < r->end && shift < 64) {
+        unsigned char b = *r->p++;
+
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (b < 0x80) {
+            return v;
+        }
+        shift += 7;
+    }
+
+    r->bad = 1;
+    r->p = r->end;
+    return 0;
+}
+
+static inline const char *hp_agg_bytes(hp_agg_reader *r, uint32_t *len) {
+    uint64_t n = hp_agg_varint(r);
+    const char *s = (const char *)r->p;
+
+    if (r->bad || n > (uint64_t)(r->end - r->p)) {
+        r->bad = 1;
+        r->p = r->end;
+        *len = 0;
+        return "";
+    }
+
+    r->p += n;
+    *len = (uint32_t)n;
+    return s;
+}
+
+/**
+ * Parse a file of sessions. A truncated tail (the process was killed while
+ * writing) ends the file without discarding what was read before it; the
+ * request it cut through is left out entirely.
+ *
+ * @return 0 when the file is not a dump or is broken before its end
+ */
+static int hp_agg_parse_dump(hp_agg_worker *worker, const unsigned char *data, size_t size) {
+    hp_agg_reader r = {data, data + size, 0};
+    int key_map[64];
+    uint32_t key_num = 0;
+
+    while (r.p < r.end && !r.bad) {
+        unsigned char type = *r.p;
+
+        if (type == 'X') {
+            uint32_t i;
+
+            if (r.end - r.p < 5 || memcmp(r.p, "XHPB", 4) != 0 || r.p[4] != HP_AGG_DUMP_VERSION) {
+                return 0;
+            }
+            r.p += 5;
+
+            key_num = (uint32_t)hp_agg_varint(&r);
+            if (key_num > 64) {
+                return 0;
+            }
+            for (i = 0; i < key_num; i++) {
+                uint32_t len;
+                const char *name = hp_agg_bytes(&r, &len);
+
+                key_map[i] = hp_agg_key_id(name, len);
+            }
+            worker->name_num = 0;
+
+        } else if (type == 'S') {
+            uint64_t count;
+
+            r.p++;
+            count = hp_agg_varint(&r);
+            while (count-- && !r.bad) {
+                uint32_t len;
+                const char *name = hp_agg_bytes(&r, &len);
+
+                if (worker->name_num == worker->name_cap) {
+                    worker->name_cap = worker->name_cap ? worker->name_cap * 2 : 1024;
+                    worker->name_map = (uint32_t *)realloc(worker->name_map, sizeof(uint32_t) * worker->name_cap);
+                }
+                worker->name_map[worker->name_num++] = hp_agg_table_find(&worker->table, name, len, hp_agg_hash(name, len));
+            }
+
+        } else if (type == 'R') {
+            uint64_t time_us, mask, row_num, n;
+            int cols[64];
+            uint32_t col_num = 0, stride, i;
+            int64_t *row;
+
+            r.p++;
+            time_us = hp_agg_varint(&r);
+            hp_agg_varint(&r);      /* flags */
+            mask = hp_agg_varint(&r);
+            row_num = hp_agg_varint(&r);
+
+            //这个请求写了哪些列, 对应到全局编号
+            for (i = 0; i < key_num; i++) {
+                if (mask & ((uint64_t)1 << i)) {
+                    cols[col_num++] = key_map[i];
+                }
+            }
+            stride = col_num + 2;
+
+            //每行至少一个字节, 行数比剩下的字节还多就是被截断了
+            if (r.bad || row_num > (uint64_t)(r.end - r.p)) {
+                break;
+            }
+            if (row_num * stride > worker->rows_cap) {
+                worker->rows_cap = row_num * stride * 2;
+                worker->rows = (int64_t *)realloc(worker->rows, sizeof(int64_t) * worker->rows_cap);
+            }
+
+            //先解码到 rows, 被截断的请求 (写的进程被杀掉) 不能留下一半的值
+            for (n = 0, row = worker->rows; n < row_num; n++, row += stride) {
+                uint64_t name_id = hp_agg_varint(&r);
+
+                if (r.bad) {
+                    break;
+                }
+                if (name_id >= worker->name_num) {
+                    return 0;
+                }
+                row[0] = worker->name_map[name_id];
+                row[1] = 0;
+
+                for (i = 0; i < col_num; i++) {
+                    uint64_t z = hp_agg_varint(&r);
+                    int64_t v = (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+
+                    if (cols[i] == HP_AGG_SORT_KEY) {
+                        row[1] = v;
+                    }
+                    row[2 + i] = v;
+                }
+            }
+            if (r.bad) {
+                break;
+            }
+
+            hp_agg_time(worker, time_us);
+            for (n = 0, row = worker->rows; n < row_num; n++, row += stride) {
+                hp_agg_func *func = &worker->table.funcs[row[0]];
+
+                for (i = 0; i < col_num; i++) {
+                    if (cols[i] >= 0) {
+                        func->sums[cols[i]] += row[2 + i];
+                    }
+                }
+                hp_agg_func_seen(func, row[1]);
+            }
+            worker->requests++;
+
+        } else {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* ------------------------------------------------------------------------
+ * JSON: json_encode(xhprof_disable()) 的结果, 一个文件里可以是一个对象、
+ * 对象的数组或者每行一个对象, 每个对象算一个请求
+ * ------------------------------------------------------------------------ */
+
+typedef struct hp_agg_json {
+    const char *p;
+    const char *end;
+    int         bad;
+    char       *buf;                    /* 带转义的字符串解码到这里 */
+    size_t      buf_cap;
+} hp_agg_json;
+
+static inline void hp_agg_json_ws(hp_agg_json *j) {
+    while (j->p < j->end && (*j->p == ' ' || *j->p == '\n' || *j->p == '\r' || *j->p == '\t')) {
+        j->p++;
+    }
+}
+
+static inline int hp_agg_json_eat(hp_agg_json *j, char c) {
+    hp_agg_json_ws(j);
+    if (j->p < j->end && *j->p == c) {
+        j->p++;
+        return 1;
+    }
+    return 0;
+}
+
+static void hp_agg_json_utf8(hp_agg_json *j, size_t *len, uint32_t cp) {
+    char *o = j->buf + *len;
+
+    if (cp < 0x80) {
+        o[0] = (char)cp;
+        *len += 1;
+    } else if (cp < 0x800) {
+        o[0] = (char)(0xc0 | (cp >> 6));
+        o[1] = (char)(0x80 | (cp & 0x3f));
+        *len += 2;
+    } else if (cp < 0x10000) {
+        o[0] = (char)(0xe0 | (cp >> 12));
+        o[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+        o[2] = (char)(0x80 | (cp & 0x3f));
+        *len += 3;
+    } else {
+        o[0] = (char)(0xf0 | (cp >> 18));
+        o[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+        o[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+        o[3] = (char)(0x80 | (cp & 0x3f));
+        *len += 4;
+    }
+}
+
+static uint32_t hp_agg_json_hex4(hp_agg_json *j) {
+    uint32_t cp = 0;
+    int i;
+
+    if (j->end - j->p < 4) {
+        j->bad = 1;
+        return 0;
+    }
+    for (i = 0; i < 4; i++) {
+        char c = *j->p++;
+
+        cp <<= 4;
+        if (c >= '0' && c <= '9') {
+            cp |= (uint32_t)(c - '0');
+        } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+            cp |= (uint32_t)((c | 0x20) - 'a' + 10);
+        } else {
+            j->bad = 1;
+        }
+    }
+    return cp;
+}
+
+/* 读一个字符串, 没有转义时直接指向文件里的内容 */
+static const char *hp_agg_json_string(hp_agg_json *j, uint32_t *out_len) {
+    const char *start, *s;
+    size_t len = 0;
+
+    if (!hp_agg_json_eat(j, '"')) {
+        j->bad = 1;
+        return NULL;
+    }
+
+    start = j->p;
+    s = memchr(start, '"', (size_t)(j->end - start));
+    if (s && !memchr(start, '\\', (size_t)(s - start))) {
+        j->p = s + 1;
+        *out_len = (uint32_t)(s - start);
+        return start;
+    }
+
+    //有转义: 解码后的长度不会超过原文
+    if ((size_t)(j->end - start) + 4 > j->buf_cap) {
+        j->buf_cap = (size_t)(j->end - start) + 4;
+        j->buf = (char *)realloc(j->buf, j->buf_cap);
+    }
+    while (j->p < j->end && *j->p != '"') {
+        char c = *j->p++;
+
+        if (c != '\\') {
+            j->buf[len++] = c;
+            continue;
+        }
+        if (j->p >= j->end) {
+            break;
+        }
+        c = *j->p++;
+        switch (c) {
+            case 'b': j->buf[len++] = '\b'; break;
+            case 'f': j->buf[len++] = '\f'; break;
+            case 'n': j->buf[len++] = '\n'; break;
+            case 'r': j->buf[len++] = '\r'; break;
+            case 't': j->buf[len++] = '\t'; break;
+            case 'u': {
+                uint32_t cp = hp_agg_json_hex4(j);
+
+                if (cp >= 0xd800 && cp < 0xdc00 && j->end - j->p >= 6 && j->p[0] == '\\' && j->p[1] == 'u') {
+                    uint32_t low;
+
+                    j->p += 2;
+                    low = hp_agg_json_hex4(j);
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                }
+                hp_agg_json_utf8(j, &len, cp);
+                break;
+            }
+            default: j->buf[len++] = c; break;
+        }
+    }
+    if (j->p >= j->end) {
+        j->bad = 1;
+        return NULL;
+    }
+    j->p++;
+
+    *out_len = (uint32_t)len;
+    return j->buf;
+}
+
+/* 跳过任意一个值 */
+static void hp_agg_json_skip(hp_agg_json *j) {
+    int depth = 0;
+
+    hp_agg_json_ws(j);
+    do {
+        uint32_t len;
+
+        if (j->p >= j->end) {
+            j->bad = 1;
+            return;
+        }
+        switch (*j->p) {
+            case '"':
+                hp_agg_json_string(j, &len);
+                break;
+            case '{': case '[':
+                depth++;
+                j->p++;
+                break;
+            case '}': case ']':
+                depth--;
+                j->p++;
+                break;
+            default:
+                j->p++;
+                break;
+        }
+        hp_agg_json_ws(j);
+    } while (depth > 0 && !j->bad);
+}
+
+/* 数字读成整数, 小数部分舍掉; 不是数字时返回 0 并且跳过这个值 */
+static int hp_agg_json_number(hp_agg_json *j, int64_t *value) {
+    const char *p;
+    int neg = 0;
+    int64_t v = 0;
+
+    hp_agg_json_ws(j);
+    p = j->p;
+    if (p < j->end && *p == '-') {
+        neg = 1;
+        p++;
+    }
+    if (p >= j->end || *p < '0' || *p > '9') {
+        hp_agg_json_skip(j);
+        return 0;
+    }
+    while (p < j->end && *p >= '0' && *p <= '9') {
+        v = v * 10 + (*p++ - '0');
+    }
+    if (p < j->end && (*p == '.' || *p == 'e' || *p == 'E')) {
+        char tmp[64];
+        size_t n = 0;
+
+        p = j->p;
+        while (p < j->end && n < sizeof(tmp) - 1 && strchr("+-.0123456789eE", *p)) {
+            tmp[n++] = *p++;
+        }
+        tmp[n] = '\0';
+        *value = (int64_t)strtod(tmp, NULL);
+        j->p = p;
+        return 1;
+    }
+
+    j->p = p;
+    *value = neg ? -v : v;
+    return 1;
+}
+
+/* XHPROF_FLAGS_HISTOGRAM 导出的 wt_p50 wt_max 之类不能相加 */
+static int hp_agg_json_derived(const char *name, uint32_t len) {
+    uint32_t i;
+
+    if (len >= 4 && memcmp(name + len - 4, "_max", 4) == 0) {
+        return 1;
+    }
+    for (i = len; i > 0 && name[i - 1] >= '0' && name[i - 1] <= '9'; i--) {
+    }
+    return i < len && i >= 2 && name[i - 1] == 'p' && name[i - 2] == '_';
+}
+
+/* 一个请求: { "函数名": { "ct": 1, "wt": 2, ... }, ... } */
+static void hp_agg_json_request(hp_agg_worker *worker, hp_agg_json *j) {
+
+    if (!hp_agg_json_eat(j, '{')) {
+        j->bad = 1;
+        return;
+    }
+    if (hp_agg_json_eat(j, '}')) {
+        worker->requests++;
+        return;
+    }
+
+    do {
+        uint32_t len;
+        const char *name = hp_agg_json_string(j, &len);
+        uint32_t index;
+        int64_t sort_value = 0;
+
+        if (!name || !hp_agg_json_eat(j, ':')) {
+            j->bad = 1;
+            return;
+        }
+        hp_agg_json_ws(j);
+        if (j->p >= j->end || *j->p != '{') {
+            //xhprof_sample_disable() 之类的结果, 不是函数行
+            hp_agg_json_skip(j);
+            continue;
+        }
+        j->p++;
+        //名字可能在 j->buf 里, 读下一个字符串之前先放进表
+        index = hp_agg_table_find(&worker->table, name, len, hp_agg_hash(name, len));
+
+        if (!hp_agg_json_eat(j, '}')) {
+            do {
+                const char *key = hp_agg_json_string(j, &len);
+                int64_t v;
+                int id;
+
+                if (!key || !hp_agg_json_eat(j, ':')) {
+                    j->bad = 1;
+                    return;
+                }
+                if (!hp_agg_json_number(j, &v) || hp_agg_json_derived(key, len)) {
+                    continue;
+                }
+                id = hp_agg_key_id(key, len);
+                if (id == HP_AGG_SORT_KEY) {
+                    sort_value = v;
+                }
+                if (id >= 0) {
+                    worker->table.funcs[index].sums[id] += v;
+                }
+            } while (hp_agg_json_eat(j, ','));
+
+            if (!hp_agg_json_eat(j, '}')) {
+                j->bad = 1;
+                return;
+            }
+        }
+
+        hp_agg_func_seen(&worker->table.funcs[index], sort_value);
+    } while (hp_agg_json_eat(j, ','));
+
+    if (!hp_agg_json_eat(j, '}')) {
+        j->bad = 1;
+        return;
+    }
+    worker->requests++;
+}
+
+static int hp_agg_parse_json(hp_agg_worker *worker, const char *data, size_t size) {
+    hp_agg_json j = {data, data + size, 0, NULL, 0};
+
+    hp_agg_json_ws(&j);
+    while (j.p < j.end && !j.bad) {
+        if (hp_agg_json_eat(&j, '[')) {
+            if (!hp_agg_json_eat(&j, ']')) {
+                do {
+                    hp_agg_json_request(worker, &j);
+                } while (!j.bad && hp_agg_json_eat(&j, ','));
+                if (!hp_agg_json_eat(&j, ']')) {
+                    j.bad = 1;
+                }
+            }
+        } else {
+            hp_agg_json_request(worker, &j);
+        }
+        hp_agg_json_ws(&j);
+    }
+
+    free(j.buf);
+    return !j.bad;
+}
+
+/* ------------------------------------------------------------------------
+ * 线程和汇总
+ * ------------------------------------------------------------------------ */
+
+static int hp_agg_parse_file(hp_agg_worker *worker, const hp_agg_file *file) {
+    int fd, ok;
+    void *data;
+
+    if (!file->size) {
+        return 1;
+    }
+
+    fd = open(file->path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "xhprof_agg: %s: %s\n", file->path, strerror(errno));
+        return 0;
+    }
+    data = mmap(NULL, (size_t)file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "xhprof_agg: %s: %s\n", file->path, strerror(errno));
+        return 0;
+    }
+    madvise(data, (size_t)file->size, MADV_SEQUENTIAL);
+
+    if (file->size >= 4 && memcmp(data, "XHPB", 4) == 0) {
+        ok = hp_agg_parse_dump(worker, (const unsigned char *)data, (size_t)file->size);
+    } else {
+        ok = hp_agg_parse_json(worker, (const char *)data, (size_t)file->size);
+    }
+    worker->bytes += (uint64_t)file->size;
+
+    munmap(data, (size_t)file->size);
+
+    if (!ok) {
+        fprintf(stderr, "xhprof_agg: %s: malformed, counted up to the error\n", file->path);
+    }
+    return ok;
+}
+
+static void *hp_agg_worker_run(void *arg) {
+    hp_agg_worker *worker = (hp_agg_worker *)arg;
+
+    //文件按大小从大到小排好了, 谁空了谁取下一个
+    for (;;) {
+        uint32_t i = __atomic_fetch_add(&hp_agg_file_next, 1, __ATOMIC_RELAXED);
+
+        if (i >= hp_agg_file_num) {
+            break;
+        }
+        if (!hp_agg_parse_file(worker, &hp_agg_files[i])) {
+            worker->bad_files++;
+        }
+    }
+
+    return NULL;
+}
+
+/* 把 from 的表加到 to 里 */
+static void hp_agg_reduce(hp_agg_worker *to, hp_agg_worker *from) {
+    uint32_t i, k, b;
+
+    for (i = 0; i < from->table.func_num; i++) {
+        hp_agg_func *src = &from->table.funcs[i];
+        //hp_agg_table_find() 可能 realloc funcs, 先取下标
+        uint32_t index = hp_agg_table_find(&to->table, src->name, src->len, src->hash);
+        hp_agg_func *dst = &to->table.funcs[index];
+
+        dst->requests += src->requests;
+        for (k = 0; k < HP_AGG_MAX_KEYS; k++) {
+            dst->sums[k] += src->sums[k];
+        }
+        if (src->hist) {
+            if (!dst->hist) {
+                dst->hist = src->hist;
+                src->hist = NULL;
+            } else {
+                for (b = 0; b < HP_HIST_BUCKETS; b++) {
+                    dst->hist->counts[b] += src->hist->counts[b];
+                }
+                dst->hist->total += src->hist->total;
+                if (src->hist->max > dst->hist->max) {
+                    dst->hist->max = src->hist->max;
+                }
+            }
+        }
+    }
+
+    to->requests += from->requests;
+    to->bytes += from->bytes;
+    to->bad_files += from->bad_files;
+    if (from->time_min && (!to->time_min || from->time_min < to->time_min)) {
+        to->time_min = from->time_min;
+    }
+    if (from->time_max > to->time_max) {
+        to->time_max = from->time_max;
+    }
+}
+
+static void hp_agg_table_free(hp_agg_worker *worker) {
+    uint32_t i;
+
+    for (i = 0; i < worker->table.func_num; i++) {
+        free(worker->table.funcs[i].name);
+        free(worker->table.funcs[i].hist);
+    }
+    free(worker->table.funcs);
+    free(worker->table.slots);
+    free(worker->name_map);
+    free(worker->rows);
+}
+
+/* ------------------------------------------------------------------------
+ * 输入文件和输出
+ * ------------------------------------------------------------------------ */
+
+static void hp_agg_add_file(const char *path, off_t size) {
+    static uint32_t cap = 0;
+
+    if (hp_agg_file_num == cap) {
+        cap = cap ? cap * 2 : 1024;
+        hp_agg_files = (hp_agg_file *)realloc(hp_agg_files, sizeof(hp_agg_file) * cap);
+    }
+    hp_agg_files[hp_agg_file_num].path = strdup(path);
+    hp_agg_files[hp_agg_file_num].size = size;
+    hp_agg_file_num++;
+}
+
+static int hp_agg_suffix(const char *name, const char *suffix) {
+    size_t n = strlen(name), m = strlen(suffix);
+
+    return n >= m && strcmp(name + n - m, suffix) == 0;
+}
+
+/* 命令行上的文件直接加, 目录只取里面的 .xhpb 和 .json */
+static int hp_agg_add_path(const char *path) {
+    struct stat st;
+    DIR *dir;
+    struct dirent *ent;
+
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "xhprof_agg: %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        hp_agg_add_file(path, st.st_size);
+        return 1;
+    }
+
+    dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "xhprof_agg: %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        char full[4096];
+
+        if (!hp_agg_suffix(ent->d_name, ".xhpb") && !hp_agg_suffix(ent->d_name, ".json")) {
+            continue;
+        }
+        snprintf(full, sizeof(full), "%s/%s", path, ent->d_name);
+        if (stat(full, &st) == 0 && S_ISREG(st.st_mode)) {
+            hp_agg_add_file(full, st.st_size);
+        }
+    }
+    closedir(dir);
+
+    return 1;
+}
+
+static int hp_agg_file_cmp(const void *a, const void *b) {
+    off_t x = ((const hp_agg_file *)a)->size, y = ((const hp_agg_file *)b)->size;
+
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+static double hp_agg_sort_value(const hp_agg_func *func) {
+    double total = (double)func->sums[HP_AGG_SORT_KEY];
+
+    return hp_agg_sort_mean ? (func->requests ? total / (double)func->requests : 0) : total;
+}
+
+static int hp_agg_func_cmp(const void *a, const void *b) {
+    const hp_agg_func *x = *(const hp_agg_func * const *)a, *y = *(const hp_agg_func * const *)b;
+    double vx = hp_agg_sort_value(x), vy = hp_agg_sort_value(y);
+
+    if (vx != vy) {
+        return vx < vy ? 1 : -1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+static void hp_agg_json_print_string(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        } else if (c < 0x20) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+static void hp_agg_print_json(hp_agg_func **sorted, uint32_t num) {
+    uint32_t i, k, q;
+
+    printf("{\n");
+    for (i = 0; i < num; i++) {
+        hp_agg_func *func = sorted[i];
+
+        printf("  ");
+        hp_agg_json_print_string(func->name);
+        printf(": {\"requests\": %llu", (unsigned long long)func->requests);
+        for (k = 0; k < hp_agg_keys.key_num; k++) {
+            if (func->sums[k]) {
+                printf(", \"%s\": %lld", hp_agg_keys.names[k], (long long)func->sums[k]);
+            }
+        }
+        if (func->hist && func->hist->total) {
+            for (q = 0; q < hp_agg_pct_num; q++) {
+                printf(", \"%s_p%g\": %llu", hp_agg_sort_name, hp_agg_pct[q] * 100,
+                        (unsigned long long)hp_hist_percentile(func->hist, hp_agg_pct[q]));
+            }
+            printf(", \"%s_max\": %llu", hp_agg_sort_name, (unsigned long long)func->hist->max);
+        }
+        printf("}%s\n", i + 1 < num ? "," : "");
+    }
+    printf("}\n");
+}
+
+static void hp_agg_print_table(hp_agg_func **sorted, uint32_t num, uint32_t shown, const hp_agg_worker *all) {
+    int ct = hp_agg_key_id("ct", 2);
+    uint32_t i, q;
+    double grand = 0;
+    int width = 8;
+    char head[32];
+
+    for (i = 0; i < num; i++) {
+        grand += (double)sorted[i]->sums[HP_AGG_SORT_KEY];
+    }
+    if (num && grand == 0) {
+        fprintf(stderr, "xhprof_agg: metric '%s' is zero or missing in every input\n", hp_agg_sort_name);
+    }
+    for (i = 0; i < shown; i++) {
+        if ((int)sorted[i]->len > width) {
+            width = (int)sorted[i]->len;
+        }
+    }
+    if (width > 80) {
+        width = 80;
+    }
+
+    printf("%llu requests in %u files, %.1f MB", (unsigned long long)all->requests, hp_agg_file_num,
+            (double)all->bytes / (1024 * 1024));
+    if (all->bad_files) {
+        printf(", %llu malformed", (unsigned long long)all->bad_files);
+    }
+    //JSON 里没有请求时间
+    if (all->time_min) {
+        time_t from = (time_t)(all->time_min / 1000000), to = (time_t)(all->time_max / 1000000);
+        char from_str[32], to_str[32];
+
+        strftime(from_str, sizeof(from_str), "%Y-%m-%d %H:%M:%S", localtime(&from));
+        strftime(to_str, sizeof(to_str), "%Y-%m-%d %H:%M:%S", localtime(&to));
+        printf(", %s .. %s", from_str, to_str);
+    }
+    printf("\n\n");
+
+    //按 ct 排序时不重复 ct 一列
+    if (ct == HP_AGG_SORT_KEY) {
+        printf("%-*s %10s %14s %6s %12s", width, "function", "requests", hp_agg_sort_name, "%", "mean/req");
+    } else {
+        printf("%-*s %10s %12s %14s %6s %12s", width, "function", "requests", "ct", hp_agg_sort_name, "%", "mean/req");
+    }
+    for (q = 0; q < hp_agg_pct_num; q++) {
+        snprintf(head, sizeof(head), "p%g", hp_agg_pct[q] * 100);
+        printf(" %10s", head);
+    }
+    printf(" %10s\n", "max");
+
+    for (i = 0; i < shown; i++) {
+        hp_agg_func *func = sorted[i];
+        double total = (double)func->sums[HP_AGG_SORT_KEY];
+
+        printf("%-*.*s %10llu", width, width, func->name, (unsigned long long)func->requests);
+        if (ct != HP_AGG_SORT_KEY) {
+            printf(" %12lld", (long long)(ct >= 0 ? func->sums[ct] : 0));
+        }
+        printf(" %14lld %6.2f %12.1f", (long long)func->sums[HP_AGG_SORT_KEY],
+                grand > 0 ? total * 100 / grand : 0.0, func->requests ? total / (double)func->requests : 0.0);
+        for (q = 0; q < hp_agg_pct_num; q++) {
+            printf(" %10llu", (unsigned long long)(func->hist ? hp_hist_percentile(func->hist, hp_agg_pct[q]) : 0));
+        }
+        printf(" %10llu\n", (unsigned long long)(func->hist ? func->hist->max : 0));
+    }
+}
+
+static void hp_agg_usage(FILE *out) {
+    fprintf(out,
+        "usage: xhprof_agg [options] FILE|DIR ...\n"
+        "\n"
+        "Merge xhprof.dump files (*.xhpb) and json_encode(xhprof_disable()) results\n"
+        "(*.json: one object, an array of them, or one per line) into per-function\n"
+        "totals. Percentiles are over the per-request values of the sort metric.\n"
+        "\n"
+        "  -s, --sort=METRIC       metric to sort by and take percentiles of (default wt)\n"
+        "  -m, --mean              sort by mean per request instead of the total\n"
+        "  -p, --percentiles=LIST  comma separated, default 50,90,99\n"
+        "  -n, --limit=N           rows to print, 0 for all (default 50)\n"
+        "  -j, --threads=N         worker threads (default: online CPUs)\n"
+        "      --json              print every function and metric as JSON\n"
+        "  -h, --help\n");
+}
+
+int main(int argc, char **argv) {
+    static const struct option long_options[] = {
+        {"sort",        required_argument, NULL, 's'},
+        {"mean",        no_argument,       NULL, 'm'},
+        {"percentiles", required_argument, NULL, 'p'},
+        {"limit",       required_argument, NULL, 'n'},
+        {"threads",     required_argument, NULL, 'j'},
+        {"json",        no_argument,       NULL, 'J'},
+        {"help",        no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    hp_agg_worker *workers;
+    hp_agg_func **sorted;
+    long thread_num = sysconf(_SC_NPROCESSORS_ONLN);
+    long limit = 50;
+    int json = 0, opt, i, status;
+    uint32_t f;
+
+    while ((opt = getopt_long(argc, argv, "s:mp:n:j:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 's':
+                hp_agg_sort_name = optarg;
+                break;
+            case 'm':
+                hp_agg_sort_mean = 1;
+                break;
+            case 'p': {
+                char *s = optarg, *next;
+
+                hp_agg_pct_num = 0;
+                while (*s && hp_agg_pct_num < HP_AGG_MAX_PCT) {
+                    double v = strtod(s, &next);
+
+                    if (next == s || v <= 0 || v > 100) {
+                        fprintf(stderr, "xhprof_agg: bad percentile list '%s'\n", optarg);
+                        return 2;
+                    }
+                    hp_agg_pct[hp_agg_pct_num++] = v / 100;
+                    s = *next == ',' ? next + 1 : next;
+                }
+                break;
+            }
+            case 'n':
+                limit = atol(optarg);
+                break;
+            case 'j':
+                thread_num = atol(optarg);
+                break;
+            case 'J':
+                json = 1;
+                break;
+            case 'h':
+                hp_agg_usage(stdout);
+                return 0;
+            default:
+                hp_agg_usage(stderr);
+                return 2;
+        }
+    }
+
+    if (optind >= argc) {
+        hp_agg_usage(stderr);
+        return 2;
+    }
+
+    //排序指标的编号固定是 HP_AGG_SORT_KEY
+    hp_agg_key_id(hp_agg_sort_name, strlen(hp_agg_sort_name));
+
+    for (i = optind; i < argc; i++) {
+        hp_agg_add_path(argv[i]);
+    }
+    if (!hp_agg_file_num) {
+        fprintf(stderr, "xhprof_agg: no input files\n");
+        return 1;
+    }
+    qsort(hp_agg_files, hp_agg_file_num, sizeof(hp_agg_file), hp_agg_file_cmp);
+
+    if (thread_num < 1) {
+        thread_num = 1;
+    }
+    if (thread_num > (long)hp_agg_file_num) {
+        thread_num = (long)hp_agg_file_num;
+    }
+
+    workers = (hp_agg_worker *)calloc((size_t)thread_num, sizeof(hp_agg_worker));
+    for (i = 1; i < thread_num; i++) {
+        if (pthread_create(&workers[i].thread, NULL, hp_agg_worker_run, &workers[i]) != 0) {
+            thread_num = i;
+            break;
+        }
+    }
+    hp_agg_worker_run(&workers[0]);
+    for (i = 1; i < thread_num; i++) {
+        pthread_join(workers[i].thread, NULL);
+        hp_agg_reduce(&workers[0], &workers[i]);
+        hp_agg_table_free(&workers[i]);
+    }
+
+    sorted = (hp_agg_func **)malloc(sizeof(hp_agg_func *) * (workers[0].table.func_num + 1));
+    for (f = 0; f < workers[0].table.func_num; f++) {
+        sorted[f] = &workers[0].table.funcs[f];
+    }
+    qsort(sorted, workers[0].table.func_num, sizeof(hp_agg_func *), hp_agg_func_cmp);
+
+    if (json) {
+        hp_agg_print_json(sorted, workers[0].table.func_num);
+    } else {
+        uint32_t shown = workers[0].table.func_num;
+
+        if (limit > 0 && (uint32_t)limit < shown) {
+            shown = (uint32_t)limit;
+        }
+        hp_agg_print_table(sorted, workers[0].table.func_num, shown, &workers[0]);
+    }
+
+    status = workers[0].bad_files ? 1 : 0;
+
+    free(sorted);
+    hp_agg_table_free(&workers[0]);
+    free(workers);
+    for (f = 0; f < hp_agg_file_num; f++) {
+        free(hp_agg_files[f].path);
+    }
+    free(hp_agg_files);
+
+    return status;
+}
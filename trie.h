@@ -4,193 +4,339 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-
-#define TRUE 1
-#define FALSE 0
-
-//#define SUB_NODE_COUNT 26
-//#define SUB_NODE_COUNT 94
-#define SUB_NODE_COUNT 127
-#define START_ASCII '!'
-
-typedef struct node {
-    struct node* children[SUB_NODE_COUNT];
-    int flag; // true 代表一个单词的结束  false 还有子节点
-    char character;
-    zend_long func_hash_index;
+#include <string.h>
+
+/* 子节点数超过该值时二分查找, 否则顺序扫描 */
+#define HP_TRIE_LINEAR_SCAN_MAX 16
+/* 单条边标签的最大长度 */
+#define HP_TRIE_LABEL_MAX 0xffff
+
+/**
+ * Path-compressed (radix) trie over the full 256 byte alphabet.
+ *
+ * The whole trie lives in one contiguous block laid out as
+ *
+ *     [hp_trie][nodes ...][first_bytes ...][labels ...]
+ *
+ * Children of a node are stored next to each other and sorted by the first
+ * byte of their edge label, so finding a child is a scan over a few adjacent
+ * bytes in first_bytes instead of a pointer chase through a 127 slot array.
+ * A node is 20 bytes, so a list of 1k namespaced methods needs a few tens of
+ * KB in total and a lookup touches only a handful of cache lines.
+ *
+ * Besides exact keys a node can hold a prefix key ("Foo:*" is stored as the
+ * prefix "Foo:"), which matches every string going through the node. The
+ * walk remembers the deepest prefix key it passed, so the most specific
+ * pattern wins and an exact key beats any pattern.
+ *
+ * The trie is immutable once built; use hp_trie_build() and hp_trie_free().
+ */
+typedef struct hp_trie_node {
+    uint32_t label_off;        /* 边标签在 labels 中的偏移 */
+    uint16_t label_len;        /* 边标签长度, 根节点为 0 */
+    uint16_t child_num;        /* 子节点个数 */
+    uint32_t first_child;      /* 第一个子节点在 nodes 中的下标 */
+    uint32_t func_hash_index;  /* 0 代表不是一个完整的函数名 */
+    uint32_t prefix_hash_index; /* 以该节点为前缀的模式, 0 代表没有 */
 } hp_trie_node;
 
+typedef struct hp_trie {
+    size_t          size;        /* 整块内存的字节数 */
+    uint32_t        node_num;
+    uint32_t        key_num;
+    int             persistent;
+    hp_trie_node   *nodes;
+    unsigned char  *first_bytes; /* first_bytes[i] 为 nodes[i] 边标签的首字节 */
+    unsigned char  *labels;
+} hp_trie;
+
+/* 构建字典树的输入 */
+typedef struct hp_trie_key {
+    const char *str;
+    size_t      len;
+    uint32_t    func_hash_index;
+    int         prefix;          /* 1: 前缀模式, str 不含结尾的 '*' */
+} hp_trie_key;
+
+/* 遍历状态: 当前节点 以及该节点边标签已匹配的长度 */
+typedef struct hp_trie_cursor {
+    uint32_t node;
+    uint32_t matched;
+} hp_trie_cursor;
+
+typedef struct hp_trie_builder {
+    hp_trie      *trie;
+    hp_trie_key  *keys;
+    size_t        label_used;
+} hp_trie_builder;
+
+static int hp_trie_key_cmp(const void *a, const void *b) {
+    const hp_trie_key *ka = (const hp_trie_key *)a;
+    const hp_trie_key *kb = (const hp_trie_key *)b;
+    size_t len = ka->len < kb->len ? ka->len : kb->len;
+    int ret = memcmp(ka->str, kb->str, len);
+
+    if (ret) {
+        return ret;
+    }
+    if (ka->len != kb->len) {
+        return ka->len < kb->len ? -1 : 1;
+    }
+    if (ka->prefix != kb->prefix) {
+        return ka->prefix < kb->prefix ? -1 : 1;
+    }
 
-hp_trie_node* hp_create_node(char c, int flag) {
-    hp_trie_node* n = emalloc(sizeof(hp_trie_node));
-    n->character = c;
-    n->flag = flag;
-    n->func_hash_index = NULL;
-
-    int i;
-    for (i = 0; i < SUB_NODE_COUNT; i++) {
-        n->children[i] = NULL;
+    //同名的函数保留先出现的 index
+    if (ka->func_hash_index != kb->func_hash_index) {
+        return ka->func_hash_index < kb->func_hash_index ? -1 : 1;
     }
-    return n;
+    return 0;
 }
 
-hp_trie_node* hp_create_root() {
-    hp_trie_node *root = hp_create_node('$', FALSE);
-    return root;
-}
+/**
+ * Fill node_idx whose edge label ends at depth from the sorted keys [lo, hi),
+ * all of which share the first depth bytes.
+ */
+static void hp_trie_build_node(hp_trie_builder *b, uint32_t node_idx, uint32_t lo, uint32_t hi, size_t depth) {
+    hp_trie *trie = b->trie;
+    hp_trie_key *keys = b->keys;
+    uint32_t i, glo, child, groups = 0;
+
+    //在该节点结束的 key: 最多一个完整函数名和一个前缀模式, 排序后完整函数名在前
+    while (lo < hi && keys[lo].len == depth) {
+        if (keys[lo].prefix) {
+            trie->nodes[node_idx].prefix_hash_index = keys[lo].func_hash_index;
+        } else {
+            trie->nodes[node_idx].func_hash_index = keys[lo].func_hash_index;
+        }
+        lo++;
+    }
 
-//创建和初始化trie树
-void hp_trie_init_root(hp_trie_node **root_ptr) {
-    if (*root_ptr) {
-        hp_efree_trie(*root_ptr);
+    for (i = lo; i < hi; i++) {
+        if (i == lo || keys[i].str[depth] != keys[i - 1].str[depth]) {
+            groups++;
+        }
     }
 
-    (*root_ptr) = hp_create_root();
-}
+    trie->nodes[node_idx].first_child = trie->node_num;
+    trie->nodes[node_idx].child_num = (uint16_t)groups;
+    child = trie->node_num;
+    trie->node_num += groups;
 
-int append_node(hp_trie_node* n, char c) {
+    for (glo = lo; glo < hi; child++) {
+        uint32_t ghi = glo + 1;
+        size_t lcp = depth + 1;
+        hp_trie_key *first = &keys[glo];
+        hp_trie_key *last;
+        hp_trie_node *n = &trie->nodes[child];
 
-    //hp_trie_node* child_ptr =  n->children[c - START_ASCII];
-    hp_trie_node* child_ptr =  n->children[c];
+        while (ghi < hi && keys[ghi].str[depth] == first->str[depth]) {
+            ghi++;
+        }
+        last = &keys[ghi - 1];
 
-    if (child_ptr) {
-        return FALSE;
+        //同组内排序后首尾两个 key 的公共前缀即整组的公共前缀
+        while (lcp < first->len && lcp < last->len && lcp - depth < HP_TRIE_LABEL_MAX
+                && first->str[lcp] == last->str[lcp]) {
+            lcp++;
+        }
 
-    } else {
-        //n->children[c - START_ASCII] = hp_create_node(c, FALSE);
-        n->children[c] = hp_create_node(c, FALSE);
-        return TRUE;
+        n->label_off = (uint32_t)b->label_used;
+        n->label_len = (uint16_t)(lcp - depth);
+        n->child_num = 0;
+        n->first_child = 0;
+        n->func_hash_index = 0;
+        n->prefix_hash_index = 0;
+        memcpy(trie->labels + b->label_used, first->str + depth, lcp - depth);
+        b->label_used += lcp - depth;
+        trie->first_bytes[child] = (unsigned char)first->str[depth];
+
+        hp_trie_build_node(b, child, glo, ghi, lcp);
+        glo = ghi;
     }
 }
 
-int hp_trie_add_word(hp_trie_node* root, char* str, zend_long func_hash_index) {
-    char c = *str;
-    hp_trie_node* ptr = root;
-    int flag = TRUE;
-    while(c != '\0') {
-        if (!append_node(ptr, c)) {
-            flag = FALSE;
-        }
-        //ptr = ptr->children[c - START_ASCII];
-        ptr = ptr->children[c];
-        c = *(++str);
+/**
+ * Build an immutable trie from keys. The keys array is reordered.
+ * Duplicate names keep the first func_hash_index. Returns NULL on failure.
+ */
+static hp_trie *hp_trie_build(hp_trie_key *keys, uint32_t key_num, int persistent) {
+    hp_trie_builder b;
+    hp_trie *trie;
+    size_t label_total = 0;
+    size_t node_cap, size;
+    uint32_t i, uniq = 0;
+
+    for (i = 0; i < key_num; i++) {
+        label_total += keys[i].len;
     }
 
-    if (!ptr->flag) {
-        flag = FALSE;
-        ptr->flag = TRUE;
-        ptr->func_hash_index = func_hash_index;
-    }
-    return !flag;
-}
+    qsort(keys, key_num, sizeof(hp_trie_key), hp_trie_key_cmp);
 
-//释放trie数内存
-void hp_efree_trie(hp_trie_node* root) {
-    if (!root) {
-        return;
+    for (i = 0; i < key_num; i++) {
+        if (uniq > 0 && keys[uniq - 1].len == keys[i].len && keys[uniq - 1].prefix == keys[i].prefix
+                && memcmp(keys[uniq - 1].str, keys[i].str, keys[i].len) == 0) {
+            continue;
+        }
+        keys[uniq++] = keys[i];
     }
 
-    if (root->flag) {
-        efree(root);
-        return;
-    }
+    /* 每个 key 最多增加一个叶子节点和一个分裂节点, 超长标签会被切成多段 */
+    node_cap = 2 * (size_t)uniq + 1 + label_total / HP_TRIE_LABEL_MAX;
+    size = ZEND_MM_ALIGNED_SIZE(sizeof(hp_trie))
+        + node_cap * sizeof(hp_trie_node)
+        + ZEND_MM_ALIGNED_SIZE(node_cap)
+        + label_total + 1;
 
-    int i;
-    for (i = 0; i < SUB_NODE_COUNT; i++) {
-        hp_efree_trie(root->children[i]);
+    trie = (hp_trie *)pemalloc(size, persistent);
+    if (!trie) {
+        return NULL;
     }
+    memset(trie, 0, size);
+
+    trie->size = size;
+    trie->persistent = persistent;
+    trie->key_num = uniq;
+    trie->nodes = (hp_trie_node *)((char *)trie + ZEND_MM_ALIGNED_SIZE(sizeof(hp_trie)));
+    trie->first_bytes = (unsigned char *)(trie->nodes + node_cap);
+    trie->labels = trie->first_bytes + ZEND_MM_ALIGNED_SIZE(node_cap);
+    trie->node_num = 1;
+
+    b.trie = trie;
+    b.keys = keys;
+    b.label_used = 0;
+    hp_trie_build_node(&b, 0, 0, uniq, 0);
+
+    return trie;
 }
 
-void traversal(hp_trie_node* root, char* str) {
-
-    if (!root) {
-        return;
+//释放trie树内存
+static void hp_trie_free(hp_trie *trie) {
+    if (trie) {
+        pefree(trie, trie->persistent);
     }
+}
 
-    int len_of_str = strlen(str);
-    char* new_str = malloc(len_of_str+1);
-    strcpy(new_str, str);
-    new_str[len_of_str] = root->character;
+static zend_always_inline uint32_t hp_trie_find_child(const hp_trie *trie, const hp_trie_node *n, unsigned char c) {
+    const unsigned char *fb = trie->first_bytes + n->first_child;
+    uint32_t lo = 0, hi = n->child_num;
 
-    if (root->flag) {
-        //输出
-        char* str_for_print = malloc(len_of_str+2);
-        strcpy(str_for_print, new_str);
-        str_for_print[len_of_str+1] = '\0';
-        php_printf("ttttttttttt\t%s\n", str_for_print);
-        free(str_for_print);
+    if (hi <= HP_TRIE_LINEAR_SCAN_MAX) {
+        for (; lo < hi; lo++) {
+            if (fb[lo] >= c) {
+                return fb[lo] == c ? n->first_child + lo : 0;
+            }
+        }
+        return 0;
     }
 
-    int i;
-
-    for (i = 0; i < SUB_NODE_COUNT; i++) {
-        traversal(root->children[i], new_str);
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) >> 1;
+        if (fb[mid] < c) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
-    free(new_str);
+
+    /* 子节点下标不会是 0 (根节点), 0 代表没找到 */
+    return (lo < n->child_num && fb[lo] == c) ? n->first_child + lo : 0;
 }
 
-int hp_trie_check_func(hp_trie_node* root, zend_string *class_name, char split_char, zend_string *function_name ) {
+/**
+ * Advance cursor over str. Returns 0 as soon as str leaves the trie.
+ * When prefix isn't NULL it receives the deepest prefix key passed on the
+ * way (it is left alone if there is none).
+ */
+static zend_always_inline int hp_trie_walk(const hp_trie *trie, hp_trie_cursor *cur, const char *str, size_t len, uint32_t *prefix) {
+    const unsigned char *s = (const unsigned char *)str;
 
-    hp_trie_node* ptr = root;
-    int i;
+    while (len) {
+        const hp_trie_node *n = &trie->nodes[cur->node];
+        size_t step;
 
-    if (class_name != NULL) {
-        for (i = 0; i < ZSTR_LEN(class_name); i++) {
-            if (!ptr) {
-                return FALSE;
+        if (cur->matched == n->label_len) {
+            uint32_t child;
+
+            if (prefix && n->prefix_hash_index) {
+                *prefix = n->prefix_hash_index;
             }
-            ptr = ptr->children[class_name->val[i]];
-        }
 
-        for (i = 0; i < 1; i++) {
-            if (!ptr) {
-                return FALSE;
+            child = hp_trie_find_child(trie, n, *s);
+            if (!child) {
+                return 0;
             }
-            ptr = ptr->children[split_char];
+            //首字节已经在 first_bytes 中比较过
+            cur->node = child;
+            cur->matched = 1;
+            s++;
+            len--;
+            continue;
         }
-    }
 
-    for (i = 0; i < ZSTR_LEN(function_name); i++) {
-        if (!ptr) {
-            return FALSE;
+        step = n->label_len - cur->matched;
+        if (step > len) {
+            step = len;
         }
-        ptr = ptr->children[function_name->val[i]];
+        if (memcmp(trie->labels + n->label_off + cur->matched, s, step)) {
+            return 0;
+        }
+        cur->matched += step;
+        s += step;
+        len -= step;
     }
 
-    if (ptr && ptr->flag) {
-        return ptr->func_hash_index;
+    return 1;
+}
+
+static zend_always_inline zend_long hp_trie_cursor_value(const hp_trie *trie, const hp_trie_cursor *cur) {
+    const hp_trie_node *n = &trie->nodes[cur->node];
+
+    return cur->matched == n->label_len ? n->func_hash_index : 0;
+}
+
+/* 遍历结束时: 完整匹配的 key, 否则最深的前缀模式 ('*' 匹配空串也算) */
+static zend_always_inline zend_long hp_trie_cursor_match(const hp_trie *trie, const hp_trie_cursor *cur, uint32_t prefix) {
+    const hp_trie_node *n = &trie->nodes[cur->node];
 
-    } else {
-        return FALSE;
+    if (cur->matched == n->label_len) {
+        if (n->func_hash_index) {
+            return n->func_hash_index;
+        }
+        if (n->prefix_hash_index) {
+            return n->prefix_hash_index;
+        }
     }
+    return prefix;
 }
 
-int hp_trie_check(hp_trie_node* root, char* word, int len) {
-    hp_trie_node* ptr = root;
-    if (len == NULL) {
-        len = strlen(word);
+/**
+ * Index of "class_name<split_char>function_name" (or function_name when
+ * class_name is NULL): the exact key if there is one, otherwise the most
+ * specific prefix pattern matching it, otherwise 0.
+ */
+static zend_long hp_trie_check_func(const hp_trie *trie, zend_string *class_name, char split_char, zend_string *function_name) {
+    hp_trie_cursor cur = {0, 0};
+    uint32_t prefix = 0;
+
+    if (!trie) {
+        return 0;
     }
 
-    int i;
-    for (i = 0; i < len; i++) {
-        if (!ptr) {
-            return FALSE;
+    if (class_name != NULL) {
+        if (!hp_trie_walk(trie, &cur, ZSTR_VAL(class_name), ZSTR_LEN(class_name), &prefix)
+                || !hp_trie_walk(trie, &cur, &split_char, 1, &prefix)) {
+            return prefix;
         }
-        //ptr = ptr->children[word[i] - START_ASCII];
-        ptr = ptr->children[word[i]];
     }
-    if (ptr && ptr->flag) {
-        return ptr->func_hash_index;
-        //return TRUE;
 
-    } else {
-        return FALSE;
+    if (!hp_trie_walk(trie, &cur, ZSTR_VAL(function_name), ZSTR_LEN(function_name), &prefix)) {
+        return prefix;
     }
+
+    return hp_trie_cursor_match(trie, &cur, prefix);
 }
 
-#undef TRUE 
-#undef FALSE
-#undef SUB_NODE_COUNT
-#undef START_ASCII
+#undef HP_TRIE_LINEAR_SCAN_MAX
 
 #endif
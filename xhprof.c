@@ -26,14 +26,32 @@
 
 #include "php.h"
 #include "php_ini.h"
+#include "SAPI.h"
 #include "ext/standard/info.h"
 #include "php_xhprof.h"
 #include "trie.h"
+#include "perf.h"
+#include "hist.h"
+#include "phf.h"
+#include "bloom.h"
 #include "zend_extensions.h"
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <ctype.h>
+#include <sys/mman.h>
+#include "zend_smart_str.h"
+#if PHP_VERSION_ID >= 80000
+# include "zend_observer.h"
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+# include <cpuid.h>
+# define HP_HAVE_TSC 1
+#endif
 #ifdef __FreeBSD__
 # if __FreeBSD_version >= 700110
 #   include <sys/resource.h>
@@ -82,8 +100,35 @@
 /* Size of a temp scratch buffer            */
 #define SCRATCH_BUF_LEN            512
 
+/* TSC 频率缓存文件, 放在 xhprof.output_dir 下 */
+#define HP_TSC_CACHE_FILE          "xhprof_tsc.cache"
+
+/* 没有其他办法得到 TSC 频率时, 测量的时长 (微秒) */
+#define HP_TSC_MEASURE_US          2000
+
 #define XHPROF_ALGORITHM_HASH 1   // hash 查找
 #define XHPROF_ALGORITHM_TRIE 2   // trie 树查找
+#define XHPROF_ALGORITHM_PHF  3   // 最小完美 hash 查找
+#define XHPROF_ALGORITHM_AUTO 0   // 按函数列表的大小选 HASH 或 PHF
+
+/* XHPROF_ALGORITHM_AUTO: 完全匹配的函数名超过这么多时用 PHF, 否则开放寻址表
+ * 的第一个槽位基本就命中, 不比多读一次 pilot 慢 */
+#define HP_PHF_AUTO_MIN 16
+
+/* 时钟源, 由 xhprof.clock_source 选择 */
+#define HP_CLOCK_AUTO        0   /* 有 invariant TSC 时用 tsc, 否则 monotonic */
+#define HP_CLOCK_TSC         1   /* invariant TSC, rdtscp, 不绑定 CPU */
+#define HP_CLOCK_MONOTONIC   2   /* clock_gettime(CLOCK_MONOTONIC), 走 vDSO */
+#define HP_CLOCK_TSC_PINNED  3   /* rdtsc + 绑定到随机 CPU, 用于没有 invariant TSC 的老机器 */
+
+/* CPU 时间的来源, 由 xhprof.cpu_clock 选择 */
+#define HP_CPU_CLOCK_AUTO            0   /* 能用 perf 就用 perf, 否则 thread_cputime */
+#define HP_CPU_CLOCK_PERF            1   /* perf task clock 的 mmap 页, 用户态读取, 没有系统调用 */
+#define HP_CPU_CLOCK_THREAD_CPUTIME  2   /* clock_gettime(CLOCK_THREAD_CPUTIME_ID) */
+#define HP_CPU_CLOCK_GETRUSAGE       3   /* getrusage(RUSAGE_SELF), 原来的方式 */
+
+/* 校验 perf task clock 时比较的时长 (纳秒) */
+#define HP_CPU_PERF_VALIDATE_NS      200000
 
 /* profiling flags.
  *
@@ -94,6 +139,11 @@
 #define XHPROF_FLAGS_NO_BUILTINS   0x0001         /* do not profile builtins */
 #define XHPROF_FLAGS_CPU           0x0002      /* gather CPU times for funcs */
 #define XHPROF_FLAGS_MEMORY        0x0004   /* gather memory usage for funcs */
+#define XHPROF_FLAGS_PERF          0x0008   /* gather hardware counters for funcs */
+#define XHPROF_FLAGS_HISTOGRAM     0x0010   /* wall time histogram for funcs */
+#define XHPROF_FLAGS_EXCLUSIVE     0x0020   /* exclusive wall/cpu time for funcs */
+#define XHPROF_FLAGS_EDGES         0x0040   /* caller==>callee stats between tracked funcs */
+#define XHPROF_FLAGS_PATTERN_DETAIL 0x0080  /* per function rows under each pattern */
 
 #if !defined(uint64)
 typedef unsigned long long uint64;
@@ -106,43 +156,225 @@ typedef unsigned char uint8;
 #endif
 
 //hp_globals.stats_count 单个元素的 hash table index
+#define HP_STATS_ACTIVE      0  //不导出: 函数当前在栈上的层数, 递归调用的耗时只算最外层
 #define HP_STATS_COUNT_CT    1 
 #define HP_STATS_COUNT_WT    2 
 #define HP_STATS_COUNT_CPU   3 
 #define HP_STATS_COUNT_MU    4 
 #define HP_STATS_COUNT_PMU   5 
+#define HP_STATS_COUNT_INSTRUCTIONS   6  //XHPROF_FLAGS_PERF 硬件计数器, 顺序与 hp_perf_counter_open() 一致
+#define HP_STATS_COUNT_CYCLES         7
+#define HP_STATS_COUNT_LLC_MISSES     8
+#define HP_STATS_COUNT_BRANCH_MISSES  9
+#define HP_STATS_COUNT_EWT   10  //XHPROF_FLAGS_EXCLUSIVE 去掉被抓取的子函数之后的耗时
+#define HP_STATS_COUNT_ECPU  11
 
-#define HP_STATS_KEY_NUM   6 //统计的数据种类 比 HP_STATS_COUNT_XX定义的最大值多1
+#define HP_STATS_KEY_NUM   12 //统计的数据种类 比 HP_STATS_COUNT_XX定义的最大值多1
+
+/* hp_globals.stats_count 是一整块连续内存, 每个函数一行, 每行对齐到 64 字节 */
+#define HP_STATS_ALIGN     64
+#define HP_STATS_ROW_LEN   ((HP_STATS_KEY_NUM * sizeof(zend_long) + HP_STATS_ALIGN - 1) / HP_STATS_ALIGN * HP_STATS_ALIGN / sizeof(zend_long))
+#define HP_STATS(index, key) (hp_globals.stats_count[(size_t)(index) * HP_STATS_ROW_LEN + (key)])
 
 #define CLASS_FUNC_SPLIT_CHAR ':' //类名函数名连接的字符
 
+/* 两个字符串 hash 合成 hp_name_slot 的 key */
+#define HP_NAME_HASH_MIX(class_hash, func_hash) \
+    hp_mix64((uint64)(class_hash) * 0x9E3779B97F4A7C15ULL ^ (uint64)(func_hash))
+
+/* PHP 8 的 observer API, 不替换 zend_execute_ex, opcache JIT 可以继续工作.
+ * 8.2 之前只观察用户函数, 内部函数仍然用 zend_execute_internal */
+#if PHP_VERSION_ID >= 80000
+# define HP_HAVE_OBSERVER 1
+# if PHP_VERSION_ID >= 80200
+#  define HP_OBSERVER_INTERNAL 1
+# endif
+#endif
+
+/* 引擎钩子: EXECUTE_EX / EXECUTE_INTERNAL 从 MINIT 装到 MSHUTDOWN, INTERRUPT 只在采样期间 (hp_hooks_update()) */
+#define HP_HOOK_EXECUTE_EX        0x1
+#define HP_HOOK_EXECUTE_INTERNAL  0x2
+#define HP_HOOK_INTERRUPT         0x4
+#define HP_HOOK_NUM               3
+
+/* xhprof_sample_enable(): 需要 timer_create() 和线程 CPU 时间时钟 */
+#if defined(HAVE_TIMER_CREATE) && defined(CLOCK_THREAD_CPUTIME_ID)
+# define HP_HAVE_SAMPLE 1
+# ifdef SIGRTMIN
+/* 不能用 SIGPROF, PHP 的 max_execution_time 在 Linux 上用的是它 */
+#  define HP_SAMPLE_SIGNAL (SIGRTMIN + 5)
+# else
+#  define HP_SAMPLE_SIGNAL SIGPROF
+# endif
+# if defined(SIGEV_THREAD_ID) && !defined(sigev_notify_thread_id)
+#  define sigev_notify_thread_id _sigev_un._tid
+# endif
+#endif
+
+/* xhprof.dump: 写文件在后台线程里做 */
+#if defined(HAVE_PTHREAD_CREATE)
+# define HP_HAVE_DUMP 1
+# include "dump.h"
+#endif
+
+/* 一个采样记录: 权重, 深度, 然后是从内到外的 frame id */
+#define HP_SAMPLE_MAX_DEPTH    62
+#define HP_SAMPLE_RECORD_LEN   (HP_SAMPLE_MAX_DEPTH + 2)
+#define HP_SAMPLE_TRUNCATED    0x80000000u   /* 深度字段的标志位: 栈超过 HP_SAMPLE_MAX_DEPTH 被截断 */
+
+/* XHPROF_FLAGS_EDGES 的开放寻址表, 大小固定, 最多装 3/4 */
+#define HP_EDGE_TABLE_BITS   12
+#define HP_EDGE_TABLE_SIZE   (1 << HP_EDGE_TABLE_BITS)
+#define HP_EDGE_TABLE_MAX    (HP_EDGE_TABLE_SIZE / 4 * 3)
+#define HP_EDGE_KEY(parent, child)  (((uint64)(uint32)(parent) << 32) | (uint32)(child))
+
+/* 共享内存里每个 worker 的 slab 头, 占一个 cache line */
+#define HP_SHM_SLAB_HEADER   64
+
+/* 函数是否需要捕获的缓存, 槽位数必须是 2 的幂 */
+#define HP_FUNC_CACHE_BITS   11
+#define HP_FUNC_CACHE_SIZE   (1 << HP_FUNC_CACHE_BITS)
+#define HP_FUNC_CACHE_SLOT(func) \
+    ((uint32)((((uintptr_t)(func) >> 3) * 0x9E3779B97F4A7C15ULL) >> (64 - HP_FUNC_CACHE_BITS)))
+
 /**
  * *****************************
  * GLOBAL DATATYPES AND TYPEDEFS
  * *****************************
  */
 
-/* XHProf maintains a stack of entries being profiled. The memory for the entry
- * function. Often, this is just C-stack memory.
+/* XHProf maintains a stack of entries being profiled.
  *
- * This structure is a convenient place to track start time of a particular
- * profile operation, recursion depth, and the name of the function being
- * profiled. */
+ * The stack is one contiguous array indexed by depth (hp_globals.frames),
+ * allocated once per thread and grown by doubling, so entering a tracked
+ * function is a bump of hp_globals.frame_depth. Each frame is this header
+ * followed by only the parts the enabled flags need (hp_frame_part), at
+ * offsets fixed by hp_frames_layout() for the whole xhprof_enable(); with
+ * no flags a frame is the 16 byte header. The caller's frame is the one
+ * just below, so no link is stored. */
 typedef struct hp_entry_t {
-    int                     rlvl_hprof;        /* recursion level for function */
     uint64                  tsc_start;         /* start value for TSC counter  */
-    long int                mu_start_hprof;                    /* memory usage */
-    long int                pmu_start_hprof;              /* peak memory usage */
-    struct rusage           ru_start_hprof;             /* user/sys time start */
-    struct hp_entry_t      *prev_hprof;    /* ptr to prev entry being profiled */
-    zend_long               func_hash_index;     /* func_hash_index for the function name  */
+    uint32                  func_hash_index;   /* func_hash_index for the function name  */
+    int                     rlvl_hprof;        /* recursion level for function */
 } hp_entry_t;
 
+/* 帧里按 flags 追加的部分, 偏移为 0 表示没有 */
+typedef enum hp_frame_part {
+    HP_FRAME_CPU = 0,           /* uint64 cpu_start, 纳秒 */
+    HP_FRAME_MEMORY,            /* hp_frame_memory */
+    HP_FRAME_PERF,              /* uint64[HP_PERF_COUNTER_NUM] 硬件计数器起始值 */
+    HP_FRAME_EXCLUSIVE,         /* hp_frame_exclusive */
+    HP_FRAME_PATTERN,           /* hp_frame_pattern */
+    HP_FRAME_EXECUTE_DATA,      /* zend_execute_data *, observer 返回时用来配对 */
+    HP_FRAME_PART_NUM
+} hp_frame_part;
+
+typedef struct hp_frame_memory {
+    zend_long               mu_start_hprof;    /* memory usage */
+    zend_long               pmu_start_hprof;   /* peak memory usage */
+} hp_frame_memory;
+
+typedef struct hp_frame_exclusive {
+    uint64                  child_ticks;       /* 被抓取的子函数的耗时 (时钟 tick) */
+    uint64                  child_cpu;         /* 被抓取的子函数的 CPU 时间 (纳秒) */
+} hp_frame_exclusive;
+
+typedef struct hp_frame_pattern {
+    uint32                  pattern_index;     /* XHPROF_FLAGS_PATTERN_DETAIL: 所属模式的行, 0 为没有 */
+    int                     prlvl_hprof;       /* 所属模式在栈上的层数 */
+} hp_frame_pattern;
+
+#define HP_FRAME(depth) ((hp_entry_t *)(hp_globals.frames + (size_t)(depth) * hp_globals.frame_size))
+#define HP_FRAME_PART(entry, part, type) ((type *)((char *)(entry) + hp_globals.frame_off[part]))
+
+/* Cached tracking decision for one zend_function.
+ *
+ * The answer for a function only depends on its name and scope, which are
+ * compared as well so that a zend_function address reused by another
+ * function (closures, eval) never picks up a stale answer. Entries written
+ * under an older generation are ignored. */
+typedef struct hp_func_cache_entry {
+    zend_function          *func;
+    zend_string            *function_name;
+    zend_class_entry       *scope;
+    uint32                  generation;
+    uint32                  func_hash_index;   /* 0: 不捕获 */
+} hp_func_cache_entry;
+
+/* One exact name of a track list in the XHPROF_ALGORITHM_HASH table.
+ *
+ * The key is built from the hashes of the class and function names, which
+ * PHP already keeps in every zend_string, so a lookup neither builds
+ * "Class:func" nor hashes it. The names point into the list's own strings
+ * and are compared on a key match. */
+typedef struct hp_name_slot {
+    uint64                  key;            /* HP_NAME_HASH_MIX, 0 为空槽位 */
+    const char             *class_name;     /* 普通函数为 NULL */
+    const char             *function_name;
+    uint32                  class_len;
+    uint32                  function_len;
+    uint32                  index;
+} hp_name_slot;
+
+/* Compiled list of functions to track.
+ *
+ * Index 0 is reserved for "not tracked", names[i] is the original name of
+ * the function whose stats live in row i. A list is immutable once built.
+ *
+ * Besides exact names a list may hold patterns: "Foo:*" or "App\*" (a
+ * trailing '*' matches any rest of the name, resolved by the trie) and
+ * "*:method" (a method of any class, resolved by method_patterns). All
+ * calls matching a pattern share its row.
+ * The one built from the xhprof.track_functions INI settings is persistent,
+ * created in MINIT and shared (copy-on-write) by all forked workers. */
+typedef struct hp_track_list {
+    uint32_t        func_num;      /* 包含保留的 0 号位置 */
+    int             persistent;
+    zend_string   **names;         /* names[index] 原始函数名 */
+    hp_name_slot   *slots;         /* XHPROF_ALGORITHM_HASH 的开放寻址表, 2 的幂个槽位 */
+    uint32_t        slot_mask;
+    uint32_t        exact_num;     /* 完全匹配的函数名个数 */
+    hp_phf         *phf;           /* XHPROF_ALGORITHM_PHF, 没有构建或构建失败时为 NULL */
+    hp_name_slot   *phf_slots;     /* phf_slots[hp_phf_lookup(key)], exact_num 个, 没有空槽位 */
+    hp_bloom       *bloom;         /* 完全匹配的函数名的 key, 有模式时为 NULL */
+    hp_trie        *trie;          /* 字典树, 可能为 NULL */
+    HashTable      *method_patterns; /* "*:method" 的方法名 => index, 可能为 NULL */
+    uint8          *is_pattern;    /* is_pattern[index] 该行是模式 */
+    int             has_prefix;    /* 有以 '*' 结尾的模式, 两种算法都要用字典树 */
+} hp_track_list;
+
+/* Stats of one caller==>callee edge. parent is the nearest tracked
+ * function on the stack, 0 when there is none ("main()"). The child index
+ * is never 0, so key 0 marks an empty slot. */
+typedef struct hp_edge {
+    uint64                  key;        /* HP_EDGE_KEY(parent, child) */
+    zend_long               ct;
+    zend_long               wt;
+} hp_edge;
+
+/* Header of a per-worker slab in the shared memory aggregator. A worker
+ * claims a slab by swapping its pid into owner, the counter rows follow
+ * the header, laid out like hp_globals.stats_count. */
+typedef struct hp_shm_slab {
+    volatile pid_t          owner;
+    uint32                  padding;
+    volatile zend_long      requests;    /* 合并进来的请求数 */
+} hp_shm_slab;
+
+/* A function seen by the sampler, frame ids index an array of these. The
+ * name is built once when the function is first seen in a sample. */
+typedef struct hp_sample_frame {
+    zend_function          *func;
+    zend_string            *function_name;
+    zend_class_entry       *scope;
+    zend_string            *name;          /* "Class:method" 或 "function" */
+} hp_sample_frame;
+
 /* Various types for XHPROF callbacks       */
 typedef void (*hp_init_cb)           (TSRMLS_D);
 typedef void (*hp_exit_cb)           (TSRMLS_D);
-typedef void (*hp_begin_function_cb) (hp_entry_t **entries, hp_entry_t *current   TSRMLS_DC);
-typedef void (*hp_end_function_cb)   (hp_entry_t **entries  TSRMLS_DC);
+typedef void (*hp_begin_function_cb) (hp_entry_t *current   TSRMLS_DC);
+typedef void (*hp_end_function_cb)   (hp_entry_t *top, hp_entry_t *parent  TSRMLS_DC);
 
 /* Struct to hold the various callbacks for a single xhprof mode */
 typedef struct hp_mode_cb {
@@ -152,11 +384,12 @@ typedef struct hp_mode_cb {
     hp_end_function_cb     end_fn_cb;
 } hp_mode_cb;
 
-/* Xhprof's global state.
+/* Xhprof's per-thread state, the module globals.
  *
- * This structure is instantiated once.  Initialize defaults for attributes in
+ * One instance per thread under ZTS, a plain global otherwise; GINIT sets
+ * the defaults. Everything fixed at MINIT lives in hp_shared_t instead.
  */
-typedef struct hp_global_t {
+ZEND_BEGIN_MODULE_GLOBALS(xhprof)
 
     /*       ----------   Global attributes:  -----------       */
 
@@ -166,30 +399,53 @@ typedef struct hp_global_t {
     /* Indicates if xhprof was ever enabled during this request */
     int              ever_enabled;
 
-    /* 抓取的结果 */
-    zend_long             **stats_count;
-
-    //当前执行的函数名 带类名
-    zend_string *cur_func_name;
+    /* 抓取的结果, 按 HP_STATS(index, key) 访问 */
+    zend_long              *stats_count;
+    void                   *stats_count_raw;      //对齐前的地址, 用于释放
+    uint32_t                stats_count_capacity; //已分配的行数, 跨请求复用
 
-    /* Table of function names need track , track all when null */
-    HashTable  *track_function_names; //要抓取的函数 hashtable
-    hp_trie_node *track_function_trie; // 要抓取的函数， 字段树
+    /* 当前生效的要抓取的函数, NULL 时不抓取 */
+    hp_track_list *track_list;
 
     uint32_t track_algorithm;
 
-    //要抓取的函数个数
+    //要抓取的函数个数, 包括 XHPROF_FLAGS_PATTERN_DETAIL 追加的行
     uint32_t stats_count_func_num;
 
-    /* Top of the profile stack */
-    hp_entry_t      *entries;
-
-    /* freelist of hp_entry_t chunks for reuse... */
-    hp_entry_t      *entry_free_list;
+    /* XHPROF_FLAGS_PATTERN_DETAIL: 模式匹配到的具体函数, 行号从 track_list->func_num 开始 */
+    HashTable *detail_ht;         //函数名 => 行号
+    zend_string **detail_names;
+    uint32 *detail_parent;        //所属模式的行号
+    uint32 detail_num;
+    uint32 detail_size;
+
+    /* XHPROF_FLAGS_EDGES: HP_EDGE_TABLE_SIZE 个槽位, 第一次使用时分配, 之后只清零 */
+    hp_edge *edges;
+    uint32_t edges_used;
+    zend_long edges_dropped;      //表满之后丢弃的调用次数
+
+    /* XHPROF_FLAGS_HISTOGRAM: 每个函数一个耗时直方图 (纳秒), 第一次调用时才分配 */
+    hp_hist **hists;
+    uint32_t hists_num;
+
+    /* zend_function => func_hash_index, 每次 xhprof_enable 递增 generation 使其失效 */
+    hp_func_cache_entry *func_cache;
+    uint32 func_cache_generation;
+
+    /* The profile stack: frame_depth frames of frame_size bytes, see hp_entry_t */
+    char            *frames;
+    size_t           frames_bytes;    //已分配的字节数, 跨请求复用
+    size_t           frame_size;
+    uint32           frame_depth;
+    uint32           frame_capacity;  //frames_bytes 能放下的帧数
+    uint16_t         frame_off[HP_FRAME_PART_NUM];
 
     /* Callbacks for various xhprof modes */
     hp_mode_cb       mode_cb;
 
+    /* 本线程需要的 HP_HOOK_XX, 见 hp_hooks_update() */
+    uint32           hooks;
+
     /*       ----------   Mode specific attributes:  -----------       */
 
     /* This array is used to store cpu frequencies for all available logical
@@ -199,20 +455,128 @@ typedef struct hp_global_t {
      * while (for example, every 1 or 5 seconds). */
     double *cpu_frequencies;
 
-    /* The number of logical CPUs this machine has. */
-    uint32 cpu_num;
-
     /* The saved cpu affinity. */
     cpu_set_t prev_mask;
 
     /* The cpu id current process is bound to. (default 0) */
     uint32 cur_cpu_id;
 
+    /* 本线程实际使用的 CPU 时间来源 HP_CPU_CLOCK_XX */
+    uint32 cpu_clock_active;
+
+    /* 当前线程的 perf task clock, 在打开它的进程中才有效 (fork 之后要重新打开) */
+    hp_perf_event cpu_perf_event;
+    pid_t cpu_perf_pid;
+
+    /* XHPROF_FLAGS_PERF 的硬件计数器, 打不开的 fd 为 -1 */
+    hp_perf_event perf_counters[HP_PERF_COUNTER_NUM];
+    pid_t perf_counters_pid;
+    int perf_counters_num;        //成功打开的个数, 0 时 XHPROF_FLAGS_PERF 不起作用
+
     /* XHProf flags */
     uint32 xhprof_flags;
 
+    /*       ----------   Auto profiling:  -----------       */
+
+    /* 当前请求是 RINIT 自动开始的 */
+    int auto_enabled;
+
+    /* 每个 worker 独立的 xorshift 状态, fork 之后按 pid 重新播种 */
+    uint64 rand_state;
+    pid_t rand_pid;
+
+    /*       ----------   Shared memory aggregation:  -----------       */
+
+    /* 当前 worker 使用的 slab, 在 shm_pid 进程里有效 */
+    zend_long *shm_slab;
+    pid_t shm_pid;
+
+    /*       ----------   Sampling mode:  -----------       */
+
+    /* xhprof_sample_enable() 启用中 */
+    int sample_enabled;
+
+    /* 定时器信号处理函数只累加这个计数, 之后第一个 hook 或 VM 中断把栈记到 sample_ring */
+    volatile sig_atomic_t sample_pending;
+
+    /* 预分配的环形缓冲区, sample_ring_size 个 HP_SAMPLE_RECORD_LEN 长的记录, 满了覆盖最旧的 */
+    uint32 *sample_ring;
+    uint32 sample_ring_size;
+    uint32 sample_head;           //下一个要写的记录
+    uint32 sample_num;            //有效记录数
+    uint64 sample_dropped;        //被覆盖的记录数
+
+    /* frame id => 函数, sample_frame_ids: zend_function 地址 => frame id */
+    hp_sample_frame *sample_frames;
+    uint32 sample_frame_num;
+    uint32 sample_frame_size;
+    HashTable sample_frame_ids;
+
+#ifdef HP_HAVE_SAMPLE
+    timer_t sample_timer;
+    struct sigaction sample_prev_action;
+#endif
+
+ZEND_END_MODULE_GLOBALS(xhprof)
+
+/* State computed once in MINIT and only read afterwards (apart from the
+ * hook bookkeeping, which is under hooks_mutex), shared by all threads and
+ * by the workers forked after MINIT. */
+typedef struct hp_shared_t {
+
+    /* xhprof.track_functions(_file) 在 MINIT 时编译, 所有请求共享 */
+    hp_track_list *ini_track_list;
+
+    /* The number of logical CPUs this machine has. */
+    uint32 cpu_num;
+
+    /* 时钟源 HP_CLOCK_XX */
+    uint32 clock_source;
+
+    /* 时钟每微秒的 tick 数, HP_CLOCK_TSC_PINNED 时使用 cpu_frequencies */
+    double clock_ticks_per_us;
+
+    /* CPUID 报告了 invariant TSC */
+    int tsc_invariant;
+
+    /* TSC 频率的来源: cache, sysfs, cpuid, measured */
+    const char *tsc_calibration;
+
+    /* xhprof.cpu_clock 配置的 CPU 时间来源 HP_CPU_CLOCK_XX */
+    uint32 cpu_clock;
+
+    /* xhprof.observer: 用 observer API 代替 zend_execute_ex */
+    int observer;
+
+    /* 装上的 HP_HOOK_XX 和需要它们的线程数, 最后一个线程不用时拆掉 */
+    uint32 hooks;
+    uint32 hook_refs[HP_HOOK_NUM];
+#ifdef ZTS
+    MUTEX_T hooks_mutex;
+#endif
+
+    /* xhprof.sample_rate: 每 N 个请求在 RINIT 自动抓取一个, 0 关闭 */
+    zend_long auto_sample_rate;
+
+    /* xhprof.trigger(_value): 带这个名字的 cookie/header/环境变量的请求总是抓取 */
+    char *auto_trigger;
+    size_t auto_trigger_len;
+    char *auto_trigger_header;     //"HTTP_" + 大写的 trigger, - 换成 _
+    char *auto_trigger_value;
+
+    /* xhprof.auto_flags: 自动抓取时的 XHPROF_FLAGS_XX */
+    uint32 auto_flags;
 
-} hp_global_t;
+    /* MINIT 时 mmap 的匿名共享内存, fork 出的 worker 共用; NULL 表示没开启
+     * 布局: shm_slab_num 个 [hp_shm_slab 头][func_num 行计数] */
+    void *shm;
+    size_t shm_size;
+    uint32 shm_slab_num;
+    size_t shm_slab_size;
+
+    /* xhprof.dump: 每次 hp_stop() 把计数交给写线程 */
+    int dump;
+} hp_shared_t;
 
 
 /**
@@ -220,11 +584,27 @@ typedef struct hp_global_t {
  * GLOBAL STATIC VARIABLES
  * ***********************
  */
-/* XHProf global state */
-static hp_global_t       hp_globals;
+/* XHProf per-thread state */
+ZEND_DECLARE_MODULE_GLOBALS(xhprof)
+
+#if defined(COMPILE_DL_XHPROF) && defined(ZTS)
+ZEND_TSRMLS_CACHE_DEFINE()
+#endif
+
+#define XHPROF_G(v) ZEND_MODULE_GLOBALS_ACCESSOR(xhprof, v)
+#define hp_globals  (*ZEND_MODULE_GLOBALS_BULK(xhprof))
+
+/* XHProf state shared by all threads */
+static hp_shared_t       hp_shared;
+
+/* xhprof_disable() 返回结果中各项指标的 key, MINIT 时创建的 interned string */
+static zend_string      *hp_stats_key_names[HP_STATS_KEY_NUM];
 
 static ZEND_DLEXPORT void (*_zend_execute_ex)(zend_execute_data *execute_data);
 static ZEND_DLEXPORT void (*_zend_execute_internal)(zend_execute_data *execute_data, zval *return_value);
+#if PHP_VERSION_ID >= 70100
+static void (*_zend_interrupt_function)(zend_execute_data *execute_data);
+#endif
 
 ZEND_DLEXPORT void hp_execute_ex (zend_execute_data *execute_data TSRMLS_DC);
 ZEND_DLEXPORT void hp_execute_internal(zend_execute_data *execute_data, zval *return_value);
@@ -235,11 +615,6 @@ static zend_op_array * (*_zend_compile_file) (zend_file_handle *file_handle, int
 /* Pointer to the original compile string function (used by eval) */
 static zend_op_array * (*_zend_compile_string) (zval *source_string, char *filename TSRMLS_DC);
 
-/* Bloom filter for function names to be ignored */
-#define INDEX_2_BYTE(index)  (index >> 3)
-#define INDEX_2_BIT(index)   (1 << (index & 0x7));
-
-
 /**
  * ****************************
  * STATIC FUNCTION DECLARATIONS
@@ -250,14 +625,29 @@ static void hp_register_constants(INIT_FUNC_ARGS);
 static void hp_begin(TSRMLS_DC);
 static void hp_stop(TSRMLS_D);
 static void hp_end(TSRMLS_D);
+static void hp_hooks_update();
+static void hp_hook_install(uint32 hook);
+static void hp_hook_remove(uint32 hook);
+static PHP_GINIT_FUNCTION(xhprof);
+static PHP_GSHUTDOWN_FUNCTION(xhprof);
 
 static inline uint64 cycle_timer();
+static zend_always_inline uint64 hp_monotonic_timer();
+static zend_always_inline uint64 hp_clock_read();
+static zend_always_inline double hp_clock_to_us(uint64 ticks);
+static inline double get_us_from_tsc(uint64 count, double cpu_frequency);
+static uint32 hp_clock_select(const char *name);
+static const char *hp_clock_name(uint32 clock_source);
+static void hp_tsc_calibrate();
+static void hp_cpu_clock_init();
+static void hp_perf_counters_init();
+static void hp_perf_counters_close(zend_xhprof_globals *globals);
+static const char *hp_cpu_clock_name(uint32 cpu_clock);
 static double get_cpu_frequency();
-static void clear_frequencies();
+static void clear_frequencies(zend_xhprof_globals *globals);
 
-static void hp_free_the_free_list();
-static hp_entry_t *hp_fast_alloc_hprof_entry();
-static void hp_fast_free_hprof_entry(hp_entry_t *p);
+static void hp_frames_layout();
+static void hp_frames_grow();
 static void get_all_cpu_frequencies();
 static long get_us_interval(struct timeval *start, struct timeval *end);
 static void incr_us_interval(struct timeval *start, uint64 incr);
@@ -265,9 +655,44 @@ static void incr_us_interval(struct timeval *start, uint64 incr);
 static void init_options_from_arg(uint32_t track_algorithm, HashTable *args, zend_long xhprof_flags);
 
 static inline zval  *hp_zval_at_key(char  *key, HashTable  *values);
-static inline void emalloc_hp_stats_count(uint32_t func_num);
-static inline void efree_hp_stats_count();
-static zend_string *hp_get_function_name();
+static void hp_stats_count_prepare(uint32_t func_num);
+static void hp_stats_count_grow(uint32_t func_num);
+static uint32 hp_detail_row(zend_function *func, uint32 parent);
+static void hp_detail_free();
+static void hp_stats_count_free(zend_xhprof_globals *globals);
+static void hp_stats_count_export(zval *result);
+static void hp_hists_prepare(uint32_t func_num);
+static void hp_hists_free();
+static void hp_hist_export(HashTable *metrics, const hp_hist *hist);
+static void hp_edges_export(zval *result);
+
+static hp_track_list *hp_track_list_create(zend_string **names, uint32_t num, int persistent, int with_trie, int with_phf);
+static void hp_track_list_free(hp_track_list *list);
+static void hp_phf_table_build(hp_track_list *list);
+static void hp_name_table_build(hp_track_list *list);
+static hp_track_list *hp_track_list_from_ini(const char *functions, const char *file);
+static void hp_release_track_list();
+#ifdef HP_HAVE_DUMP
+static void hp_dump_request();
+#endif
+static zend_long hp_resolve_func_hash_index(zend_function *func);
+static zend_long hp_track_list_lookup(hp_track_list *list, zend_function *func, uint32_t algorithm);
+static void hp_func_cache_invalidate();
+static int hp_auto_selected();
+static void hp_shm_init();
+static void hp_shm_fold();
+static void hp_shm_export(zval *result);
+static int hp_sample_start(zend_long interval_us);
+static void hp_sample_stop();
+static void hp_sample_collect(zend_execute_data *execute_data);
+static void hp_sample_export(zval *result);
+static void hp_sample_reset();
+#if PHP_VERSION_ID >= 70100
+static void hp_interrupt_function(zend_execute_data *execute_data);
+#endif
+#ifdef HP_HAVE_OBSERVER
+static zend_observer_fcall_handlers hp_observer_fcall_init(zend_execute_data *execute_data);
+#endif
 
 /* {{{ arginfo */
 ZEND_BEGIN_ARG_INFO(arginfo_xhprof_test, 0)
@@ -281,11 +706,15 @@ ZEND_END_ARG_INFO()
 ZEND_BEGIN_ARG_INFO(arginfo_xhprof_disable, 0)
 ZEND_END_ARG_INFO()
 
-ZEND_BEGIN_ARG_INFO(arginfo_xhprof_sample_enable, 0)
+ZEND_BEGIN_ARG_INFO_EX(arginfo_xhprof_sample_enable, 0, 0, 0)
+ZEND_ARG_INFO(0, interval_us)
 ZEND_END_ARG_INFO()
 
 ZEND_BEGIN_ARG_INFO(arginfo_xhprof_sample_disable, 0)
 ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO(arginfo_xhprof_shm_stats, 0)
+ZEND_END_ARG_INFO()
 /* }}} */
 
 /**
@@ -306,6 +735,9 @@ zend_function_entry xhprof_functions[] = {
         PHP_FE(xhprof_test, arginfo_xhprof_test)
         PHP_FE(xhprof_enable, arginfo_xhprof_enable)
         PHP_FE(xhprof_disable, arginfo_xhprof_disable)
+        PHP_FE(xhprof_sample_enable, arginfo_xhprof_sample_enable)
+        PHP_FE(xhprof_sample_disable, arginfo_xhprof_sample_disable)
+        PHP_FE(xhprof_shm_stats, arginfo_xhprof_shm_stats)
         {NULL, NULL, NULL}
 };
 
@@ -324,16 +756,66 @@ zend_module_entry xhprof_module_entry = {
 #if ZEND_MODULE_API_NO >= 20010901
     XHPROF_VERSION,
 #endif
-    STANDARD_MODULE_PROPERTIES
+    PHP_MODULE_GLOBALS(xhprof),      /* Per-thread state */
+    PHP_GINIT(xhprof),
+    PHP_GSHUTDOWN(xhprof),
+    NULL,
+    STANDARD_MODULE_PROPERTIES_EX
 };
 
 PHP_INI_BEGIN()
 
+    /* 要捕获的函数, 逗号或空白分隔, 例如 "foo, Bar:baz".
+     * 只在 MINIT 时读取一次, 调用 xhprof_enable() 时不传 track_functions
+     * 就使用这里的列表 */
+    PHP_INI_ENTRY("xhprof.track_functions", "", PHP_INI_SYSTEM, NULL)
+
+    /* 要捕获的函数列表文件, 每行一个函数名, # 开头的行为注释 */
+    PHP_INI_ENTRY("xhprof.track_functions_file", "", PHP_INI_SYSTEM, NULL)
+
+    /* 时钟源: auto, tsc, monotonic, pinned_tsc.
+     * auto 在 CPU 支持 invariant TSC 时用 rdtscp, 否则用 clock_gettime,
+     * 两者都不会改变进程的 CPU 亲和性. pinned_tsc 是原来的做法 */
+    PHP_INI_ENTRY("xhprof.clock_source", "auto", PHP_INI_SYSTEM, NULL)
+
+    /* XHPROF_FLAGS_CPU 的 CPU 时间来源: auto, perf, thread_cputime, getrusage */
+    PHP_INI_ENTRY("xhprof.cpu_clock", "auto", PHP_INI_SYSTEM, NULL)
+
+    /* xhprof_sample_enable() 默认的采样间隔, 微秒 CPU 时间 */
+    PHP_INI_ENTRY("xhprof.sample_interval", "10000", PHP_INI_SYSTEM, NULL)
+
+    /* 采样环形缓冲区能放的样本数, 每个样本 256 字节 */
+    PHP_INI_ENTRY("xhprof.sample_buffer_size", "4096", PHP_INI_SYSTEM, NULL)
+
+    /* 每 N 个请求在 RINIT 用 INI 的函数列表自动开始抓取一个, 0 关闭 */
+    PHP_INI_ENTRY("xhprof.sample_rate", "0", PHP_INI_SYSTEM, NULL)
+
+    /* 带这个名字的 cookie, 请求头或环境变量时总是自动抓取, 例如 XHPROF_PROFILE.
+     * xhprof.trigger_value 非空时值必须与之相等 */
+    PHP_INI_ENTRY("xhprof.trigger", "", PHP_INI_SYSTEM, NULL)
+    PHP_INI_ENTRY("xhprof.trigger_value", "", PHP_INI_SYSTEM, NULL)
+
+    /* 自动抓取时的 XHPROF_FLAGS_XX */
+    PHP_INI_ENTRY("xhprof.auto_flags", "0", PHP_INI_SYSTEM, NULL)
+
+    /* 跨请求汇总 INI 函数列表的计数, 共享内存里的 slab 数, 一般设为 FPM 的
+     * pm.max_children; 0 关闭. worker 比 slab 多时会共用 slab */
+    PHP_INI_ENTRY("xhprof.shm_slabs", "0", PHP_INI_SYSTEM, NULL)
+
+    /* PHP 8 上用 observer API 抓取用户函数 (不影响 JIT); 0 时仍然替换 zend_execute_ex */
+    PHP_INI_ENTRY("xhprof.observer", "1", PHP_INI_SYSTEM, NULL)
+
+    /* 抓取栈预分配的层数, 更深时翻倍 */
+    PHP_INI_ENTRY("xhprof.stack_depth", "256", PHP_INI_SYSTEM, NULL)
+
+    /* 每个抓取过的请求结束时把计数追加到 xhprof.output_dir 下的二进制文件, 见 dump.h */
+    PHP_INI_ENTRY("xhprof.dump", "0", PHP_INI_SYSTEM, NULL)
+
     /* output directory:
-     * Currently this is not used by the extension itself.
-     * But some implementations of iXHProfRuns interface might
-     * choose to save/restore XHProf profiler runs in the
-     * directory specified by this ini setting.
+     * xhprof.dump files and the TSC frequency cache go here. Some
+     * implementations of iXHProfRuns interface might also choose to
+     * save/restore XHProf profiler runs in the directory specified by
+     * this ini setting.
      */
     PHP_INI_ENTRY("xhprof.output_dir", "", PHP_INI_ALL, NULL)
 
@@ -355,22 +837,29 @@ PHP_FUNCTION(xhprof_test) {
 }
 
 /**
- * Start XHProf profiling in hierarchical mode.
+ * Start XHProf profiling in hierarchical mode. A profile that is already
+ * running (e.g. started from RINIT by xhprof.auto_sample_rate) is stopped
+ * first, as xhprof_disable() would, before the new options are applied.
  *
  * @param  long $flags  flags for hierarchical mode
  * @return void
  * @author kannan
  */
 PHP_FUNCTION(xhprof_enable) {
-    zend_long  track_algorithm; //捕获使用的算法, hash查找， trie数查找
-    zend_long  xhprof_flags; //捕获CPU 内存信息 配置
-    HashTable *optional_array;
+    zend_long  track_algorithm = XHPROF_ALGORITHM_TRIE; //捕获使用的算法, hash查找， trie数查找, 最小完美 hash, 自动选择
+    zend_long  xhprof_flags = 0; //捕获CPU 内存信息 配置
+    HashTable *optional_array = NULL;
 
     if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
                 "|lhl", &track_algorithm, &optional_array, &xhprof_flags) == FAILURE) {
         return;
     }
 
+    //还在捕获时帧布局和行号都属于上一次的参数, 先结束它再换参数
+    if (hp_globals.enabled) {
+        hp_stop(TSRMLS_C);
+    }
+
     init_options_from_arg((uint32_t)track_algorithm, optional_array, xhprof_flags);
 
     hp_begin(TSRMLS_CC);
@@ -387,15 +876,66 @@ PHP_FUNCTION(xhprof_enable) {
 PHP_FUNCTION(xhprof_disable) {
     if (hp_globals.enabled) {
         hp_stop(TSRMLS_C);
+        hp_stats_count_export(return_value);
+        return;
+    }
+    /* else null is returned */
+}
 
-        int i, j = 1;
-        for (i = 1; i < hp_globals.stats_count_func_num; i++) {
-            for (j = 1; j < HP_STATS_KEY_NUM; j++) {
-                php_printf("%d, %d => %d \n", i, j, hp_globals.stats_count[i][j]);
-            }
-        }
+/**
+ * Start statistical sampling of the call stack, driven by a timer on the
+ * thread's CPU time. Independent of xhprof_enable(), no track list needed.
+ *
+ * @param  int $interval_us  sampling interval, default xhprof.sample_interval
+ * @return bool
+ */
+PHP_FUNCTION(xhprof_sample_enable) {
+    zend_long interval_us = 0;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|l", &interval_us) == FAILURE) {
+        return;
+    }
+
+    if (interval_us <= 0) {
+        interval_us = INI_INT("xhprof.sample_interval");
+    }
+
+    if (hp_sample_start(interval_us) == FAILURE) {
+        RETURN_FALSE;
+    }
+    RETURN_TRUE;
+}
 
-        //RETURN_ARR(hp_globals.stats_count);
+/**
+ * Stop sampling and return the samples folded by stack:
+ *
+ *     [ "main()==>Foo:bar==>baz" => 3, ... ]
+ *
+ * The value is the number of timer ticks that landed on the stack.
+ *
+ * @return array|null
+ */
+PHP_FUNCTION(xhprof_sample_disable) {
+    if (hp_globals.sample_enabled) {
+        hp_sample_stop();
+        hp_sample_export(return_value);
+        hp_sample_reset();
+        return;
+    }
+    /* else null is returned */
+}
+
+/**
+ * Per-function counters of the INI track list, summed over every request
+ * profiled by every worker since the server started:
+ *
+ *     [ "Foo:bar" => ["ct" => 1234, "wt" => 56789, ...], ... ]
+ *
+ * @return array|null  null when xhprof.shm_slabs is 0
+ */
+PHP_FUNCTION(xhprof_shm_stats) {
+    if (hp_shared.shm) {
+        hp_shm_export(return_value);
     }
     /* else null is returned */
 }
@@ -406,43 +946,117 @@ PHP_FUNCTION(xhprof_disable) {
  * @author cjiang
  */
 PHP_MINIT_FUNCTION(xhprof) {
+    int i;
 
     REGISTER_INI_ENTRIES();
 
     hp_register_constants(INIT_FUNC_ARGS_PASSTHRU);
 
+    hp_stats_key_names[HP_STATS_COUNT_CT]  = zend_new_interned_string(zend_string_init("ct", sizeof("ct") - 1, 1));
+    hp_stats_key_names[HP_STATS_COUNT_WT]  = zend_new_interned_string(zend_string_init("wt", sizeof("wt") - 1, 1));
+    hp_stats_key_names[HP_STATS_COUNT_CPU] = zend_new_interned_string(zend_string_init("cpu", sizeof("cpu") - 1, 1));
+    hp_stats_key_names[HP_STATS_COUNT_MU]  = zend_new_interned_string(zend_string_init("mu", sizeof("mu") - 1, 1));
+    hp_stats_key_names[HP_STATS_COUNT_PMU] = zend_new_interned_string(zend_string_init("pmu", sizeof("pmu") - 1, 1));
+    hp_stats_key_names[HP_STATS_COUNT_INSTRUCTIONS] = zend_new_interned_string(zend_string_init("instructions", sizeof("instructions") - 1, 1));
+    hp_stats_key_names[HP_STATS_COUNT_CYCLES] = zend_new_interned_string(zend_string_init("cycles", sizeof("cycles") - 1, 1));
+    hp_stats_key_names[HP_STATS_COUNT_LLC_MISSES] = zend_new_interned_string(zend_string_init("llc_misses", sizeof("llc_misses") - 1, 1));
+    hp_stats_key_names[HP_STATS_COUNT_BRANCH_MISSES] = zend_new_interned_string(zend_string_init("branch_misses", sizeof("branch_misses") - 1, 1));
+    hp_stats_key_names[HP_STATS_COUNT_EWT] = zend_new_interned_string(zend_string_init("ewt", sizeof("ewt") - 1, 1));
+    hp_stats_key_names[HP_STATS_COUNT_ECPU] = zend_new_interned_string(zend_string_init("ecpu", sizeof("ecpu") - 1, 1));
+
     /* Get the number of available logical CPUs. */
-    hp_globals.cpu_num = sysconf(_SC_NPROCESSORS_CONF);
+    hp_shared.cpu_num = sysconf(_SC_NPROCESSORS_CONF);
 
-    /* Get the cpu affinity mask. */
-#ifndef __APPLE__
-    if (GET_AFFINITY(0, sizeof(cpu_set_t), &hp_globals.prev_mask) < 0) {
-        perror("getaffinity");
-        return FAILURE;
-    }
-#else
-    CPU_ZERO(&(hp_globals.prev_mask));
-#endif
+    hp_shared.clock_source = hp_clock_select(INI_STR("xhprof.clock_source"));
+    hp_shared.clock_ticks_per_us = (hp_shared.clock_source == HP_CLOCK_MONOTONIC ? 1000.0 : 0.0);
 
-    hp_globals.enabled = 0;
+    /* 在 fork 之前测一次 TSC 频率, 所有 worker 和线程共享; 之后只读, 请求里不再写 hp_shared */
+    if (hp_shared.clock_source == HP_CLOCK_TSC) {
+        hp_tsc_calibrate();
+        if (hp_shared.clock_ticks_per_us <= 0) {
+            hp_shared.clock_source = HP_CLOCK_MONOTONIC;
+            hp_shared.clock_ticks_per_us = 1000.0;
+        }
+    }
 
-    /* Initialize cpu_frequencies and cur_cpu_id. */
-    hp_globals.cpu_frequencies = NULL;
-    hp_globals.cur_cpu_id = 0;
+    hp_shared.cpu_clock = HP_CPU_CLOCK_AUTO;
+    if (strcasecmp(INI_STR("xhprof.cpu_clock"), "perf") == 0) {
+        hp_shared.cpu_clock = HP_CPU_CLOCK_PERF;
+    } else if (strcasecmp(INI_STR("xhprof.cpu_clock"), "thread_cputime") == 0) {
+        hp_shared.cpu_clock = HP_CPU_CLOCK_THREAD_CPUTIME;
+    } else if (strcasecmp(INI_STR("xhprof.cpu_clock"), "getrusage") == 0) {
+        hp_shared.cpu_clock = HP_CPU_CLOCK_GETRUSAGE;
+    }
+    hp_shared.ini_track_list = hp_track_list_from_ini(INI_STR("xhprof.track_functions"),
+            INI_STR("xhprof.track_functions_file"));
+
+    /* 必须在 fork 之前 */
+    hp_shm_init();
+
+    hp_shared.auto_sample_rate = INI_INT("xhprof.sample_rate");
+    hp_shared.auto_flags = (uint32)INI_INT("xhprof.auto_flags");
+    hp_shared.auto_trigger = NULL;
+    hp_shared.auto_trigger_header = NULL;
+    hp_shared.auto_trigger_value = NULL;
+
+    if (INI_STR("xhprof.trigger") && *INI_STR("xhprof.trigger")) {
+        size_t len = strlen(INI_STR("xhprof.trigger"));
+
+        hp_shared.auto_trigger = pestrdup(INI_STR("xhprof.trigger"), 1);
+        hp_shared.auto_trigger_len = len;
+
+        //请求头在 SAPI 环境变量里是 HTTP_XHPROF_PROFILE 的形式
+        hp_shared.auto_trigger_header = pemalloc(sizeof("HTTP_") + len, 1);
+        memcpy(hp_shared.auto_trigger_header, "HTTP_", sizeof("HTTP_") - 1);
+        for (i = 0; i <= (int)len; i++) {
+            char c = hp_shared.auto_trigger[i];
+            hp_shared.auto_trigger_header[sizeof("HTTP_") - 1 + i] = (c == '-' ? '_' : toupper((unsigned char)c));
+        }
 
-    hp_globals.stats_count = NULL;
-    hp_globals.stats_count_func_num = 0;
+        if (INI_STR("xhprof.trigger_value") && *INI_STR("xhprof.trigger_value")) {
+            hp_shared.auto_trigger_value = pestrdup(INI_STR("xhprof.trigger_value"), 1);
+        }
+    }
 
-    /* no free hp_entry_t structures to start with */
-    hp_globals.entry_free_list = NULL;
+    hp_shared.hooks = 0;
+    memset(hp_shared.hook_refs, 0, sizeof(hp_shared.hook_refs));
+#ifdef ZTS
+    hp_shared.hooks_mutex = tsrm_mutex_alloc();
+#endif
+    hp_shared.observer = 0;
+#ifdef HP_HAVE_OBSERVER
+    if (INI_INT("xhprof.observer")) {
+        zend_observer_fcall_register(hp_observer_fcall_init);
+        hp_shared.observer = 1;
+    }
+#endif
 
-    //function proxy
+    /* function proxy: zend_get_call_op() 编译时就按 zend_execute_ex / zend_execute_internal 选择
+     * 调用 opcode, 钩子要在编译任何脚本之前装上, 一直留到 MSHUTDOWN; 不抓取时只多一次判断.
+     * observer 后端不装它们 (8.2 之前内部函数除外), 不在函数列表里的函数没有 handler, 不抓取时没有开销 */
+    if (!hp_shared.observer) {
+        hp_hook_install(HP_HOOK_EXECUTE_EX);
+    }
+#ifdef HP_OBSERVER_INTERNAL
+    if (!hp_shared.observer)
+#endif
+    {
+        hp_hook_install(HP_HOOK_EXECUTE_INTERNAL);
+    }
 
-    _zend_execute_ex = zend_execute_ex;
-    zend_execute_ex  = hp_execute_ex;
+    hp_shared.dump = 0;
+#ifdef HP_HAVE_DUMP
+    if (INI_INT("xhprof.dump") && INI_STR("xhprof.output_dir") && *INI_STR("xhprof.output_dir")) {
+        const char *key_names[HP_STATS_KEY_NUM];
+        uint32 key;
 
-    _zend_execute_internal = zend_execute_internal;
-    zend_execute_internal = hp_execute_internal;
+        //文件里的指标从 ct 开始
+        for (key = HP_STATS_COUNT_CT; key < HP_STATS_KEY_NUM; key++) {
+            key_names[key - HP_STATS_COUNT_CT] = ZSTR_VAL(hp_stats_key_names[key]);
+        }
+        hp_shared.dump = hp_dump_init(INI_STR("xhprof.output_dir"), key_names, HP_STATS_KEY_NUM - HP_STATS_COUNT_CT);
+    }
+#endif
 
 #if defined(DEBUG)
     /* To make it random number generator repeatable to ease testing. */
@@ -455,11 +1069,41 @@ PHP_MINIT_FUNCTION(xhprof) {
  * Module shutdown callback.
  */
 PHP_MSHUTDOWN_FUNCTION(xhprof) {
-    /* Make sure cpu_frequencies is free'ed. */
-    clear_frequencies();
+    hp_hook_remove(HP_HOOK_EXECUTE_EX);
+    hp_hook_remove(HP_HOOK_EXECUTE_INTERNAL);
+
+#ifdef HP_HAVE_DUMP
+    /* 写完还在队列里的请求 */
+    if (hp_shared.dump) {
+        hp_dump_shutdown();
+        hp_shared.dump = 0;
+    }
+#endif
+
+    if (hp_shared.ini_track_list) {
+        hp_track_list_free(hp_shared.ini_track_list);
+        hp_shared.ini_track_list = NULL;
+    }
+
+    if (hp_shared.shm) {
+        munmap(hp_shared.shm, hp_shared.shm_size);
+        hp_shared.shm = NULL;
+    }
+
+    if (hp_shared.auto_trigger) {
+        pefree(hp_shared.auto_trigger, 1);
+        pefree(hp_shared.auto_trigger_header, 1);
+        hp_shared.auto_trigger = NULL;
+        hp_shared.auto_trigger_header = NULL;
+    }
+    if (hp_shared.auto_trigger_value) {
+        pefree(hp_shared.auto_trigger_value, 1);
+        hp_shared.auto_trigger_value = NULL;
+    }
 
-    /* free any remaining items in the free list */
-    hp_free_the_free_list();
+#ifdef ZTS
+    tsrm_mutex_free(hp_shared.hooks_mutex);
+#endif
 
     UNREGISTER_INI_ENTRIES();
 
@@ -467,9 +1111,93 @@ PHP_MSHUTDOWN_FUNCTION(xhprof) {
 }
 
 /**
- * Request init callback. Nothing to do yet!
+ * Per-thread state constructor: runs once for the main thread, and under
+ * ZTS once for every thread the SAPI starts. Nothing here may depend on
+ * INI settings, use hp_shared for those.
+ */
+static PHP_GINIT_FUNCTION(xhprof) {
+    int i;
+
+#if defined(COMPILE_DL_XHPROF) && defined(ZTS)
+    ZEND_TSRMLS_CACHE_UPDATE();
+#endif
+
+    memset(xhprof_globals, 0, sizeof(zend_xhprof_globals));
+
+    xhprof_globals->cpu_clock_active = HP_CPU_CLOCK_AUTO;
+    xhprof_globals->cpu_perf_event.fd = -1;
+    for (i = 0; i < HP_PERF_COUNTER_NUM; i++) {
+        xhprof_globals->perf_counters[i].fd = -1;
+    }
+
+    xhprof_globals->func_cache = (hp_func_cache_entry *)pecalloc(HP_FUNC_CACHE_SIZE, sizeof(hp_func_cache_entry), 1);
+}
+
+/**
+ * Per-thread state destructor, run after MSHUTDOWN without ZTS. Under ZTS
+ * it usually runs in the exiting thread, but when the module is unloaded
+ * ts_free_id() runs it for every thread's instance from one thread, so
+ * everything here works on xhprof_globals, never on hp_globals.
+ */
+static PHP_GSHUTDOWN_FUNCTION(xhprof) {
+    /* Make sure cpu_frequencies is free'ed. */
+    clear_frequencies(xhprof_globals);
+
+    if (xhprof_globals->frames) {
+        pefree(xhprof_globals->frames, 1);
+        xhprof_globals->frames = NULL;
+    }
+
+    if (xhprof_globals->func_cache) {
+        pefree(xhprof_globals->func_cache, 1);
+        xhprof_globals->func_cache = NULL;
+    }
+
+    hp_stats_count_free(xhprof_globals);
+
+    if (xhprof_globals->cpu_perf_pid == getpid()) {
+        hp_perf_event_close(&xhprof_globals->cpu_perf_event);
+    }
+
+    if (xhprof_globals->perf_counters_pid == getpid()) {
+        hp_perf_counters_close(xhprof_globals);
+    }
+
+    if (xhprof_globals->sample_ring) {
+        pefree(xhprof_globals->sample_ring, 1);
+        xhprof_globals->sample_ring = NULL;
+    }
+
+    if (xhprof_globals->edges) {
+        pefree(xhprof_globals->edges, 1);
+        xhprof_globals->edges = NULL;
+    }
+}
+
+/**
+ * Request init callback. Starts profiling with the INI track list when the
+ * request is picked by xhprof.sample_rate or carries the xhprof.trigger.
+ * Unselected requests leave the profiler completely untouched.
  */
 PHP_RINIT_FUNCTION(xhprof) {
+#if defined(COMPILE_DL_XHPROF) && defined(ZTS)
+    ZEND_TSRMLS_CACHE_UPDATE();
+#endif
+
+    hp_globals.auto_enabled = 0;
+
+    if (!hp_shared.ini_track_list || (!hp_shared.auto_sample_rate && !hp_shared.auto_trigger)) {
+        return SUCCESS;
+    }
+
+    if (!hp_auto_selected()) {
+        return SUCCESS;
+    }
+
+    init_options_from_arg(XHPROF_ALGORITHM_TRIE, NULL, hp_shared.auto_flags);
+    hp_begin(TSRMLS_CC);
+    hp_globals.auto_enabled = 1;
+
     return SUCCESS;
 }
 
@@ -478,6 +1206,11 @@ PHP_RINIT_FUNCTION(xhprof) {
  */
 PHP_RSHUTDOWN_FUNCTION(xhprof) {
     hp_end(TSRMLS_C);
+
+    if (hp_globals.sample_enabled) {
+        hp_sample_stop();
+        hp_sample_reset();
+    }
     return SUCCESS;
 }
 
@@ -492,14 +1225,35 @@ PHP_MINFO_FUNCTION(xhprof) {
 
     php_info_print_table_start();
     php_info_print_table_header(2, "xhprof", XHPROF_VERSION);
-    len = snprintf(buf, SCRATCH_BUF_LEN, "%d", hp_globals.cpu_num);
+    len = snprintf(buf, SCRATCH_BUF_LEN, "%d", hp_shared.cpu_num);
     buf[len] = 0;
     php_info_print_table_header(2, "CPU num", buf);
 
+    len = snprintf(buf, SCRATCH_BUF_LEN, "%d",
+            hp_shared.ini_track_list ? hp_shared.ini_track_list->func_num - 1 : 0);
+    buf[len] = 0;
+    php_info_print_table_row(2, "INI track functions", buf);
+
+    len = snprintf(buf, SCRATCH_BUF_LEN, "%u", hp_shared.shm_slab_num);
+    buf[len] = 0;
+    php_info_print_table_row(2, "Shared memory slabs", buf);
+
+    php_info_print_table_row(2, "Clock source", hp_clock_name(hp_shared.clock_source));
+    php_info_print_table_row(2, "Invariant TSC", hp_shared.tsc_invariant ? "yes" : "no");
+    php_info_print_table_row(2, "CPU time source", hp_cpu_clock_name(
+                hp_globals.cpu_clock_active ? hp_globals.cpu_clock_active : hp_shared.cpu_clock));
+
+    if (hp_shared.clock_source == HP_CLOCK_TSC && hp_shared.clock_ticks_per_us > 0) {
+        len = snprintf(buf, SCRATCH_BUF_LEN, "%f (%s)", hp_shared.clock_ticks_per_us,
+                hp_shared.tsc_calibration ? hp_shared.tsc_calibration : "measured");
+        buf[len] = 0;
+        php_info_print_table_row(2, "TSC Clock Rate (MHz)", buf);
+    }
+
     if (hp_globals.cpu_frequencies) {
         /* Print available cpu frequencies here. */
         php_info_print_table_header(2, "CPU logical id", " Clock Rate (MHz) ");
-        for (i = 0; i < hp_globals.cpu_num; ++i) {
+        for (i = 0; i < hp_shared.cpu_num; ++i) {
             len = snprintf(buf, SCRATCH_BUF_LEN, " CPU %d ", i);
             buf[len] = 0;
             len = snprintf(tmp, SCRATCH_BUF_LEN, "%f", hp_globals.cpu_frequencies[i]);
@@ -527,6 +1281,14 @@ static void hp_register_constants(INIT_FUNC_ARGS) {
             XHPROF_ALGORITHM_TRIE,
             CONST_CS | CONST_PERSISTENT);
 
+    REGISTER_LONG_CONSTANT("XHPROF_ALGORITHM_PHF",
+            XHPROF_ALGORITHM_PHF,
+            CONST_CS | CONST_PERSISTENT);
+
+    REGISTER_LONG_CONSTANT("XHPROF_ALGORITHM_AUTO",
+            XHPROF_ALGORITHM_AUTO,
+            CONST_CS | CONST_PERSISTENT);
+
     REGISTER_LONG_CONSTANT("XHPROF_FLAGS_NO_BUILTINS",
             XHPROF_FLAGS_NO_BUILTINS,
             CONST_CS | CONST_PERSISTENT);
@@ -538,91 +1300,603 @@ static void hp_register_constants(INIT_FUNC_ARGS) {
     REGISTER_LONG_CONSTANT("XHPROF_FLAGS_MEMORY",
             XHPROF_FLAGS_MEMORY,
             CONST_CS | CONST_PERSISTENT);
-}
-
-/**
- * 启动配置解析， 
- * track的函数 track_functions
- *
- * @author mpal
- */
-static void init_options_from_arg(uint32_t track_algorithm, HashTable *args, zend_long xhprof_flags) {
 
-    //捕获算法
-    hp_globals.track_algorithm = (track_algorithm == XHPROF_ALGORITHM_HASH ? XHPROF_ALGORITHM_HASH : XHPROF_ALGORITHM_TRIE);
+    REGISTER_LONG_CONSTANT("XHPROF_FLAGS_PERF",
+            XHPROF_FLAGS_PERF,
+            CONST_CS | CONST_PERSISTENT);
 
-    //要捕获的指标
-    hp_globals.xhprof_flags = (uint32)xhprof_flags;
+    REGISTER_LONG_CONSTANT("XHPROF_FLAGS_HISTOGRAM",
+            XHPROF_FLAGS_HISTOGRAM,
+            CONST_CS | CONST_PERSISTENT);
 
-    //当前执行的函数名存储的内存
-    if (hp_globals.cur_func_name) {
-        zend_string_free(hp_globals.cur_func_name);
-    }
-    hp_globals.cur_func_name = zend_string_alloc(1024 , 0);
+    REGISTER_LONG_CONSTANT("XHPROF_FLAGS_EXCLUSIVE",
+            XHPROF_FLAGS_EXCLUSIVE,
+            CONST_CS | CONST_PERSISTENT);
 
-    //要捕获的函数
-    if (hp_globals.track_function_names) {
-        zend_hash_destroy(hp_globals.track_function_names);
-    }
-    hp_globals.track_function_names = NULL;
+    REGISTER_LONG_CONSTANT("XHPROF_FLAGS_EDGES",
+            XHPROF_FLAGS_EDGES,
+            CONST_CS | CONST_PERSISTENT);
 
-    //统计结果数据存储内存块
-    if (hp_globals.stats_count) {
-        efree_hp_stats_count();//释放旧内存
-    }
+    REGISTER_LONG_CONSTANT("XHPROF_FLAGS_PATTERN_DETAIL",
+            XHPROF_FLAGS_PATTERN_DETAIL,
+            CONST_CS | CONST_PERSISTENT);
+}
 
-    if (args == NULL) {
-        return;
-    }
+/**
+ * ***********************
+ * AUTO PROFILING
+ * ***********************
+ */
 
-    //要捕获的函数
-    zval  *z_track_functions = NULL;
-    z_track_functions = hp_zval_at_key("track_functions", args);
-    if (!z_track_functions || Z_TYPE_P(z_track_functions) != IS_ARRAY
-            || zend_hash_num_elements(Z_ARR_P(z_track_functions)) < 1) {
-        return ;
+/**
+ * xorshift64*, seeded once per worker. Cheap and good enough to pick one
+ * request in N, and unlike rand() doesn't share state with PHP code.
+ */
+static zend_always_inline uint64 hp_rand() {
+    uint64 x;
+
+    if (UNEXPECTED(hp_globals.rand_pid != getpid())) {
+        //fork 出来的 worker 各自播种, 否则会选中同样的请求
+        hp_globals.rand_pid = getpid();
+        hp_globals.rand_state = hp_monotonic_timer() ^ ((uint64)hp_globals.rand_pid << 32)
+            ^ (uint64)(uintptr_t)&x;
+        if (!hp_globals.rand_state) {
+            hp_globals.rand_state = 0x9e3779b97f4a7c15ULL;
+        }
     }
 
-    ALLOC_HASHTABLE(hp_globals.track_function_names);
-    zend_hash_init(hp_globals.track_function_names, 20, NULL, NULL, 0);
-
-    size_t tf_count = 1;
-    zval *temp_value;
+    x = hp_globals.rand_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    hp_globals.rand_state = x;
 
-    //emalloc hp_stats_count init 统计结果数据内存分配
-    hp_globals.stats_count_func_num = zend_hash_num_elements(Z_ARR_P(z_track_functions)) + 1;
-    emalloc_hp_stats_count(hp_globals.stats_count_func_num);
+    return x * 0x2545f4914f6cdd1dULL;
+}
 
-    //初始化字典树
-    if (hp_globals.track_algorithm == XHPROF_ALGORITHM_TRIE) {
-        hp_trie_init_root(&hp_globals.track_function_trie);
+static int hp_auto_trigger_match(const char *value, size_t len) {
+    if (!len) {
+        return 0;
     }
+    if (!hp_shared.auto_trigger_value) {
+        return 1;
+    }
+    return len == strlen(hp_shared.auto_trigger_value)
+        && memcmp(value, hp_shared.auto_trigger_value, len) == 0;
+}
 
-    for (zend_hash_internal_pointer_reset(Z_ARR_P(z_track_functions));
-            zend_hash_has_more_elements(Z_ARR_P(z_track_functions)) == SUCCESS;
-            zend_hash_move_forward(Z_ARR_P(z_track_functions))) {
-
-        zval *data = zend_hash_get_current_data(Z_ARR_P(z_track_functions));
-
-        if (data && Z_TYPE_P(data) == IS_STRING) {
-            temp_value = (zval *)emalloc(sizeof(zval));
-            ZVAL_LONG(temp_value, tf_count);
-
-            zend_hash_add(hp_globals.track_function_names, Z_STR_P(data), temp_value);
-
-            //字典树
-            if (hp_globals.track_algorithm == XHPROF_ALGORITHM_TRIE) {
-                hp_trie_add_word(hp_globals.track_function_trie, ZSTR_VAL(Z_STR_P(data)), tf_count);
-            }
+/**
+ * Whether the current request carries the trigger as a cookie, a request
+ * header or an environment variable (CLI).
+ */
+static int hp_auto_triggered() {
+    zval *cookies = &PG(http_globals)[TRACK_VARS_COOKIE];
+    zval *value;
+    char *env;
+    int matched;
+
+    if (Z_TYPE_P(cookies) == IS_ARRAY) {
+        value = zend_hash_str_find(Z_ARRVAL_P(cookies), hp_shared.auto_trigger, hp_shared.auto_trigger_len);
+        if (value && Z_TYPE_P(value) == IS_STRING
+                && hp_auto_trigger_match(Z_STRVAL_P(value), Z_STRLEN_P(value))) {
+            return 1;
+        }
+    }
 
-            tf_count++;
+    //$_SERVER 是 JIT 的, 直接问 SAPI
+    env = sapi_getenv(hp_shared.auto_trigger_header, strlen(hp_shared.auto_trigger_header));
+    if (env) {
+        matched = hp_auto_trigger_match(env, strlen(env));
+        efree(env);
+        if (matched) {
+            return 1;
         }
     }
 
-    //cclehui_test
-    //traversal(hp_globals.track_function_trie, "test");
-    //display_hash_table(hp_globals.track_function_names);
-    display_hash_table_new(hp_globals.track_function_names);
+    env = getenv(hp_shared.auto_trigger);
+    return env && hp_auto_trigger_match(env, strlen(env));
+}
+
+static int hp_auto_selected() {
+    if (hp_shared.auto_sample_rate > 0
+            && hp_rand() % (uint64)hp_shared.auto_sample_rate == 0) {
+        return 1;
+    }
+
+    return hp_shared.auto_trigger && hp_auto_triggered();
+}
+
+/**
+ * 启动配置解析， 
+ * track的函数 track_functions
+ *
+ * @author mpal
+ */
+static void init_options_from_arg(uint32_t track_algorithm, HashTable *args, zend_long xhprof_flags) {
+
+    //捕获算法, 不认识的按字典树
+    switch (track_algorithm) {
+        case XHPROF_ALGORITHM_HASH:
+        case XHPROF_ALGORITHM_PHF:
+        case XHPROF_ALGORITHM_AUTO:
+            hp_globals.track_algorithm = track_algorithm;
+            break;
+        default:
+            hp_globals.track_algorithm = XHPROF_ALGORITHM_TRIE;
+    }
+
+    //要捕获的指标
+    hp_globals.xhprof_flags = (uint32)xhprof_flags;
+
+    //函数列表可能变化, 之前缓存的结果全部作废
+    hp_func_cache_invalidate();
+
+    //上一次 xhprof_enable 创建的函数列表
+    hp_release_track_list();
+    hp_hists_free();
+    hp_detail_free();
+
+    //默认使用 INI 中配置的函数列表
+    hp_globals.track_list = hp_shared.ini_track_list;
+
+    //要捕获的函数
+    zval  *z_track_functions = NULL;
+    if (args != NULL) {
+        z_track_functions = hp_zval_at_key("track_functions", args);
+    }
+
+    if (z_track_functions && Z_TYPE_P(z_track_functions) == IS_ARRAY
+            && zend_hash_num_elements(Z_ARR_P(z_track_functions)) > 0) {
+        zend_string **names;
+        uint32_t num = 0;
+        zval *data;
+
+        names = (zend_string **)emalloc(sizeof(zend_string *) * zend_hash_num_elements(Z_ARR_P(z_track_functions)));
+
+        ZEND_HASH_FOREACH_VAL(Z_ARR_P(z_track_functions), data) {
+            if (Z_TYPE_P(data) == IS_STRING) {
+                names[num++] = Z_STR_P(data);
+            }
+        } ZEND_HASH_FOREACH_END();
+
+        hp_globals.track_list = hp_track_list_create(names, num, 0,
+                hp_globals.track_algorithm == XHPROF_ALGORITHM_TRIE,
+                hp_globals.track_algorithm == XHPROF_ALGORITHM_PHF
+                || (hp_globals.track_algorithm == XHPROF_ALGORITHM_AUTO && num > HP_PHF_AUTO_MIN));
+        efree(names);
+    }
+
+    if (!hp_globals.track_list) {
+        hp_globals.stats_count_func_num = 0;
+        return;
+    }
+
+    if (hp_globals.track_algorithm == XHPROF_ALGORITHM_AUTO) {
+        hp_globals.track_algorithm = (hp_globals.track_list->phf && hp_globals.track_list->exact_num > HP_PHF_AUTO_MIN)
+            ? XHPROF_ALGORITHM_PHF : XHPROF_ALGORITHM_HASH;
+    }
+
+    //统计结果只需要清零, 内存跨请求复用
+    hp_globals.stats_count_func_num = hp_globals.track_list->func_num;
+    hp_stats_count_prepare(hp_globals.stats_count_func_num);
+
+    if (hp_globals.xhprof_flags & XHPROF_FLAGS_HISTOGRAM) {
+        hp_hists_prepare(hp_globals.stats_count_func_num);
+    }
+
+    if (hp_globals.xhprof_flags & XHPROF_FLAGS_EDGES) {
+        if (!hp_globals.edges) {
+            hp_globals.edges = (hp_edge *)pemalloc(sizeof(hp_edge) * HP_EDGE_TABLE_SIZE, 1);
+        }
+        memset(hp_globals.edges, 0, sizeof(hp_edge) * HP_EDGE_TABLE_SIZE);
+        hp_globals.edges_used = 0;
+        hp_globals.edges_dropped = 0;
+    }
+}
+
+/**
+ * Release the track list of the last xhprof_enable() call. The shared INI
+ * list is never freed here.
+ */
+static void hp_release_track_list() {
+    if (hp_globals.track_list && hp_globals.track_list != hp_shared.ini_track_list) {
+        hp_track_list_free(hp_globals.track_list);
+    }
+    hp_globals.track_list = NULL;
+}
+
+/**
+ * ***********************
+ * TRACK LIST
+ * ***********************
+ */
+
+/**
+ * Compile names into a track list. Duplicate names share the row of their
+ * first occurrence. The list keeps its own reference to every name.
+ *
+ * A name whose only '*' is the last character is a prefix pattern, a name
+ * "*:method" without another '*' matches that method of every class. Any
+ * other '*' is taken literally.
+ *
+ * @param int with_trie  also build the trie for XHPROF_ALGORITHM_TRIE
+ * @param int with_phf   also build the minimal perfect hash for XHPROF_ALGORITHM_PHF
+ */
+static hp_track_list *hp_track_list_create(zend_string **names, uint32_t num, int persistent, int with_trie, int with_phf) {
+    hp_track_list *list;
+    HashTable names_ht;
+    zval index;
+    uint32_t i;
+
+    list = (hp_track_list *)pecalloc(1, sizeof(hp_track_list), persistent);
+    list->persistent = persistent;
+    list->names = (zend_string **)pecalloc(num + 1, sizeof(zend_string *), persistent);
+    list->is_pattern = (uint8 *)pecalloc(num + 1, sizeof(uint8), persistent);
+    list->func_num = 1;
+
+    //去重用, 只在创建时需要
+    zend_hash_init(&names_ht, num, NULL, NULL, persistent);
+
+    for (i = 0; i < num; i++) {
+        const char *name = ZSTR_VAL(names[i]);
+        size_t len = ZSTR_LEN(names[i]);
+        const char *star = memchr(name, '*', len);
+
+        ZVAL_LONG(&index, list->func_num);
+
+        if (!zend_hash_add(&names_ht, names[i], &index)) {
+            continue;
+        }
+
+        if (star == name + len - 1) {
+            //前缀: 只有最后一个字符是 '*'
+            list->is_pattern[list->func_num] = 1;
+            list->has_prefix = 1;
+
+        } else if (len > 2 && name[0] == '*' && name[1] == CLASS_FUNC_SPLIT_CHAR
+                && !memchr(name + 2, '*', len - 2)) {
+            //"*:method" 任意类的方法
+            if (!list->method_patterns) {
+                list->method_patterns = (HashTable *)pemalloc(sizeof(HashTable), persistent);
+                zend_hash_init(list->method_patterns, 8, NULL, NULL, persistent);
+            }
+            zend_hash_str_add(list->method_patterns, name + 2, len - 2, &index);
+            list->is_pattern[list->func_num] = 1;
+        }
+
+        list->names[list->func_num++] = zend_string_copy(names[i]);
+    }
+
+    zend_hash_destroy(&names_ht);
+
+    hp_name_table_build(list);
+
+    //模式不能按整个名字的 hash 排除, 有模式时不用过滤器
+    if (list->exact_num && !list->has_prefix && !list->method_patterns) {
+        list->bloom = hp_bloom_create(list->exact_num, persistent);
+        for (i = 0; i <= list->slot_mask; i++) {
+            if (list->slots[i].key) {
+                hp_bloom_add(list->bloom, list->slots[i].key);
+            }
+        }
+    }
+
+    if (with_phf) {
+        hp_phf_table_build(list);
+    }
+
+    if ((with_trie || list->has_prefix) && list->func_num > 1) {
+        hp_trie_key *keys = (hp_trie_key *)pemalloc(sizeof(hp_trie_key) * (list->func_num - 1), persistent);
+        uint32_t key_num = 0;
+
+        for (i = 1; i < list->func_num; i++) {
+            hp_trie_key *key = &keys[key_num];
+
+            key->str = ZSTR_VAL(list->names[i]);
+            key->len = ZSTR_LEN(list->names[i]);
+            key->func_hash_index = i;
+            key->prefix = 0;
+
+            //前缀模式去掉结尾的 '*', "*:method" 不进字典树
+            if (list->is_pattern[i]) {
+                if (key->str[key->len - 1] != '*') {
+                    continue;
+                }
+                key->len--;
+                key->prefix = 1;
+            }
+            key_num++;
+        }
+
+        list->trie = hp_trie_build(keys, key_num, persistent);
+        pefree(keys, persistent);
+    }
+
+    return list;
+}
+
+//64 位整数的 finalizer (murmur3 fmix64), 每一位输入影响每一位输出
+static zend_always_inline uint64 hp_mix64(uint64 h) {
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * Slot of row i of list. "Class:func" is split at the first ':'. Returns 0
+ * for patterns and for the (negligible) names whose key comes out 0, which
+ * marks an empty slot; such a name is just never found.
+ */
+static int hp_name_slot_init(const hp_track_list *list, uint32_t i, hp_name_slot *slot) {
+    const char *name = ZSTR_VAL(list->names[i]);
+    size_t len = ZSTR_LEN(list->names[i]);
+    const char *split = memchr(name, CLASS_FUNC_SPLIT_CHAR, len);
+
+    if (list->is_pattern[i]) {
+        return 0;
+    }
+
+    if (split) {
+        slot->class_name = name;
+        slot->class_len = (uint32)(split - name);
+        slot->function_name = split + 1;
+        slot->function_len = (uint32)(len - slot->class_len - 1);
+        slot->key = HP_NAME_HASH_MIX(zend_inline_hash_func(slot->class_name, slot->class_len),
+                zend_inline_hash_func(slot->function_name, slot->function_len));
+    } else {
+        slot->class_name = NULL;
+        slot->class_len = 0;
+        slot->function_name = name;
+        slot->function_len = (uint32)len;
+        slot->key = HP_NAME_HASH_MIX(0, zend_inline_hash_func(name, len));
+    }
+    slot->index = i;
+
+    return slot->key != 0;
+}
+
+//key 相同之后比较名字
+static zend_always_inline int hp_name_slot_match(const hp_name_slot *slot, uint64 key,
+        zend_string *class_name, zend_string *function_name) {
+    if (slot->key != key || slot->function_len != ZSTR_LEN(function_name)) {
+        return 0;
+    }
+
+    if (class_name) {
+        if (!slot->class_name || slot->class_len != ZSTR_LEN(class_name)
+                || memcmp(slot->class_name, ZSTR_VAL(class_name), slot->class_len) != 0) {
+            return 0;
+        }
+    } else if (slot->class_name) {
+        return 0;
+    }
+
+    return memcmp(slot->function_name, ZSTR_VAL(function_name), slot->function_len) == 0;
+}
+
+/**
+ * Fill the XHPROF_ALGORITHM_HASH table with the exact names of list, at
+ * most half full.
+ */
+static void hp_name_table_build(hp_track_list *list) {
+    uint32_t i, size = 16;
+
+    while (size < list->func_num * 2) {
+        size <<= 1;
+    }
+
+    list->slots = (hp_name_slot *)pecalloc(size, sizeof(hp_name_slot), list->persistent);
+    list->slot_mask = size - 1;
+    list->exact_num = 0;
+
+    for (i = 1; i < list->func_num; i++) {
+        hp_name_slot slot;
+        uint32_t pos;
+
+        if (!hp_name_slot_init(list, i, &slot)) {
+            continue;
+        }
+
+        pos = (uint32_t)slot.key & list->slot_mask;
+        while (list->slots[pos].key) {
+            pos = (pos + 1) & list->slot_mask;
+        }
+        list->slots[pos] = slot;
+        list->exact_num++;
+    }
+}
+
+/**
+ * Build the XHPROF_ALGORITHM_PHF table: a minimal perfect hash over the
+ * keys of the exact names and the slots in hash order. Leaves list->phf
+ * NULL if it can't be built (two names with the same 64 bit key); lookups
+ * then use the XHPROF_ALGORITHM_HASH table.
+ */
+static void hp_phf_table_build(hp_track_list *list) {
+    hp_name_slot *slots;
+    uint64 *keys;
+    uint32_t i, num = 0;
+
+    if (!list->exact_num) {
+        return;
+    }
+
+    slots = (hp_name_slot *)pemalloc(sizeof(hp_name_slot) * list->exact_num, list->persistent);
+    keys = (uint64 *)pemalloc(sizeof(uint64) * list->exact_num, list->persistent);
+
+    for (i = 1; i < list->func_num; i++) {
+        if (hp_name_slot_init(list, i, &slots[num])) {
+            keys[num] = slots[num].key;
+            num++;
+        }
+    }
+
+    list->phf = hp_phf_build((const uint64_t *)keys, num, list->persistent);
+
+    if (list->phf) {
+        list->phf_slots = (hp_name_slot *)pemalloc(sizeof(hp_name_slot) * num, list->persistent);
+        for (i = 0; i < num; i++) {
+            list->phf_slots[hp_phf_lookup(list->phf, keys[i])] = slots[i];
+        }
+    }
+
+    pefree(keys, list->persistent);
+    pefree(slots, list->persistent);
+}
+
+/**
+ * Index of the exact name class_name:function_name (function_name alone
+ * when class_name is NULL), 0 when it isn't in the list.
+ */
+static zend_long hp_name_table_find(const hp_track_list *list, zend_string *class_name, zend_string *function_name) {
+    uint64 key = HP_NAME_HASH_MIX(class_name ? zend_string_hash_val(class_name) : 0,
+            zend_string_hash_val(function_name));
+    uint32_t pos = (uint32_t)key & list->slot_mask;
+    const hp_name_slot *slot;
+
+    for (;; pos = (pos + 1) & list->slot_mask) {
+        slot = &list->slots[pos];
+
+        if (!slot->key) {
+            return 0;
+        }
+        if (hp_name_slot_match(slot, key, class_name, function_name)) {
+            return slot->index;
+        }
+    }
+}
+
+/**
+ * Same as hp_name_table_find() with the XHPROF_ALGORITHM_PHF table: one
+ * probe, one compare.
+ */
+static zend_long hp_phf_table_find(const hp_track_list *list, zend_string *class_name, zend_string *function_name) {
+    uint64 key = HP_NAME_HASH_MIX(class_name ? zend_string_hash_val(class_name) : 0,
+            zend_string_hash_val(function_name));
+    const hp_name_slot *slot = &list->phf_slots[hp_phf_lookup(list->phf, key)];
+
+    return hp_name_slot_match(slot, key, class_name, function_name) ? slot->index : 0;
+}
+
+static void hp_track_list_free(hp_track_list *list) {
+    uint32_t i;
+
+    if (!list) {
+        return;
+    }
+
+    hp_trie_free(list->trie);
+    hp_bloom_free(list->bloom);
+    pefree(list->slots, list->persistent);
+
+    if (list->phf) {
+        hp_phf_free(list->phf);
+        pefree(list->phf_slots, list->persistent);
+    }
+
+    if (list->method_patterns) {
+        zend_hash_destroy(list->method_patterns);
+        pefree(list->method_patterns, list->persistent);
+    }
+
+    for (i = 1; i < list->func_num; i++) {
+        zend_string_release(list->names[i]);
+    }
+
+    pefree(list->names, list->persistent);
+    pefree(list->is_pattern, list->persistent);
+    pefree(list, list->persistent);
+}
+
+/**
+ * Split buf on commas and whitespace into persistent interned names.
+ * A token starting with '#' comments out the rest of its line.
+ */
+static void hp_track_list_parse(const char *buf, size_t len, zend_string ***names, uint32_t *num, uint32_t *size) {
+    const char *p = buf, *end = buf + len;
+
+    while (p < end) {
+        const char *tok;
+
+        if (*p == ',' || *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+            p++;
+            continue;
+        }
+
+        if (*p == '#') {
+            while (p < end && *p != '\n') {
+                p++;
+            }
+            continue;
+        }
+
+        tok = p;
+        while (p < end && *p != ',' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+            p++;
+        }
+
+        if (*num == *size) {
+            *size = *size ? *size * 2 : 64;
+            *names = (zend_string **)perealloc(*names, sizeof(zend_string *) * (*size), 1);
+        }
+
+        (*names)[(*num)++] = zend_new_interned_string(zend_string_init(tok, p - tok, 1));
+    }
+}
+
+/**
+ * Build the shared track list from xhprof.track_functions and
+ * xhprof.track_functions_file. Only called from MINIT, before workers fork.
+ * Returns NULL when both settings are empty.
+ */
+static hp_track_list *hp_track_list_from_ini(const char *functions, const char *file) {
+    zend_string **names = NULL;
+    uint32_t num = 0, size = 0, i;
+    hp_track_list *list = NULL;
+
+    if (functions && *functions) {
+        hp_track_list_parse(functions, strlen(functions), &names, &num, &size);
+    }
+
+    if (file && *file) {
+        FILE *fp = fopen(file, "r");
+        char *buf = NULL;
+        size_t len = 0, cap = 0, n;
+
+        if (!fp) {
+            zend_error(E_CORE_WARNING, "xhprof: cannot open xhprof.track_functions_file '%s'", file);
+
+        } else {
+            do {
+                if (len == cap) {
+                    cap = cap ? cap * 2 : 64 * 1024;
+                    buf = (char *)perealloc(buf, cap, 1);
+                }
+                n = fread(buf + len, 1, cap - len, fp);
+                len += n;
+            } while (n > 0);
+            fclose(fp);
+
+            hp_track_list_parse(buf, len, &names, &num, &size);
+            pefree(buf, 1);
+        }
+    }
+
+    if (num > 0) {
+        list = hp_track_list_create(names, num, 1, 1, 1);
+    }
+
+    for (i = 0; i < num; i++) {
+        zend_string_release(names[i]);
+    }
+    if (names) {
+        pefree(names, 1);
+    }
+
+    return list;
 }
 
 /**
@@ -634,19 +1908,38 @@ void hp_init_profiler_state() {
     /* Setup globals */
     if (!hp_globals.ever_enabled) {
         hp_globals.ever_enabled  = 1;
-        hp_globals.entries = NULL;
+        hp_globals.frame_depth = 0;
     }
 
-    /* NOTE(cjiang): some fields such as cpu_frequencies take relatively longer
-     * to initialize, (5 milisecond per logical cpu right now), therefore we
-     * calculate them lazily. */
-    if (hp_globals.cpu_frequencies == NULL) {
-        get_all_cpu_frequencies();
-        restore_cpu_affinity(&hp_globals.prev_mask);
+    if (hp_shared.clock_source == HP_CLOCK_TSC_PINNED) {
+        /* 亲和性是按线程的, 绑定前保存当前线程的, hp_stop() 时恢复 */
+#ifndef __APPLE__
+        if (GET_AFFINITY(0, sizeof(cpu_set_t), &hp_globals.prev_mask) < 0) {
+            perror("getaffinity");
+        }
+#else
+        CPU_ZERO(&(hp_globals.prev_mask));
+#endif
+
+        /* NOTE(cjiang): some fields such as cpu_frequencies take relatively longer
+         * to initialize, (5 milisecond per logical cpu right now), therefore we
+         * calculate them lazily. */
+        if (hp_globals.cpu_frequencies == NULL) {
+            get_all_cpu_frequencies();
+            restore_cpu_affinity(&hp_globals.prev_mask);
+        }
+
+        /* bind to a random cpu so that we can use rdtsc instruction. */
+        bind_to_cpu((int) (rand() % hp_shared.cpu_num));
     }
 
-    /* bind to a random cpu so that we can use rdtsc instruction. */
-    bind_to_cpu((int) (rand() % hp_globals.cpu_num));
+    if (hp_globals.xhprof_flags & XHPROF_FLAGS_CPU) {
+        hp_cpu_clock_init();
+    }
+
+    if (hp_globals.xhprof_flags & XHPROF_FLAGS_PERF) {
+        hp_perf_counters_init();
+    }
 
     /* Call current mode's init cb */
     hp_globals.mode_cb.init_cb(TSRMLS_C);
@@ -663,17 +1956,14 @@ void hp_clean_profiler_state(TSRMLS_D) {
     hp_globals.mode_cb.exit_cb(TSRMLS_C);
 
     /* Clear globals */
-    if (hp_globals.stats_count) {
-        efree_hp_stats_count();
-    }
+    hp_globals.stats_count_func_num = 0;
+    hp_hists_free();
+    hp_detail_free();
 
-    hp_globals.entries = NULL;
+    hp_globals.frame_depth = 0;
     hp_globals.ever_enabled = 0;
 
-    if (hp_globals.track_function_names) {
-        zend_hash_clean(hp_globals.track_function_names);
-        hp_globals.track_function_names = NULL;
-    }
+    hp_release_track_list();
 }
 
 /*
@@ -684,18 +1974,24 @@ void hp_clean_profiler_state(TSRMLS_D) {
  *        CALLING FUNCTION OR BY CALLING TSRMLS_FETCH()
  *        TSRMLS_FETCH() IS RELATIVELY EXPENSIVE.
  */
-#define BEGIN_PROFILING(entries, func_hash_index)                  \
+#define BEGIN_PROFILING(func_hash_index, execute_data)                     \
     do {                                                                  \
         /* 判断当前函数是否需要捕获 */     \
-        func_hash_index = get_func_hash_index();                 \
+        func_hash_index = get_func_hash_index(execute_data);              \
         if (func_hash_index) {                                                 \
-            hp_entry_t *cur_entry = hp_fast_alloc_hprof_entry();              \
-            (cur_entry)->func_hash_index = func_hash_index;                               \
-            (cur_entry)->prev_hprof = (*(entries));                           \
+            hp_entry_t *cur_entry;                                            \
+            if (UNEXPECTED(hp_globals.frame_depth == hp_globals.frame_capacity)) { \
+                hp_frames_grow();                                             \
+            }                                                                 \
+            cur_entry = HP_FRAME(hp_globals.frame_depth);                     \
+            (cur_entry)->func_hash_index = (uint32)func_hash_index;           \
+            if (hp_globals.frame_off[HP_FRAME_EXECUTE_DATA]) {                \
+                *HP_FRAME_PART(cur_entry, HP_FRAME_EXECUTE_DATA, zend_execute_data *) = (execute_data); \
+            }                                                                 \
             /* Call the mode's beginfn callback */                            \
-            hp_globals.mode_cb.begin_fn_cb((entries), (cur_entry) TSRMLS_CC); \
-            /* Update entries linked list */                                  \
-            (*(entries)) = (cur_entry);                                       \
+            hp_globals.mode_cb.begin_fn_cb((cur_entry) TSRMLS_CC);            \
+            /* Push it */                                                     \
+            hp_globals.frame_depth++;                                         \
         }                                                                   \
     } while (0)
 
@@ -707,172 +2003,334 @@ void hp_clean_profiler_state(TSRMLS_D) {
  *        CALLING FUNCTION OR BY CALLING TSRMLS_FETCH()
  *        TSRMLS_FETCH() IS RELATIVELY EXPENSIVE.
  */
-#define END_PROFILING(entries, func_hash_index)                            \
+#define END_PROFILING(func_hash_index)                                     \
     do {                                                                  \
-            hp_entry_t *cur_entry;                                            \
+            uint32 depth = --hp_globals.frame_depth;                          \
             /* Call the mode's endfn callback. */                             \
             /* NOTE(cjiang): we want to call this 'end_fn_cb' before */       \
             if (func_hash_index) {                                                 \
-                hp_globals.mode_cb.end_fn_cb((entries) TSRMLS_CC);                \
+                hp_globals.mode_cb.end_fn_cb(HP_FRAME(depth),                 \
+                        depth ? HP_FRAME(depth - 1) : NULL TSRMLS_CC);        \
             }                                                                   \
-            cur_entry = (*(entries));                                         \
-            /* Free top entry and update entries linked list */               \
-            (*(entries)) = (*(entries))->prev_hprof;                          \
-            hp_fast_free_hprof_entry(cur_entry);                              \
     } while (0)
 
 
 
 //是否不捕获当前函数
 //获取要捕获的函数 在hash table 的index 值
-static inline zend_long  get_func_hash_index() {
-    if (hp_globals.track_function_names != NULL) {
-
-        if (hp_globals.track_algorithm == XHPROF_ALGORITHM_TRIE) {
-
-            zend_function    *cur_func;
-            zend_string      *cur_class_name;
-            zend_string      *cur_function_name;
-
-            if (!EG(current_execute_data)) {
-                return NULL;
-            }
+//结果按 zend_function 缓存, 命中时只需一次内存读取和比较
+static zend_always_inline zend_long get_func_hash_index(zend_execute_data *execute_data) {
+    zend_function       *func;
+    hp_func_cache_entry *entry;
+    zend_long            func_hash_index;
+
+    if (hp_globals.track_list == NULL || !execute_data) {
+        return 0;
+    }
 
-            cur_func = EG(current_execute_data)->func;
+    func = execute_data->func;
+    if (!func || !func->common.function_name) {
+        return 0;
+    }
 
-            if (!cur_func || !cur_func->common.function_name) {
-                return NULL;
-            }
-            cur_function_name = cur_func->common.function_name;
+    entry = &hp_globals.func_cache[HP_FUNC_CACHE_SLOT(func)];
+    if (EXPECTED(entry->func == func
+                && entry->generation == hp_globals.func_cache_generation
+                && entry->function_name == func->common.function_name
+                && entry->scope == func->common.scope)) {
+        return entry->func_hash_index;
+    }
 
-            //类名
-            if (cur_func->common.scope && cur_func->common.scope->name) {
-                cur_class_name = cur_func->common.scope->name;
-            } 
+    //绝大多数函数不抓取, 先用过滤器排除, 不用查表
+    if (hp_globals.track_list->bloom && !hp_bloom_maybe(hp_globals.track_list->bloom, HP_NAME_HASH_MIX(
+                    func->common.scope && func->common.scope->name ? zend_string_hash_val(func->common.scope->name) : 0,
+                    zend_string_hash_val(func->common.function_name)))) {
+        func_hash_index = 0;
+    } else {
+        func_hash_index = hp_resolve_func_hash_index(func);
+    }
 
-            //字典树查找
-            return hp_trie_check_func(hp_globals.track_function_trie, cur_class_name, CLASS_FUNC_SPLIT_CHAR, cur_function_name);
-            
-        } else {
-            //hash 查找
-            zend_string *curr_func;
-            curr_func = hp_get_function_name();
+    entry->func = func;
+    entry->function_name = func->common.function_name;
+    entry->scope = func->common.scope;
+    entry->generation = hp_globals.func_cache_generation;
+    entry->func_hash_index = (uint32)func_hash_index;
 
-            zval *index_value;
-            index_value = zend_hash_find(hp_globals.track_function_names, curr_func);
+    return func_hash_index;
+}
 
-            if (!index_value) {
-                return NULL;
-            }
+/**
+ * Look func up in the track list, bypassing the cache.
+ */
+static zend_never_inline zend_long hp_resolve_func_hash_index(zend_function *func) {
+    hp_track_list *list = hp_globals.track_list;
+    zend_long index;
 
-            return Z_LVAL_P(index_value);
-        }
+    index = hp_track_list_lookup(list, func, hp_globals.track_algorithm);
 
+    if (index && list->is_pattern[index] && (hp_globals.xhprof_flags & XHPROF_FLAGS_PATTERN_DETAIL)) {
+        index = hp_detail_row(func, (uint32)index);
     }
 
-    return NULL;
+    return index;
 }
 
 /**
- * Get the name of the current function. The name is qualified with
- * the class name if the function is in a class.
+ * Row of func in list: the exact name, else a "*:method" pattern, else the
+ * longest prefix pattern; 0 when nothing matches.
  *
- * @author kannan, hzhao
+ * @param int algorithm  XHPROF_ALGORITHM_XX used for exact names; falls back
+ *                       to the hash table when the list lacks its structure
  */
-static zend_string *hp_get_function_name() {
-    zend_execute_data *data;
-    char              *ret = NULL;
-    zend_function      *curr_func;
+static zend_long hp_track_list_lookup(hp_track_list *list, zend_function *func, uint32_t algorithm) {
+    zend_string *cur_class_name = NULL;
+    zend_long index = 0;
 
-    data = EG(current_execute_data);
-
-    if (!data) {
-        return NULL;
+    //类名
+    if (func->common.scope && func->common.scope->name) {
+        cur_class_name = func->common.scope->name;
     }
 
-    curr_func = data->func;
+    if (algorithm == XHPROF_ALGORITHM_TRIE && list->trie) {
+        //字典树查找, 完全匹配优先, 其次是最长的前缀
+        index = hp_trie_check_func(list->trie, cur_class_name, CLASS_FUNC_SPLIT_CHAR, func->common.function_name);
+
+    } else {
+        //hash 查找, 用类名和函数名自带的 hash, 不拼接字符串
+        if (algorithm == XHPROF_ALGORITHM_PHF && list->phf) {
+            index = hp_phf_table_find(list, cur_class_name, func->common.function_name);
+        } else {
+            index = hp_name_table_find(list, cur_class_name, func->common.function_name);
+        }
 
-    if (!curr_func->common.function_name) {
-        return NULL;
+        if (!index && list->has_prefix) {
+            index = hp_trie_check_func(list->trie, cur_class_name, CLASS_FUNC_SPLIT_CHAR, func->common.function_name);
+        }
     }
 
-    //cclehui_test
-    //return curr_func->common.function_name;
+    //"*:method" 比前缀优先
+    if (list->method_patterns && cur_class_name && (!index || list->is_pattern[index])) {
+        zval *index_value = zend_hash_find(list->method_patterns, func->common.function_name);
 
+        if (index_value) {
+            index = Z_LVAL_P(index_value);
+        }
+    }
 
-    //没有类
-    if (!curr_func->common.scope || !curr_func->common.scope->name) {
-        zend_string_addref(curr_func->common.function_name);
-        return curr_func->common.function_name;
-    } 
+    return index;
+}
 
-    zend_string *result = hp_globals.cur_func_name;
+/**
+ * XHPROF_FLAGS_PATTERN_DETAIL: the row of one concrete function matched by
+ * pattern row parent. Rows are appended after the track list's own rows on
+ * first use and live until the next xhprof_enable(). Calls are counted in
+ * both the concrete row and the pattern row, see hp_mode_hier_endfn_cb().
+ */
+static uint32 hp_detail_row(zend_function *func, uint32 parent) {
+    hp_track_list *list = hp_globals.track_list;
+    zend_string *name;
+    zval *found, row;
+    uint32 index;
+
+    if (!hp_globals.detail_ht) {
+        ALLOC_HASHTABLE(hp_globals.detail_ht);
+        zend_hash_init(hp_globals.detail_ht, 16, NULL, NULL, 0);
+    }
 
-    //result = zend_string_dup(curr_func->common.scope->name, 0);
-    //result = zend_string_alloc(ZSTR_LEN(curr_func->common.scope->name) + ZSTR_LEN(curr_func->common.function_name) + 1 , 0);
+    if (func->common.scope && func->common.scope->name) {
+        name = strpprintf(0, "%s%c%s", ZSTR_VAL(func->common.scope->name), CLASS_FUNC_SPLIT_CHAR,
+                ZSTR_VAL(func->common.function_name));
+    } else {
+        name = zend_string_copy(func->common.function_name);
+    }
 
-    memcpy(result->val, ZSTR_VAL(curr_func->common.scope->name), ZSTR_LEN(curr_func->common.scope->name));
+    //同名的函数共用一行 (例如不同文件里的同名闭包)
+    found = zend_hash_find(hp_globals.detail_ht, name);
+    if (found) {
+        zend_string_release(name);
+        return (uint32)Z_LVAL_P(found);
+    }
 
-    *(result->val + ZSTR_LEN(curr_func->common.scope->name)) = CLASS_FUNC_SPLIT_CHAR;
+    if (hp_globals.detail_num == hp_globals.detail_size) {
+        hp_globals.detail_size = hp_globals.detail_size ? hp_globals.detail_size * 2 : 16;
+        hp_globals.detail_names = (zend_string **)erealloc(hp_globals.detail_names,
+                sizeof(zend_string *) * hp_globals.detail_size);
+        hp_globals.detail_parent = (uint32 *)erealloc(hp_globals.detail_parent,
+                sizeof(uint32) * hp_globals.detail_size);
+    }
 
-    memcpy(result->val + ZSTR_LEN(curr_func->common.scope->name) + 1 , ZSTR_VAL(curr_func->common.function_name), ZSTR_LEN(curr_func->common.function_name));
+    index = list->func_num + hp_globals.detail_num;
+    hp_globals.detail_names[hp_globals.detail_num] = name;
+    hp_globals.detail_parent[hp_globals.detail_num] = parent;
+    hp_globals.detail_num++;
 
-    *(result->val + ZSTR_LEN(curr_func->common.scope->name) + 1 + ZSTR_LEN(curr_func->common.function_name))  = '\0';
+    ZVAL_LONG(&row, index);
+    zend_hash_add_new(hp_globals.detail_ht, name, &row);
 
-    hp_globals.cur_func_name->len = ZSTR_LEN(curr_func->common.scope->name) + ZSTR_LEN(curr_func->common.function_name) + 1;
+    hp_stats_count_grow(index + 1);
+    if (hp_globals.hists) {
+        hp_globals.hists = (hp_hist **)erealloc(hp_globals.hists, sizeof(hp_hist *) * (index + 1));
+        memset(hp_globals.hists + hp_globals.hists_num, 0, sizeof(hp_hist *) * (index + 1 - hp_globals.hists_num));
+        hp_globals.hists_num = index + 1;
+    }
 
-    return result;
+    return index;
 }
 
-/**
- * Free any items in the free list.
- */
-static void hp_free_the_free_list() {
-    hp_entry_t *p = hp_globals.entry_free_list;
-    hp_entry_t *cur;
+static void hp_detail_free() {
+    uint32 i;
 
-    while (p) {
-        cur = p;
-        p = p->prev_hprof;
-        free(cur);
+    if (hp_globals.detail_ht) {
+        zend_hash_destroy(hp_globals.detail_ht);
+        FREE_HASHTABLE(hp_globals.detail_ht);
+        hp_globals.detail_ht = NULL;
     }
-}
 
-/**
- * Fast allocate a hp_entry_t structure. Picks one from the
- * free list if available, else does an actual allocate.
- *
- * Doesn't bother initializing allocated memory.
- *
- * @author kannan
- */
-static hp_entry_t *hp_fast_alloc_hprof_entry() {
-    hp_entry_t *p;
+    for (i = 0; i < hp_globals.detail_num; i++) {
+        zend_string_release(hp_globals.detail_names[i]);
+    }
+    if (hp_globals.detail_names) {
+        efree(hp_globals.detail_names);
+        efree(hp_globals.detail_parent);
+    }
+    hp_globals.detail_names = NULL;
+    hp_globals.detail_parent = NULL;
+    hp_globals.detail_num = 0;
+    hp_globals.detail_size = 0;
+}
 
-    p = hp_globals.entry_free_list;
+//导出时每一行的名字
+static zend_always_inline zend_string *hp_row_name(uint32 index) {
+    hp_track_list *list = hp_globals.track_list;
 
-    if (p) {
-        hp_globals.entry_free_list = p->prev_hprof;
-        return p;
-    } else {
-        return (hp_entry_t *)malloc(sizeof(hp_entry_t));
+    if (index < list->func_num) {
+        return list->names[index];
     }
+    return hp_globals.detail_names[index - list->func_num];
 }
 
+#ifdef HP_HAVE_DUMP
 /**
- * Fast free a hp_entry_t structure. Simply returns back
- * the hp_entry_t to a free list and doesn't actually
- * perform the free.
- *
- * @author kannan
+ * xhprof.dump: copy the rows this request collected into a batch for the
+ * writer thread. Only a copy happens here; encoding and I/O are done by
+ * the writer, see dump.h.
  */
-static void hp_fast_free_hprof_entry(hp_entry_t *p) {
-
-    /* we use/overload the prev_hprof field in the structure to link entries in
-     * the free list. */
-    p->prev_hprof = hp_globals.entry_free_list;
-    hp_globals.entry_free_list = p;
-}
+static void hp_dump_request() {
+    hp_dump_batch *batch;
+    uint32 i;
+
+    if (!hp_globals.track_list || hp_globals.stats_count_func_num <= 1) {
+        return;
+    }
+
+    //内存不够时 dump.h 记为丢弃
+    batch = hp_dump_batch_new(4096, hp_globals.xhprof_flags);
+    if (!batch) {
+        return;
+    }
+
+    for (i = 1; i < hp_globals.stats_count_func_num; i++) {
+        zend_string *name;
+
+        if (!HP_STATS(i, HP_STATS_COUNT_CT)) {
+            continue;
+        }
+        name = hp_row_name(i);
+        batch = hp_dump_batch_row(batch, ZSTR_VAL(name), (uint32)ZSTR_LEN(name), &HP_STATS(i, HP_STATS_COUNT_CT));
+        if (!batch) {
+            return;
+        }
+    }
+
+    if (batch->row_num) {
+        hp_dump_submit(batch);
+    } else {
+        free(batch);
+    }
+}
+#endif
+
+/**
+ * Drop every cached tracking decision. Called whenever the track list may
+ * have changed.
+ */
+static void hp_func_cache_invalidate() {
+    hp_globals.func_cache_generation++;
+
+    //generation 回绕到 0 时清空, 保证空槽位永远不会命中
+    if (hp_globals.func_cache_generation == 0) {
+        memset(hp_globals.func_cache, 0, sizeof(hp_func_cache_entry) * HP_FUNC_CACHE_SIZE);
+        hp_globals.func_cache_generation = 1;
+    }
+}
+
+/**
+ * Lay out the frame for the flags of this xhprof_enable() and make sure the
+ * stack holds at least xhprof.stack_depth frames. Called from hp_begin()
+ * after the counters are opened, with the stack empty.
+ */
+static void hp_frames_layout() {
+    uint32 flags = hp_globals.xhprof_flags;
+    size_t size = sizeof(hp_entry_t);
+    size_t want;
+    zend_long depth;
+
+    memset(hp_globals.frame_off, 0, sizeof(hp_globals.frame_off));
+
+#define HP_FRAME_ADD(part, bytes)                                             \
+    do {                                                                      \
+        hp_globals.frame_off[part] = (uint16_t)size;                          \
+        size += (bytes);                                                      \
+    } while (0)
+
+    if (flags & XHPROF_FLAGS_CPU) {
+        HP_FRAME_ADD(HP_FRAME_CPU, sizeof(uint64));
+    }
+    if (flags & XHPROF_FLAGS_MEMORY) {
+        HP_FRAME_ADD(HP_FRAME_MEMORY, sizeof(hp_frame_memory));
+    }
+    if ((flags & XHPROF_FLAGS_PERF) && hp_globals.perf_counters_num) {
+        HP_FRAME_ADD(HP_FRAME_PERF, sizeof(uint64) * HP_PERF_COUNTER_NUM);
+    }
+    if (flags & XHPROF_FLAGS_EXCLUSIVE) {
+        HP_FRAME_ADD(HP_FRAME_EXCLUSIVE, sizeof(hp_frame_exclusive));
+    }
+    if (flags & XHPROF_FLAGS_PATTERN_DETAIL) {
+        HP_FRAME_ADD(HP_FRAME_PATTERN, sizeof(hp_frame_pattern));
+    }
+    if (hp_shared.observer) {
+        HP_FRAME_ADD(HP_FRAME_EXECUTE_DATA, sizeof(zend_execute_data *));
+    }
+
+#undef HP_FRAME_ADD
+
+    hp_globals.frame_size = size;
+    hp_globals.frame_depth = 0;
+
+    depth = INI_INT("xhprof.stack_depth");
+    if (depth < 16) {
+        depth = 16;
+    }
+    want = (size_t)depth * size;
+    if (hp_globals.frames_bytes < want) {
+        if (hp_globals.frames) {
+            pefree(hp_globals.frames, 1);
+        }
+        hp_globals.frames = (char *)pemalloc(want, 1);
+        hp_globals.frames_bytes = want;
+    }
+    hp_globals.frame_capacity = (uint32)(hp_globals.frames_bytes / size);
+}
+
+/**
+ * The stack is full: double it. Only called by BEGIN_PROFILING() before it
+ * takes the address of the new frame, nothing holds a frame pointer then.
+ */
+static zend_never_inline void hp_frames_grow() {
+    hp_globals.frames_bytes *= 2;
+    hp_globals.frames = (char *)perealloc(hp_globals.frames, hp_globals.frames_bytes, 1);
+    hp_globals.frame_capacity = (uint32)(hp_globals.frames_bytes / hp_globals.frame_size);
+}
 
 /**
  * ***********************
@@ -880,6 +2338,17 @@ static void hp_fast_free_hprof_entry(hp_entry_t *p) {
  * ***********************
  */
 
+/**
+ * Nanoseconds from clock_gettime(CLOCK_MONOTONIC), which glibc serves from
+ * the vDSO without entering the kernel.
+ */
+static zend_always_inline uint64 hp_monotonic_timer() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64)ts.tv_sec * 1000000000ULL + (uint64)ts.tv_nsec;
+}
+
 /**
  * Get time stamp counter (TSC) value via 'rdtsc' instruction.
  *
@@ -887,11 +2356,247 @@ static void hp_fast_free_hprof_entry(hp_entry_t *p) {
  * @author cjiang
  */
 static inline uint64 cycle_timer() {
+#ifdef HP_HAVE_TSC
     uint32 __a,__d;
     uint64 val;
     asm volatile("rdtsc" : "=a" (__a), "=d" (__d));
     (val) = ((uint64)__a) | (((uint64)__d)<<32);
     return val;
+#else
+    return hp_monotonic_timer();
+#endif
+}
+
+/**
+ * Read the TSC with 'rdtscp', which waits for earlier instructions to
+ * retire so the measured code can't leak past the timestamp.
+ */
+static zend_always_inline uint64 hp_rdtscp_timer() {
+#ifdef HP_HAVE_TSC
+    uint32 __a,__d,__c;
+    asm volatile("rdtscp" : "=a" (__a), "=d" (__d), "=c" (__c));
+    return ((uint64)__a) | (((uint64)__d)<<32);
+#else
+    return hp_monotonic_timer();
+#endif
+}
+
+/**
+ * Read the configured clock. Convert differences with hp_clock_to_us().
+ */
+static zend_always_inline uint64 hp_clock_read() {
+    switch (hp_shared.clock_source) {
+        case HP_CLOCK_TSC:
+            return hp_rdtscp_timer();
+        case HP_CLOCK_TSC_PINNED:
+            return cycle_timer();
+        default:
+            return hp_monotonic_timer();
+    }
+}
+
+static zend_always_inline double hp_clock_to_us(uint64 ticks) {
+    if (hp_shared.clock_source == HP_CLOCK_TSC_PINNED) {
+        return get_us_from_tsc(ticks, hp_globals.cpu_frequencies[hp_globals.cur_cpu_id]);
+    }
+    return ticks / hp_shared.clock_ticks_per_us;
+}
+
+/**
+ * Check CPUID for an invariant TSC (constant rate in all P/C-states and
+ * synchronized across cores) and for the rdtscp instruction.
+ */
+static int hp_tsc_is_invariant() {
+#ifdef HP_HAVE_TSC
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+        return 0;
+    }
+
+    //rdtscp
+    if (!__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 27))) {
+        return 0;
+    }
+
+    //invariant TSC
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8))) {
+        return 0;
+    }
+
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Resolve xhprof.clock_source to one of HP_CLOCK_TSC, HP_CLOCK_MONOTONIC
+ * and HP_CLOCK_TSC_PINNED.
+ */
+static uint32 hp_clock_select(const char *name) {
+    uint32 clock_source = HP_CLOCK_AUTO;
+
+    hp_shared.tsc_invariant = hp_tsc_is_invariant();
+
+    if (name && strcasecmp(name, "tsc") == 0) {
+        clock_source = HP_CLOCK_TSC;
+    } else if (name && strcasecmp(name, "monotonic") == 0) {
+        clock_source = HP_CLOCK_MONOTONIC;
+    } else if (name && strcasecmp(name, "pinned_tsc") == 0) {
+        clock_source = HP_CLOCK_TSC_PINNED;
+    }
+
+#ifndef HP_HAVE_TSC
+    return HP_CLOCK_MONOTONIC;
+#else
+    if (clock_source == HP_CLOCK_AUTO) {
+        clock_source = hp_shared.tsc_invariant ? HP_CLOCK_TSC : HP_CLOCK_MONOTONIC;
+    }
+    return clock_source;
+#endif
+}
+
+static const char *hp_clock_name(uint32 clock_source) {
+    switch (clock_source) {
+        case HP_CLOCK_TSC:
+            return "tsc (rdtscp)";
+        case HP_CLOCK_TSC_PINNED:
+            return "pinned_tsc (rdtsc, cpu affinity)";
+        default:
+            return "monotonic (clock_gettime)";
+    }
+}
+
+/**
+ * CPU time of the calling thread in nanoseconds, from the source chosen by
+ * hp_cpu_clock_init().
+ */
+static zend_always_inline uint64 hp_cpu_time_read() {
+    struct timespec ts;
+
+    switch (hp_globals.cpu_clock_active) {
+        case HP_CPU_CLOCK_PERF:
+            return hp_perf_time_enabled(&hp_globals.cpu_perf_event);
+
+        case HP_CPU_CLOCK_GETRUSAGE: {
+            struct rusage ru;
+
+            getrusage(RUSAGE_SELF, &ru);
+            return ((uint64)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000
+                    + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000;
+        }
+
+        default:
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+            return (uint64)ts.tv_sec * 1000000000ULL + (uint64)ts.tv_nsec;
+    }
+}
+
+/**
+ * Open the perf task clock of this thread and check that the time read
+ * from its mmap page in user space agrees with CLOCK_THREAD_CPUTIME_ID.
+ * Some kernels and hypervisors don't provide a usable cap_user_time.
+ */
+static int hp_cpu_perf_open() {
+#ifdef HP_HAVE_PERF
+    uint64 perf_start, perf_end, thread_start, thread_end;
+
+    if (hp_perf_event_open(&hp_globals.cpu_perf_event, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK) < 0) {
+        return 0;
+    }
+    hp_globals.cpu_perf_pid = getpid();
+
+    hp_globals.cpu_clock_active = HP_CPU_CLOCK_THREAD_CPUTIME;
+    perf_start = hp_perf_time_enabled(&hp_globals.cpu_perf_event);
+    thread_start = hp_cpu_time_read();
+    do {
+        thread_end = hp_cpu_time_read();
+    } while (thread_end - thread_start < HP_CPU_PERF_VALIDATE_NS);
+    perf_end = hp_perf_time_enabled(&hp_globals.cpu_perf_event);
+
+    if (perf_start == 0 || perf_end <= perf_start
+            || (perf_end - perf_start) * 10 < (thread_end - thread_start) * 8
+            || (perf_end - perf_start) * 10 > (thread_end - thread_start) * 12) {
+        hp_perf_event_close(&hp_globals.cpu_perf_event);
+        return 0;
+    }
+
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Pick the CPU time source for this process. The perf event belongs to the
+ * thread that opened it, so a forked worker opens its own.
+ */
+static void hp_cpu_clock_init() {
+    if (hp_shared.cpu_clock != HP_CPU_CLOCK_AUTO && hp_shared.cpu_clock != HP_CPU_CLOCK_PERF) {
+        hp_globals.cpu_clock_active = hp_shared.cpu_clock;
+        return;
+    }
+
+    if (hp_globals.cpu_perf_pid == getpid()) {
+        return;
+    }
+
+    //fork 继承来的 fd 统计的是父进程
+    if (hp_globals.cpu_perf_event.fd >= 0) {
+        hp_perf_event_close(&hp_globals.cpu_perf_event);
+    }
+
+    hp_globals.cpu_clock_active = hp_cpu_perf_open() ? HP_CPU_CLOCK_PERF : HP_CPU_CLOCK_THREAD_CPUTIME;
+    hp_globals.cpu_perf_pid = getpid();
+}
+
+/**
+ * Open the hardware counters for XHPROF_FLAGS_PERF on this thread, once per
+ * process. Counters that can't be opened (perf_event_paranoid, containers,
+ * virtual machines without a PMU) simply stay closed and are skipped.
+ */
+static void hp_perf_counters_init() {
+    int i;
+
+    if (hp_globals.perf_counters_pid == getpid()) {
+        return;
+    }
+
+    //fork 继承来的 fd 统计的是父进程
+    hp_perf_counters_close(&hp_globals);
+
+    for (i = 0; i < HP_PERF_COUNTER_NUM; i++) {
+        if (hp_perf_counter_open(&hp_globals.perf_counters[i], i) == 0) {
+            hp_globals.perf_counters_num++;
+        }
+    }
+
+    hp_globals.perf_counters_pid = getpid();
+}
+
+static void hp_perf_counters_close(zend_xhprof_globals *globals) {
+    int i;
+
+    for (i = 0; i < HP_PERF_COUNTER_NUM; i++) {
+        if (globals->perf_counters[i].fd >= 0) {
+            hp_perf_event_close(&globals->perf_counters[i]);
+        }
+    }
+    globals->perf_counters_num = 0;
+}
+
+static const char *hp_cpu_clock_name(uint32 cpu_clock) {
+    switch (cpu_clock) {
+        case HP_CPU_CLOCK_AUTO:
+            return "auto";
+        case HP_CPU_CLOCK_PERF:
+            return "perf (task clock, user space)";
+        case HP_CPU_CLOCK_GETRUSAGE:
+            return "getrusage";
+        default:
+            return "thread_cputime (clock_gettime)";
+    }
 }
 
 /**
@@ -992,6 +2697,184 @@ static double get_cpu_frequency() {
     return (tsc_end - tsc_start) * 1.0 / (get_us_interval(&start, &end));
 }
 
+/**
+ * Fingerprint of /proc/cpuinfo, ignoring the "cpu MHz" lines which change
+ * all the time. Returns 0 when it can't be read.
+ */
+static uint64 hp_cpuinfo_fingerprint() {
+    FILE *fp = fopen("/proc/cpuinfo", "r");
+    char line[SCRATCH_BUF_LEN];
+    uint64 h = 14695981039346656037ULL;
+    const char *p;
+
+    if (!fp) {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "cpu MHz", sizeof("cpu MHz") - 1) == 0) {
+            continue;
+        }
+        //FNV-1a
+        for (p = line; *p; p++) {
+            h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+        }
+    }
+    fclose(fp);
+
+    return h ? h : 1;
+}
+
+/**
+ * Read a TSC rate (MHz) for this fingerprint from the cache file.
+ */
+static double hp_tsc_cache_read(const char *path, uint64 fingerprint) {
+    FILE *fp = fopen(path, "r");
+    unsigned long long cached = 0;
+    double mhz = 0.0;
+
+    if (!fp) {
+        return 0.0;
+    }
+
+    if (fscanf(fp, "%llx %lf", &cached, &mhz) != 2 || cached != fingerprint) {
+        mhz = 0.0;
+    }
+    fclose(fp);
+
+    return mhz;
+}
+
+/**
+ * Write the cache file through a temp file + rename, so concurrent readers
+ * never see a partial line.
+ */
+static void hp_tsc_cache_write(const char *path, uint64 fingerprint, double mhz) {
+    char tmp[SCRATCH_BUF_LEN];
+    FILE *fp;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+
+    fp = fopen(tmp, "w");
+    if (!fp) {
+        return;
+    }
+
+    fprintf(fp, "%llx %f\n", (unsigned long long)fingerprint, mhz);
+    if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+    }
+}
+
+/**
+ * TSC rate (MHz) exported by the kernel, available on some kernels.
+ */
+static double hp_tsc_from_sysfs() {
+    FILE *fp = fopen("/sys/devices/system/cpu/cpu0/tsc_freq_khz", "r");
+    unsigned long khz = 0;
+
+    if (!fp) {
+        return 0.0;
+    }
+
+    if (fscanf(fp, "%lu", &khz) != 1) {
+        khz = 0;
+    }
+    fclose(fp);
+
+    return khz / 1000.0;
+}
+
+/**
+ * TSC rate (MHz) from CPUID leaf 0x15 (TSC / crystal clock ratio), or the
+ * base frequency in leaf 0x16 when the crystal clock isn't enumerated.
+ */
+static double hp_tsc_from_cpuid() {
+#ifdef HP_HAVE_TSC
+    unsigned int max_leaf, eax, ebx, ecx, edx;
+
+    max_leaf = __get_cpuid_max(0, NULL);
+    if (max_leaf < 0x15) {
+        return 0.0;
+    }
+
+    __cpuid(0x15, eax, ebx, ecx, edx);
+    if (eax == 0 || ebx == 0) {
+        return 0.0;
+    }
+
+    if (ecx) {
+        return (double)ecx * ebx / eax / 1000000.0;
+    }
+
+    if (max_leaf >= 0x16) {
+        __cpuid(0x16, eax, ebx, ecx, edx);
+        return (double)(eax & 0xffff);
+    }
+#endif
+    return 0.0;
+}
+
+/**
+ * Measure the TSC rate (MHz) against CLOCK_MONOTONIC over a short busy wait.
+ */
+static double hp_tsc_measure() {
+    uint64 t_start, t_end, tsc_start, tsc_end;
+
+    t_start = hp_monotonic_timer();
+    tsc_start = hp_rdtscp_timer();
+
+    do {
+        t_end = hp_monotonic_timer();
+    } while (t_end - t_start < HP_TSC_MEASURE_US * 1000ULL);
+
+    tsc_end = hp_rdtscp_timer();
+
+    return (tsc_end - tsc_start) * 1000.0 / (t_end - t_start);
+}
+
+/**
+ * Work out the invariant TSC rate once per host, instead of sleeping 5 ms
+ * per logical CPU. Sources in order: the cache file under
+ * xhprof.output_dir (only if /proc/cpuinfo is unchanged), the kernel, CPUID,
+ * and a single short measurement. The result is written back to the cache.
+ */
+static void hp_tsc_calibrate() {
+    const char *output_dir = INI_STR("xhprof.output_dir");
+    char path[SCRATCH_BUF_LEN];
+    uint64 fingerprint = 0;
+    double mhz = 0.0;
+
+    path[0] = 0;
+    if (output_dir && *output_dir) {
+        fingerprint = hp_cpuinfo_fingerprint();
+        if (fingerprint) {
+            snprintf(path, sizeof(path), "%s/%s", output_dir, HP_TSC_CACHE_FILE);
+            mhz = hp_tsc_cache_read(path, fingerprint);
+            if (mhz > 0) {
+                hp_shared.tsc_calibration = "cache";
+                hp_shared.clock_ticks_per_us = mhz;
+                return;
+            }
+        }
+    }
+
+    if ((mhz = hp_tsc_from_sysfs()) > 0) {
+        hp_shared.tsc_calibration = "sysfs";
+    } else if ((mhz = hp_tsc_from_cpuid()) > 0) {
+        hp_shared.tsc_calibration = "cpuid";
+    } else {
+        mhz = hp_tsc_measure();
+        hp_shared.tsc_calibration = "measured";
+    }
+
+    hp_shared.clock_ticks_per_us = mhz;
+
+    if (path[0] && mhz > 0) {
+        hp_tsc_cache_write(path, fingerprint, mhz);
+    }
+}
+
 /**
  * Calculate frequencies for all available cpus.
  *
@@ -1001,16 +2884,16 @@ static void get_all_cpu_frequencies() {
     int id;
     double frequency;
 
-    hp_globals.cpu_frequencies = malloc(sizeof(double) * hp_globals.cpu_num);
+    hp_globals.cpu_frequencies = malloc(sizeof(double) * hp_shared.cpu_num);
     if (hp_globals.cpu_frequencies == NULL) {
         return;
     }
 
     /* Iterate over all cpus found on the machine. */
-    for (id = 0; id < hp_globals.cpu_num; ++id) {
+    for (id = 0; id < hp_shared.cpu_num; ++id) {
         /* Only get the previous cpu affinity mask for the first call. */
         if (bind_to_cpu(id)) {
-            clear_frequencies();
+            clear_frequencies(&hp_globals);
             return;
         }
 
@@ -1020,7 +2903,7 @@ static void get_all_cpu_frequencies() {
 
         frequency = get_cpu_frequency();
         if (frequency == 0.0) {
-            clear_frequencies();
+            clear_frequencies(&hp_globals);
             return;
         }
         hp_globals.cpu_frequencies[id] = frequency;
@@ -1051,183 +2934,854 @@ int restore_cpu_affinity(cpu_set_t * prev_mask) {
  *
  * @author cjiang
  */
-static void clear_frequencies() {
-    if (hp_globals.cpu_frequencies) {
-        free(hp_globals.cpu_frequencies);
-        hp_globals.cpu_frequencies = NULL;
+static void clear_frequencies(zend_xhprof_globals *globals) {
+    if (globals->cpu_frequencies) {
+        free(globals->cpu_frequencies);
+        globals->cpu_frequencies = NULL;
+        //亲和性属于调用的线程, 释放别的线程的状态时不能动它
+        if (globals == &hp_globals) {
+            restore_cpu_affinity(&globals->prev_mask);
+        }
+    }
+}
+
+
+/**
+ * ***************************
+ * XHPROF DUMMY CALLBACKS
+ * ***************************
+ */
+void hp_mode_dummy_init_cb(TSRMLS_D) { }
+
+
+void hp_mode_dummy_exit_cb(TSRMLS_D) { }
+
+
+void hp_mode_dummy_beginfn_cb(hp_entry_t *current  TSRMLS_DC) { }
+
+void hp_mode_dummy_endfn_cb(hp_entry_t *top, hp_entry_t *parent  TSRMLS_DC) { }
+
+
+/**
+ * ****************************
+ * XHPROF COMMON CALLBACKS
+ * ****************************
+ */
+
+/**
+ * begin function callback
+ *
+ * @author kannan
+ */
+void hp_mode_hier_beginfn_cb(hp_entry_t  *current  TSRMLS_DC) {
+
+    /* 同一个函数在栈上的层数, 0 为最外层 */
+    current->rlvl_hprof = (int)HP_STATS(current->func_hash_index, HP_STATS_ACTIVE)++;
+
+    if (hp_globals.frame_off[HP_FRAME_EXCLUSIVE]) {
+        hp_frame_exclusive *excl = HP_FRAME_PART(current, HP_FRAME_EXCLUSIVE, hp_frame_exclusive);
+        excl->child_ticks = 0;
+        excl->child_cpu = 0;
+    }
+
+    /* XHPROF_FLAGS_PATTERN_DETAIL 的具体函数, 同时计入所属模式的行 */
+    if (hp_globals.frame_off[HP_FRAME_PATTERN]) {
+        hp_frame_pattern *pattern = HP_FRAME_PART(current, HP_FRAME_PATTERN, hp_frame_pattern);
+
+        pattern->pattern_index = 0;
+        if (UNEXPECTED(current->func_hash_index >= hp_globals.track_list->func_num)) {
+            pattern->pattern_index = hp_globals.detail_parent[current->func_hash_index - hp_globals.track_list->func_num];
+            pattern->prlvl_hprof = (int)HP_STATS(pattern->pattern_index, HP_STATS_ACTIVE)++;
+        }
+    }
+
+    /* Get start tsc counter */
+    current->tsc_start = hp_clock_read();
+
+    /* Get CPU usage */
+    if (hp_globals.xhprof_flags & XHPROF_FLAGS_CPU) {
+        *HP_FRAME_PART(current, HP_FRAME_CPU, uint64) = hp_cpu_time_read();
+    }
+
+    /* Get memory usage */
+    if (hp_globals.xhprof_flags & XHPROF_FLAGS_MEMORY) {
+        hp_frame_memory *mem = HP_FRAME_PART(current, HP_FRAME_MEMORY, hp_frame_memory);
+        mem->mu_start_hprof  = zend_memory_usage(0 TSRMLS_CC);
+        mem->pmu_start_hprof = zend_memory_peak_usage(0 TSRMLS_CC);
+    }
+
+    /* Get hardware counters */
+    if (hp_globals.frame_off[HP_FRAME_PERF]) {
+        uint64 *perf_start = HP_FRAME_PART(current, HP_FRAME_PERF, uint64);
+        int i;
+        for (i = 0; i < HP_PERF_COUNTER_NUM; i++) {
+            perf_start[i] = hp_perf_read_count(&hp_globals.perf_counters[i]);
+        }
+    }
+}
+
+/**
+ * **********************************
+ * XHPROF END FUNCTION CALLBACKS
+ * **********************************
+ */
+
+
+/**
+ * Add one call to the parent==>child edge. Linear probing in a fixed size
+ * table; once it is 3/4 full, calls on edges not yet in it are dropped
+ * (and counted) instead of growing it.
+ */
+static zend_always_inline void hp_edge_record(uint32 parent, uint32 child, zend_long wt) {
+    uint64 key = HP_EDGE_KEY(parent, child);
+    uint32 slot = (uint32)((key * 0x9E3779B97F4A7C15ULL) >> (64 - HP_EDGE_TABLE_BITS));
+    hp_edge *edge;
+
+    for (;;) {
+        edge = &hp_globals.edges[slot];
+        if (EXPECTED(edge->key == key)) {
+            break;
+        }
+        if (!edge->key) {
+            if (hp_globals.edges_used >= HP_EDGE_TABLE_MAX) {
+                hp_globals.edges_dropped++;
+                return;
+            }
+            edge->key = key;
+            hp_globals.edges_used++;
+            break;
+        }
+        slot = (slot + 1) & (HP_EDGE_TABLE_SIZE - 1);
+    }
+
+    edge->ct++;
+    edge->wt += wt;
+}
+
+/**
+ * end function callback
+ *
+ * @author kannan
+ */
+void hp_mode_hier_endfn_cb(hp_entry_t *top, hp_entry_t *parent  TSRMLS_DC) {
+    hp_frame_pattern *pattern = NULL;
+    long int         mu_end;
+    long int         pmu_end;
+
+    if (!top->func_hash_index) {
+        return;
+    }
+
+    uint64   tsc_end;
+    uint64   ticks;
+    uint64   cpu = 0;
+    double   wt;
+    zend_long before[HP_STATS_KEY_NUM];
+
+    if (hp_globals.frame_off[HP_FRAME_PATTERN]) {
+        pattern = HP_FRAME_PART(top, HP_FRAME_PATTERN, hp_frame_pattern);
+        if (EXPECTED(!pattern->pattern_index)) {
+            pattern = NULL;
+        }
+    }
+
+    if (UNEXPECTED(pattern)) {
+        memcpy(before, &HP_STATS(top->func_hash_index, 0), sizeof(before));
+    }
+
+    /* Get end tsc counter */
+    tsc_end = hp_clock_read();
+    ticks = tsc_end - top->tsc_start;
+
+    HP_STATS(top->func_hash_index, HP_STATS_ACTIVE)--;
+
+    //ct 调用次数计数
+    HP_STATS(top->func_hash_index, HP_STATS_COUNT_CT)++;
+
+    //wt 函数耗时计数, 递归时内层的耗时已经包含在最外层里
+    wt = hp_clock_to_us(ticks);
+    if (top->rlvl_hprof == 0) {
+        HP_STATS(top->func_hash_index, HP_STATS_COUNT_WT) += wt;
+    }
+
+    if (hp_globals.xhprof_flags & XHPROF_FLAGS_HISTOGRAM) {
+        hp_hist **hist = &hp_globals.hists[top->func_hash_index];
+
+        if (UNEXPECTED(!*hist)) {
+            *hist = (hp_hist *)ecalloc(1, sizeof(hp_hist));
+        }
+        hp_hist_record(*hist, (uint64_t)(wt * 1000));
+    }
+
+
+    if (hp_globals.xhprof_flags & XHPROF_FLAGS_CPU) {
+        /* Bump CPU stats in the counts hashtable */
+        cpu = hp_cpu_time_read() - *HP_FRAME_PART(top, HP_FRAME_CPU, uint64);
+        if (top->rlvl_hprof == 0) {
+            HP_STATS(top->func_hash_index, HP_STATS_COUNT_CPU) += cpu / 1000;
+        }
+    }
+
+    if (hp_globals.xhprof_flags & XHPROF_FLAGS_EDGES) {
+        hp_edge_record(parent ? parent->func_hash_index : 0, top->func_hash_index, (zend_long)wt);
+    }
+
+    /* 自身耗时 = 总耗时 - 被抓取的子函数的耗时, 各层互不重叠, 递归时每层都累加 */
+    if (hp_globals.xhprof_flags & XHPROF_FLAGS_EXCLUSIVE) {
+        hp_frame_exclusive *excl = HP_FRAME_PART(top, HP_FRAME_EXCLUSIVE, hp_frame_exclusive);
+
+        HP_STATS(top->func_hash_index, HP_STATS_COUNT_EWT) += hp_clock_to_us(ticks - excl->child_ticks);
+        if (hp_globals.xhprof_flags & XHPROF_FLAGS_CPU) {
+            HP_STATS(top->func_hash_index, HP_STATS_COUNT_ECPU) += (cpu - excl->child_cpu) / 1000;
+        }
+
+        if (parent) {
+            excl = HP_FRAME_PART(parent, HP_FRAME_EXCLUSIVE, hp_frame_exclusive);
+            excl->child_ticks += ticks;
+            excl->child_cpu += cpu;
+        }
+    }
+
+    if (hp_globals.xhprof_flags & XHPROF_FLAGS_MEMORY) {
+        /* Get Memory usage */
+        mu_end  = zend_memory_usage(0 TSRMLS_CC);
+        pmu_end = zend_memory_peak_usage(0 TSRMLS_CC);
+
+        /* Bump Memory stats in the counts hashtable */
+        hp_frame_memory *mem = HP_FRAME_PART(top, HP_FRAME_MEMORY, hp_frame_memory);
+        HP_STATS(top->func_hash_index, HP_STATS_COUNT_MU) += mu_end - mem->mu_start_hprof;
+        HP_STATS(top->func_hash_index, HP_STATS_COUNT_PMU) += pmu_end - mem->pmu_start_hprof;
+    }
+
+    if (hp_globals.frame_off[HP_FRAME_PERF]) {
+        uint64 *perf_start = HP_FRAME_PART(top, HP_FRAME_PERF, uint64);
+        int i;
+        for (i = 0; i < HP_PERF_COUNTER_NUM; i++) {
+            HP_STATS(top->func_hash_index, HP_STATS_COUNT_INSTRUCTIONS + i) +=
+                hp_perf_read_count(&hp_globals.perf_counters[i]) - perf_start[i];
+        }
+    }
+
+    /* 这次调用给具体函数的行加了多少, 模式的行也加多少; 模式在栈上不是最外层时不加耗时 */
+    if (UNEXPECTED(pattern)) {
+        const zend_long *row = &HP_STATS(top->func_hash_index, 0);
+        int key;
+
+        HP_STATS(pattern->pattern_index, HP_STATS_ACTIVE)--;
+
+        for (key = HP_STATS_COUNT_CT; key < HP_STATS_KEY_NUM; key++) {
+            if (pattern->prlvl_hprof && (key == HP_STATS_COUNT_WT || key == HP_STATS_COUNT_CPU)) {
+                continue;
+            }
+            HP_STATS(pattern->pattern_index, key) += row[key] - before[key];
+        }
+
+        if (hp_globals.xhprof_flags & XHPROF_FLAGS_HISTOGRAM) {
+            hp_hist **hist = &hp_globals.hists[pattern->pattern_index];
+
+            if (UNEXPECTED(!*hist)) {
+                *hist = (hp_hist *)ecalloc(1, sizeof(hp_hist));
+            }
+            hp_hist_record(*hist, (uint64_t)(wt * 1000));
+        }
+    }
+}
+
+/**
+ * ***************************
+ * PHP EXECUTE/COMPILE PROXIES
+ * ***************************
+ */
+
+/**
+ * XHProf enable replaced the zend_execute function with this
+ * new execute function. We can do whatever profiling we need to
+ * before and after calling the actual zend_execute().
+ *
+ * @author hzhao, kannan
+ */
+ZEND_DLEXPORT void hp_execute_ex (zend_execute_data *execute_data TSRMLS_DC) {
+    if (UNEXPECTED(hp_globals.sample_pending)) {
+        hp_sample_collect(execute_data);
+    }
+
+    if (!hp_globals.enabled) {
+        _zend_execute_ex(execute_data TSRMLS_CC);
+        return;
+    }
+
+    zend_long func_hash_index = 0;
+    uint32 depth = hp_globals.frame_depth;
+
+    BEGIN_PROFILING(func_hash_index, execute_data);
+
+    _zend_execute_ex(execute_data TSRMLS_CC);
+
+    /* 函数里调用过 xhprof_disable() 时, 它的帧已经在 hp_stop() 里清掉了;
+     * 之后再 xhprof_enable() 压入的帧都已返回, 栈不会回到 depth + 1 */
+    if (func_hash_index && hp_globals.frame_depth == depth + 1) {
+        END_PROFILING(func_hash_index);
+    }
+
+}
+
+#undef EX
+#define EX(element) ((execute_data)->element)
+
+/**
+ * Very similar to hp_execute. Proxy for zend_execute_internal().
+ * Applies to zend builtin functions.
+ *
+ * @author hzhao, kannan
+ */
+
+ZEND_DLEXPORT void hp_execute_internal(zend_execute_data *execute_data, zval *return_value) {
+
+    if (UNEXPECTED(hp_globals.sample_pending)) {
+        hp_sample_collect(execute_data);
+    }
+
+    if (!hp_globals.enabled) {
+        execute_internal(execute_data, return_value);
+        return;
+    }
+
+    int  func_hash_index = 1;
+    uint32 depth = hp_globals.frame_depth;
+
+    BEGIN_PROFILING(func_hash_index, execute_data);
+
+    //执行真正的函数调用
+    if (_zend_execute_internal) {
+        _zend_execute_internal(execute_data, return_value);
+        
+    } else {
+        execute_internal(execute_data, return_value);
+    }
+
+    if (func_hash_index && hp_globals.frame_depth == depth + 1) {
+        END_PROFILING(func_hash_index);
+    }
+
+}
+
+
+#if PHP_VERSION_ID >= 70100
+/**
+ * Called by the VM when EG(vm_interrupt) is set, which the sampling signal
+ * handler does, so long loops without calls are sampled too.
+ */
+static void hp_interrupt_function(zend_execute_data *execute_data) {
+    if (hp_globals.sample_pending) {
+        hp_sample_collect(execute_data);
+    }
+
+    if (_zend_interrupt_function) {
+        _zend_interrupt_function(execute_data);
+    }
+}
+#endif
+
+#ifdef HP_HAVE_OBSERVER
+/**
+ * Observer begin handler, the counterpart of hp_execute_ex() before the
+ * call. Only functions that hp_observer_fcall_init() let through get here;
+ * whether this call is tracked still goes through the per-function cache,
+ * so the answer follows the list of the current xhprof_enable().
+ */
+static void hp_observer_begin(zend_execute_data *execute_data) {
+    zend_long func_hash_index;
+
+    if (UNEXPECTED(hp_globals.sample_pending)) {
+        hp_sample_collect(execute_data);
+    }
+
+    if (!hp_globals.enabled) {
+        return;
+    }
+
+    BEGIN_PROFILING(func_hash_index, execute_data);
+}
+
+/**
+ * Observer end handler, also called while an exception unwinds the frame.
+ * The call was profiled only if its entry is on top of the stack: begin
+ * may have run before xhprof_enable() or found the function untracked.
+ */
+static void hp_observer_end(zend_execute_data *execute_data, zval *return_value) {
+    hp_entry_t *top;
+
+    if (!hp_globals.enabled || !hp_globals.frame_depth) {
+        return;
+    }
+
+    top = HP_FRAME(hp_globals.frame_depth - 1);
+    if (*HP_FRAME_PART(top, HP_FRAME_EXECUTE_DATA, zend_execute_data *) == execute_data) {
+        zend_long func_hash_index = top->func_hash_index;
+        END_PROFILING(func_hash_index);
+    }
+}
+
+/**
+ * Called by the engine on the first call of each function in a request;
+ * the answer is kept for the rest of the request. A function gets the
+ * handlers only if it is in the INI track list, or if profiling or
+ * sampling is already on, so a request that does neither runs untracked
+ * functions with no handler at all. The price: a function first called
+ * before xhprof_enable() and missing from the INI list is not tracked by
+ * a per-request list for the rest of that request.
+ */
+static zend_observer_fcall_handlers hp_observer_fcall_init(zend_execute_data *execute_data) {
+    zend_observer_fcall_handlers handlers = {NULL, NULL};
+    zend_function *func = execute_data->func;
+
+    if (!func || !func->common.function_name) {
+        return handlers;
+    }
+
+    if (hp_globals.enabled || hp_globals.sample_enabled
+            || (hp_shared.ini_track_list
+                && hp_track_list_lookup(hp_shared.ini_track_list, func, XHPROF_ALGORITHM_TRIE))) {
+        handlers.begin = hp_observer_begin;
+        handlers.end = hp_observer_end;
     }
-    restore_cpu_affinity(&hp_globals.prev_mask);
+    return handlers;
 }
+#endif
+
+/**
+ * **************************
+ * SHARED MEMORY AGGREGATION
+ * **************************
+ */
+
+/**
+ * Map the slabs, before the SAPI forks its workers so that they all share
+ * the same pages. Needs the INI track list, the only one with stable rows.
+ */
+static void hp_shm_init() {
+    zend_long slab_num = INI_INT("xhprof.shm_slabs");
+    void *shm;
+
+    hp_shared.shm = NULL;
+    hp_shared.shm_slab_num = 0;
+    hp_globals.shm_slab = NULL;
+    hp_globals.shm_pid = 0;
+
+    if (slab_num <= 0 || !hp_shared.ini_track_list) {
+        return;
+    }
 
+    hp_shared.shm_slab_size = HP_SHM_SLAB_HEADER
+        + (size_t)hp_shared.ini_track_list->func_num * HP_STATS_ROW_LEN * sizeof(zend_long);
+    hp_shared.shm_size = hp_shared.shm_slab_size * (size_t)slab_num;
+
+    //匿名映射已经是清零的
+    shm = mmap(NULL, hp_shared.shm_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shm == MAP_FAILED) {
+        zend_error(E_CORE_WARNING, "xhprof: cannot map %zu bytes for xhprof.shm_slabs: %s",
+                hp_shared.shm_size, strerror(errno));
+        return;
+    }
+
+    hp_shared.shm = shm;
+    hp_shared.shm_slab_num = (uint32)slab_num;
+}
+
+static zend_always_inline hp_shm_slab *hp_shm_slab_at(uint32 i) {
+    return (hp_shm_slab *)((char *)hp_shared.shm + hp_shared.shm_slab_size * i);
+}
+
+/**
+ * This worker's slab. A slab is claimed by swapping the worker's pid into
+ * an empty owner or one whose process is gone (its counts are kept, they
+ * are totals). When every slab is taken, workers share one by pid; the
+ * atomic adds in hp_shm_fold() keep that correct.
+ */
+static zend_long *hp_shm_claim() {
+    pid_t pid = getpid();
+    hp_shm_slab *slab;
+    uint32 i;
+
+    if (hp_globals.shm_pid == pid) {
+        return hp_globals.shm_slab;
+    }
+
+    slab = NULL;
+    for (i = 0; i < hp_shared.shm_slab_num && !slab; i++) {
+        hp_shm_slab *cur = hp_shm_slab_at(i);
+        pid_t owner = cur->owner;
+
+        if (owner == pid) {
+            slab = cur;
+        } else if ((owner == 0 || (kill(owner, 0) == -1 && errno == ESRCH))
+                && __sync_bool_compare_and_swap(&cur->owner, owner, pid)) {
+            slab = cur;
+        }
+    }
+
+    if (!slab) {
+        slab = hp_shm_slab_at((uint32)pid % hp_shared.shm_slab_num);
+    }
+
+    hp_globals.shm_pid = pid;
+    hp_globals.shm_slab = (zend_long *)((char *)slab + HP_SHM_SLAB_HEADER);
+
+    return hp_globals.shm_slab;
+}
+
+/**
+ * Add this request's counters to the worker's slab. Runs once per request
+ * and only touches rows of functions that were called.
+ */
+static void hp_shm_fold() {
+    zend_long *slab = hp_shm_claim();
+    uint32 i, key;
+
+    //XHPROF_FLAGS_PATTERN_DETAIL 追加的行不合并
+    for (i = 1; i < hp_shared.ini_track_list->func_num; i++) {
+        const zend_long *row = &HP_STATS(i, 0);
+        zend_long *dst = slab + (size_t)i * HP_STATS_ROW_LEN;
+
+        if (!row[HP_STATS_COUNT_CT]) {
+            continue;
+        }
+
+        for (key = HP_STATS_COUNT_CT; key < HP_STATS_KEY_NUM; key++) {
+            if (row[key]) {
+                __atomic_fetch_add(&dst[key], row[key], __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    __atomic_fetch_add(&((hp_shm_slab *)((char *)slab - HP_SHM_SLAB_HEADER))->requests, 1, __ATOMIC_RELAXED);
+}
 
 /**
- * ***************************
- * XHPROF DUMMY CALLBACKS
- * ***************************
+ * Sum all slabs into an array shaped like the xhprof_disable() result.
+ * Counters that are zero everywhere (metrics never collected) are left out.
  */
-void hp_mode_dummy_init_cb(TSRMLS_D) { }
+static void hp_shm_export(zval *result) {
+    hp_track_list *list = hp_shared.ini_track_list;
+    zend_long sum[HP_STATS_KEY_NUM];
+    uint32 i, slab, key;
 
+    array_init(result);
 
-void hp_mode_dummy_exit_cb(TSRMLS_D) { }
+    for (i = 1; i < list->func_num; i++) {
+        zval metrics, value;
 
+        memset(sum, 0, sizeof(sum));
+        for (slab = 0; slab < hp_shared.shm_slab_num; slab++) {
+            const zend_long *row = (const zend_long *)((char *)hp_shm_slab_at(slab) + HP_SHM_SLAB_HEADER)
+                + (size_t)i * HP_STATS_ROW_LEN;
 
-void hp_mode_dummy_beginfn_cb(hp_entry_t **entries, hp_entry_t *current  TSRMLS_DC) { }
+            for (key = HP_STATS_COUNT_CT; key < HP_STATS_KEY_NUM; key++) {
+                sum[key] += __atomic_load_n(&row[key], __ATOMIC_RELAXED);
+            }
+        }
 
-void hp_mode_dummy_endfn_cb(hp_entry_t **entries   TSRMLS_DC) { }
+        if (!sum[HP_STATS_COUNT_CT]) {
+            continue;
+        }
 
+        array_init(&metrics);
+        for (key = HP_STATS_COUNT_CT; key < HP_STATS_KEY_NUM; key++) {
+            if (sum[key] || key == HP_STATS_COUNT_WT) {
+                ZVAL_LONG(&value, sum[key]);
+                zend_hash_add_new(Z_ARRVAL(metrics), hp_stats_key_names[key], &value);
+            }
+        }
+        zend_hash_add_new(Z_ARRVAL_P(result), list->names[i], &metrics);
+    }
+}
 
 /**
- * ****************************
- * XHPROF COMMON CALLBACKS
- * ****************************
+ * **************************
+ * SAMPLING PROFILER
+ * **************************
  */
 
+#ifdef HP_HAVE_SAMPLE
 /**
- * begin function callback
- *
- * @author kannan
+ * Timer signal handler. Async-signal-safe: only bumps a counter and asks
+ * the VM to interrupt, the stack is walked later by hp_sample_collect().
  */
-void hp_mode_hier_beginfn_cb(hp_entry_t **entries, hp_entry_t  *current  TSRMLS_DC) {
+static void hp_sample_signal_handler(int signo) {
+    hp_globals.sample_pending++;
+#if PHP_VERSION_ID >= 80200
+    /* 8.2 起是 zend_atomic_bool */
+    zend_atomic_bool_store_ex(&EG(vm_interrupt), true);
+#elif PHP_VERSION_ID >= 70100
+    EG(vm_interrupt) = 1;
+#endif
+}
+#endif
 
-    /* Get start tsc counter */
-    current->tsc_start = cycle_timer();
+/**
+ * Arm a timer firing every interval_us of this thread's CPU time. The ring
+ * buffer is allocated here, once per process, so taking a sample never
+ * allocates except for the first sighting of a function.
+ */
+static int hp_sample_start(zend_long interval_us) {
+#ifdef HP_HAVE_SAMPLE
+    struct sigaction sa;
+    struct sigevent sev;
+    struct itimerspec its;
+    zend_long ring_size;
+
+    if (hp_globals.sample_enabled) {
+        return SUCCESS;
+    }
 
-    /* Get CPU usage */
-    if (hp_globals.xhprof_flags & XHPROF_FLAGS_CPU) {
-        getrusage(RUSAGE_SELF, &(current->ru_start_hprof));
+    ring_size = INI_INT("xhprof.sample_buffer_size");
+    if (ring_size <= 0) {
+        ring_size = 1;
     }
 
-    /* Get memory usage */
-    if (hp_globals.xhprof_flags & XHPROF_FLAGS_MEMORY) {
-        current->mu_start_hprof  = zend_memory_usage(0 TSRMLS_CC);
-        current->pmu_start_hprof = zend_memory_peak_usage(0 TSRMLS_CC);
+    if (hp_globals.sample_ring && hp_globals.sample_ring_size != (uint32)ring_size) {
+        pefree(hp_globals.sample_ring, 1);
+        hp_globals.sample_ring = NULL;
+    }
+    if (!hp_globals.sample_ring) {
+        hp_globals.sample_ring = (uint32 *)safe_pemalloc((size_t)ring_size,
+                HP_SAMPLE_RECORD_LEN * sizeof(uint32), 0, 1);
+        hp_globals.sample_ring_size = (uint32)ring_size;
     }
+    hp_globals.sample_head = 0;
+    hp_globals.sample_num = 0;
+    hp_globals.sample_dropped = 0;
+
+    zend_hash_init(&hp_globals.sample_frame_ids, 64, NULL, NULL, 0);
+    hp_globals.sample_frame_num = 1;    //0 号不用
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = hp_sample_signal_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(HP_SAMPLE_SIGNAL, &sa, &hp_globals.sample_prev_action) != 0) {
+        php_error_docref(NULL, E_WARNING, "xhprof: sigaction() failed: %s", strerror(errno));
+        hp_sample_reset();
+        return FAILURE;
+    }
+
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_signo = HP_SAMPLE_SIGNAL;
+#ifdef SIGEV_THREAD_ID
+    //信号只发给当前线程
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+#else
+    sev.sigev_notify = SIGEV_SIGNAL;
+#endif
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &hp_globals.sample_timer) != 0) {
+        php_error_docref(NULL, E_WARNING, "xhprof: timer_create() failed: %s", strerror(errno));
+        sigaction(HP_SAMPLE_SIGNAL, &hp_globals.sample_prev_action, NULL);
+        hp_sample_reset();
+        return FAILURE;
+    }
+
+    its.it_interval.tv_sec = interval_us / 1000000;
+    its.it_interval.tv_nsec = (interval_us % 1000000) * 1000;
+    its.it_value = its.it_interval;
+
+    hp_globals.sample_pending = 0;
+    hp_globals.sample_enabled = 1;
+    hp_hooks_update();
+    timer_settime(hp_globals.sample_timer, 0, &its, NULL);
+
+    return SUCCESS;
+#else
+    php_error_docref(NULL, E_WARNING, "xhprof: sampling is not supported on this platform");
+    return FAILURE;
+#endif
 }
 
 /**
- * **********************************
- * XHPROF END FUNCTION CALLBACKS
- * **********************************
+ * Disarm the timer. The samples stay in the ring until hp_sample_reset().
  */
+static void hp_sample_stop() {
+#ifdef HP_HAVE_SAMPLE
+    if (!hp_globals.sample_enabled) {
+        return;
+    }
+
+    timer_delete(hp_globals.sample_timer);
+    sigaction(HP_SAMPLE_SIGNAL, &hp_globals.sample_prev_action, NULL);
+#endif
 
+    hp_globals.sample_enabled = 0;
+    hp_globals.sample_pending = 0;
+    hp_hooks_update();
+}
 
 /**
- * end function callback
- *
- * @author kannan
+ * Forget the samples and the frame table of this request. The ring buffer
+ * itself is kept for the next xhprof_sample_enable().
  */
-void hp_mode_hier_endfn_cb(hp_entry_t **entries  TSRMLS_DC) {
-    hp_entry_t   *top = (*entries);
-    struct rusage    ru_end;
-    long int         mu_end;
-    long int         pmu_end;
+static void hp_sample_reset() {
+    uint32 i;
 
-    if (!top->func_hash_index) {
+    if (!hp_globals.sample_frame_num) {
         return;
     }
 
-    uint64   tsc_end;
-
-    /* Get end tsc counter */
-    tsc_end = cycle_timer();
+    for (i = 1; i < hp_globals.sample_frame_num; i++) {
+        zend_string_release(hp_globals.sample_frames[i].name);
+    }
+    if (hp_globals.sample_frames) {
+        efree(hp_globals.sample_frames);
+    }
+    zend_hash_destroy(&hp_globals.sample_frame_ids);
 
-    //ct 调用次数计数
-    hp_globals.stats_count[top->func_hash_index][HP_STATS_COUNT_CT]++;
+    hp_globals.sample_frames = NULL;
+    hp_globals.sample_frame_num = 0;
+    hp_globals.sample_frame_size = 0;
+    hp_globals.sample_num = 0;
+    hp_globals.sample_head = 0;
+}
 
-    //wt 函数耗时计数
-    hp_globals.stats_count[top->func_hash_index][HP_STATS_COUNT_WT] += get_us_from_tsc(tsc_end - top->tsc_start,
-                                            hp_globals.cpu_frequencies[hp_globals.cur_cpu_id]); 
+/**
+ * Frame id of func, added to the frame table the first time it is seen.
+ */
+static uint32 hp_sample_frame_id(zend_function *func) {
+    hp_sample_frame *frame;
+    zend_string *name;
+    zval *id, zid;
+
+    id = zend_hash_index_find(&hp_globals.sample_frame_ids, (zend_ulong)(uintptr_t)func >> 3);
+    if (id) {
+        frame = &hp_globals.sample_frames[Z_LVAL_P(id)];
+        //地址被别的函数复用 (closure, eval) 时重新分配 id
+        if (EXPECTED(frame->func == func
+                    && frame->function_name == func->common.function_name
+                    && frame->scope == func->common.scope)) {
+            return (uint32)Z_LVAL_P(id);
+        }
+    }
 
+    if (hp_globals.sample_frame_num == hp_globals.sample_frame_size) {
+        hp_globals.sample_frame_size = hp_globals.sample_frame_size ? hp_globals.sample_frame_size * 2 : 64;
+        hp_globals.sample_frames = (hp_sample_frame *)safe_erealloc(hp_globals.sample_frames,
+                hp_globals.sample_frame_size, sizeof(hp_sample_frame), 0);
+    }
 
-    if (hp_globals.xhprof_flags & XHPROF_FLAGS_CPU) {
-        /* Get CPU usage */
-        getrusage(RUSAGE_SELF, &ru_end);
+    if (func->common.scope && func->common.scope->name) {
+        zend_string *class_name = func->common.scope->name;
 
-        /* Bump CPU stats in the counts hashtable */
-        hp_globals.stats_count[top->func_hash_index][HP_STATS_COUNT_CPU] += (get_us_interval(&(top->ru_start_hprof.ru_utime),
-                        &(ru_end.ru_utime)) +
-                    get_us_interval(&(top->ru_start_hprof.ru_stime),
-                        &(ru_end.ru_stime)));
+        name = zend_string_alloc(ZSTR_LEN(class_name) + 1 + ZSTR_LEN(func->common.function_name), 0);
+        memcpy(ZSTR_VAL(name), ZSTR_VAL(class_name), ZSTR_LEN(class_name));
+        ZSTR_VAL(name)[ZSTR_LEN(class_name)] = CLASS_FUNC_SPLIT_CHAR;
+        memcpy(ZSTR_VAL(name) + ZSTR_LEN(class_name) + 1, ZSTR_VAL(func->common.function_name),
+                ZSTR_LEN(func->common.function_name) + 1);
+    } else {
+        name = zend_string_copy(func->common.function_name);
     }
 
-    if (hp_globals.xhprof_flags & XHPROF_FLAGS_MEMORY) {
-        /* Get Memory usage */
-        mu_end  = zend_memory_usage(0 TSRMLS_CC);
-        pmu_end = zend_memory_peak_usage(0 TSRMLS_CC);
+    frame = &hp_globals.sample_frames[hp_globals.sample_frame_num];
+    frame->func = func;
+    frame->function_name = func->common.function_name;
+    frame->scope = func->common.scope;
+    frame->name = name;
 
-        /* Bump Memory stats in the counts hashtable */
-        hp_globals.stats_count[top->func_hash_index][HP_STATS_COUNT_MU] += mu_end - top->mu_start_hprof;
-        hp_globals.stats_count[top->func_hash_index][HP_STATS_COUNT_PMU] += pmu_end - top->pmu_start_hprof;
-    }
-}
+    ZVAL_LONG(&zid, hp_globals.sample_frame_num);
+    zend_hash_index_update(&hp_globals.sample_frame_ids, (zend_ulong)(uintptr_t)func >> 3, &zid);
 
-/**
- * ***************************
- * PHP EXECUTE/COMPILE PROXIES
- * ***************************
- */
+    return hp_globals.sample_frame_num++;
+}
 
 /**
- * XHProf enable replaced the zend_execute function with this
- * new execute function. We can do whatever profiling we need to
- * before and after calling the actual zend_execute().
- *
- * @author hzhao, kannan
+ * Record the stack starting at execute_data into the ring, weighted by the
+ * number of timer ticks since the last sample. Frames without a function
+ * name (the main script, include files) are skipped.
  */
-ZEND_DLEXPORT void hp_execute_ex (zend_execute_data *execute_data TSRMLS_DC) {
-    if (!hp_globals.enabled) {
-        _zend_execute_ex(execute_data TSRMLS_CC);
+static void hp_sample_collect(zend_execute_data *execute_data) {
+    uint32 *record;
+    uint32 depth = 0;
+    sig_atomic_t weight;
+
+    //和信号处理函数之间没有锁, 用原子交换取走计数
+    weight = __sync_lock_test_and_set(&hp_globals.sample_pending, 0);
+    if (!weight || !hp_globals.sample_enabled) {
         return;
     }
 
-    zend_long func_hash_index = 0;
+    if (hp_globals.sample_num == hp_globals.sample_ring_size) {
+        hp_globals.sample_dropped++;
+    } else {
+        hp_globals.sample_num++;
+    }
 
-    BEGIN_PROFILING(&hp_globals.entries, func_hash_index);
+    record = hp_globals.sample_ring + (size_t)hp_globals.sample_head * HP_SAMPLE_RECORD_LEN;
+    if (++hp_globals.sample_head == hp_globals.sample_ring_size) {
+        hp_globals.sample_head = 0;
+    }
 
-    _zend_execute_ex(execute_data TSRMLS_CC);
+    for (; execute_data; execute_data = execute_data->prev_execute_data) {
+        zend_function *func = execute_data->func;
 
-    if (func_hash_index) {
-        END_PROFILING(&hp_globals.entries, func_hash_index);
+        if (!func || !func->common.function_name) {
+            continue;
+        }
+
+        if (depth == HP_SAMPLE_MAX_DEPTH) {
+            depth |= HP_SAMPLE_TRUNCATED;
+            break;
+        }
+        record[2 + depth++] = hp_sample_frame_id(func);
     }
 
+    record[0] = (uint32)weight;
+    record[1] = depth;
 }
 
-#undef EX
-#define EX(element) ((execute_data)->element)
-
 /**
- * Very similar to hp_execute. Proxy for zend_execute_internal().
- * Applies to zend builtin functions.
- *
- * @author hzhao, kannan
+ * Fold the ring into an array of "main()==>a==>b" => ticks, oldest first.
  */
+static void hp_sample_export(zval *result) {
+    smart_str stack = {0};
+    uint32 i, n, slot;
 
-ZEND_DLEXPORT void hp_execute_internal(zend_execute_data *execute_data, zval *return_value) {
+    array_init(result);
 
-    if (!hp_globals.enabled) {
-        execute_internal(execute_data, return_value);
-        return;
-    }
+    slot = (hp_globals.sample_head + hp_globals.sample_ring_size - hp_globals.sample_num) % hp_globals.sample_ring_size;
 
-    int  func_hash_index = 1;
+    for (n = 0; n < hp_globals.sample_num; n++) {
+        const uint32 *record = hp_globals.sample_ring + (size_t)slot * HP_SAMPLE_RECORD_LEN;
+        uint32 depth = record[1] & ~HP_SAMPLE_TRUNCATED;
+        zval *count, zcount;
 
-    BEGIN_PROFILING(&hp_globals.entries, func_hash_index);
+        //截断的栈没有最外层, 用 ... 代替 main()
+        if (record[1] & HP_SAMPLE_TRUNCATED) {
+            smart_str_appendl(&stack, "...", sizeof("...") - 1);
+        } else {
+            smart_str_appendl(&stack, "main()", sizeof("main()") - 1);
+        }
 
-    //执行真正的函数调用
-    if (_zend_execute_internal) {
-        _zend_execute_internal(execute_data, return_value);
-        
-    } else {
-        execute_internal(execute_data, return_value);
-    }
+        for (i = depth; i > 0; i--) {
+            smart_str_appendl(&stack, "==>", sizeof("==>") - 1);
+            smart_str_append(&stack, hp_globals.sample_frames[record[1 + i]].name);
+        }
+        smart_str_0(&stack);
+
+        //stack 的缓冲区会被下一个样本复用, 用 str 接口让 key 被复制
+        count = zend_hash_str_find(Z_ARRVAL_P(result), ZSTR_VAL(stack.s), ZSTR_LEN(stack.s));
+        if (count) {
+            Z_LVAL_P(count) += record[0];
+        } else {
+            ZVAL_LONG(&zcount, record[0]);
+            zend_hash_str_add(Z_ARRVAL_P(result), ZSTR_VAL(stack.s), ZSTR_LEN(stack.s), &zcount);
+        }
+        ZSTR_LEN(stack.s) = 0;
 
-    if (func_hash_index) {
-        END_PROFILING(&hp_globals.entries, func_hash_index);
+        if (++slot == hp_globals.sample_ring_size) {
+            slot = 0;
+        }
     }
 
+    smart_str_free(&stack);
 }
 
-
 /**
  * **************************
  * MAIN XHPROF CALLBACKS
@@ -1235,17 +3789,15 @@ ZEND_DLEXPORT void hp_execute_internal(zend_execute_data *execute_data, zval *re
  */
 
 /**
- * This function gets called once when xhprof gets enabled.
- * It replaces all the functions like zend_execute, zend_execute_internal,
- * etc that needs to be instrumented with their corresponding proxies.
+ * This function gets called once when xhprof gets enabled. The proxies
+ * are already installed since MINIT; setting hp_globals.enabled is what
+ * makes them record.
  */
 static void hp_begin(TSRMLS_DC) {
     if (hp_globals.enabled) {
         return;
     }
 
-    zend_long func_hash_index = 0;
-
     hp_globals.enabled      = 1;
 
     /* Initialize with the dummy mode first Having these dummy callbacks saves
@@ -1260,6 +3812,9 @@ static void hp_begin(TSRMLS_DC) {
 
     /* one time initializations */
     hp_init_profiler_state();
+
+    /* 计数器打开之后才知道帧里要不要留 perf 的位置 */
+    hp_frames_layout();
 }
 
 /**
@@ -1282,28 +3837,141 @@ static void hp_end(TSRMLS_D) {
 
 /**
  * Called from xhprof_disable(). Removes all the proxies setup by
- * hp_stop() and restores the original values.
+ * hp_begin() and restores the original values.
  */
 static void hp_stop(TSRMLS_D) {
 
     /* End any unfinished calls */
-    while (hp_globals.entries) {
-        END_PROFILING(&hp_globals.entries, NULL);
+    hp_globals.frame_depth = 0;
+
+    /* 只有 INI 函数列表的行号和共享内存一致 */
+    if (hp_shared.shm && hp_globals.track_list == hp_shared.ini_track_list) {
+        hp_shm_fold();
     }
 
-    /* Remove proxies, restore the originals */
-    zend_execute_ex       = _zend_execute_ex;
-    zend_execute_internal = _zend_execute_internal;
-    //zend_compile_file     = _zend_compile_file;
-    //zend_compile_string   = _zend_compile_string;
+#ifdef HP_HAVE_DUMP
+    if (hp_shared.dump) {
+        hp_dump_request();
+    }
+#endif
 
     /* Resore cpu affinity. */
-    restore_cpu_affinity(&hp_globals.prev_mask);
+    if (hp_shared.clock_source == HP_CLOCK_TSC_PINNED) {
+        restore_cpu_affinity(&hp_globals.prev_mask);
+    }
 
-    /* Stop profiling */
+    /* Stop profiling; the proxies stay installed and pass calls through */
     hp_globals.enabled = 0;
 }
 
+/**
+ * Install the hooks that are only needed while sampling and take them out
+ * once it stops. The execute proxies are not managed here: the call opcodes
+ * are chosen at compile time from zend_execute_ex/zend_execute_internal, so
+ * those stay installed from MINIT to MSHUTDOWN. The hooks are process wide:
+ * under ZTS each one is counted by the threads that need it and removed when
+ * the last of them is done.
+ */
+static void hp_hooks_update() {
+    uint32 want = 0;
+    uint32 change;
+    int i;
+
+#if PHP_VERSION_ID >= 70100
+    //采样的信号处理函数通过 VM 中断记录没有函数调用的循环
+    if (hp_globals.sample_enabled) {
+        want |= HP_HOOK_INTERRUPT;
+    }
+#endif
+
+    change = want ^ hp_globals.hooks;
+    if (!change) {
+        return;
+    }
+
+#ifdef ZTS
+    tsrm_mutex_lock(hp_shared.hooks_mutex);
+#endif
+
+    for (i = 0; i < HP_HOOK_NUM; i++) {
+        uint32 hook = 1u << i;
+
+        if (!(change & hook)) {
+            continue;
+        }
+
+        if (want & hook) {
+            if (hp_shared.hook_refs[i]++ == 0) {
+                hp_hook_install(hook);
+            }
+        } else if (--hp_shared.hook_refs[i] == 0) {
+            hp_hook_remove(hook);
+        }
+    }
+
+#ifdef ZTS
+    tsrm_mutex_unlock(hp_shared.hooks_mutex);
+#endif
+
+    hp_globals.hooks = want;
+}
+
+//已经装上的钩子 (上次没能拆掉的) 不重复安装
+static void hp_hook_install(uint32 hook) {
+    if (hp_shared.hooks & hook) {
+        return;
+    }
+    hp_shared.hooks |= hook;
+
+    switch (hook) {
+        case HP_HOOK_EXECUTE_EX:
+            _zend_execute_ex = zend_execute_ex;
+            zend_execute_ex = hp_execute_ex;
+            break;
+        case HP_HOOK_EXECUTE_INTERNAL:
+            _zend_execute_internal = zend_execute_internal;
+            zend_execute_internal = hp_execute_internal;
+            break;
+#if PHP_VERSION_ID >= 70100
+        case HP_HOOK_INTERRUPT:
+            _zend_interrupt_function = zend_interrupt_function;
+            zend_interrupt_function = hp_interrupt_function;
+            break;
+#endif
+    }
+}
+
+/* 别的扩展在我们之后又替换了同一个钩子时拆不掉, 留着 (不工作时只多一次判断), 下次直接复用 */
+static void hp_hook_remove(uint32 hook) {
+    if (!(hp_shared.hooks & hook)) {
+        return;
+    }
+
+    switch (hook) {
+        case HP_HOOK_EXECUTE_EX:
+            if (zend_execute_ex != hp_execute_ex) {
+                return;
+            }
+            zend_execute_ex = _zend_execute_ex;
+            break;
+        case HP_HOOK_EXECUTE_INTERNAL:
+            if (zend_execute_internal != hp_execute_internal) {
+                return;
+            }
+            zend_execute_internal = _zend_execute_internal;
+            break;
+#if PHP_VERSION_ID >= 70100
+        case HP_HOOK_INTERRUPT:
+            if (zend_interrupt_function != hp_interrupt_function) {
+                return;
+            }
+            zend_interrupt_function = _zend_interrupt_function;
+            break;
+#endif
+    }
+    hp_shared.hooks &= ~hook;
+}
+
 
 /**
  * *****************************
@@ -1326,40 +3994,247 @@ static zval *hp_zval_at_key(char  *key, HashTable  *values) {
     return result;
 }
 
-//malloc 并初始化内存
-static void emalloc_hp_stats_count(uint32_t func_num) {
-    if (func_num < 1) {
-        return;
+//统计结果内存分配并清零, 已分配的内存够用时只清零
+static void hp_stats_count_prepare(uint32_t func_num) {
+    size_t row_size = HP_STATS_ROW_LEN * sizeof(zend_long);
+
+    if (func_num > hp_globals.stats_count_capacity) {
+        hp_stats_count_free(&hp_globals);
+
+        hp_globals.stats_count_raw = pemalloc(row_size * func_num + HP_STATS_ALIGN - 1, 1);
+        hp_globals.stats_count = (zend_long *)(((uintptr_t)hp_globals.stats_count_raw + HP_STATS_ALIGN - 1)
+                & ~(uintptr_t)(HP_STATS_ALIGN - 1));
+        hp_globals.stats_count_capacity = func_num;
     }
 
-    int i = 0;
-    int j = 0;
-    hp_globals.stats_count = (zend_long **)emalloc(sizeof(zend_long *) * func_num);
-    
-    for (i = 0; i < func_num; i++) {
-        hp_globals.stats_count[i] = (zend_long *)emalloc(sizeof(zend_long) * HP_STATS_KEY_NUM);
+    memset(hp_globals.stats_count, 0, row_size * func_num);
+}
+
+//增加行数, 已有的统计保留, 新的行清零
+static void hp_stats_count_grow(uint32_t func_num) {
+    size_t row_size = HP_STATS_ROW_LEN * sizeof(zend_long);
+
+    if (func_num > hp_globals.stats_count_capacity) {
+        uint32_t capacity = hp_globals.stats_count_capacity * 2;
+        void *raw;
+        zend_long *stats;
 
-        for (j = 0; j < HP_STATS_KEY_NUM; j++) {
-            hp_globals.stats_count[i][j] = 0;
+        if (capacity < func_num) {
+            capacity = func_num;
         }
+
+        raw = pemalloc(row_size * capacity + HP_STATS_ALIGN - 1, 1);
+        stats = (zend_long *)(((uintptr_t)raw + HP_STATS_ALIGN - 1) & ~(uintptr_t)(HP_STATS_ALIGN - 1));
+        memcpy(stats, hp_globals.stats_count, row_size * hp_globals.stats_count_func_num);
+
+        pefree(hp_globals.stats_count_raw, 1);
+        hp_globals.stats_count_raw = raw;
+        hp_globals.stats_count = stats;
+        hp_globals.stats_count_capacity = capacity;
     }
 
-    return;
+    memset(&HP_STATS(hp_globals.stats_count_func_num, 0), 0, row_size * (func_num - hp_globals.stats_count_func_num));
+    hp_globals.stats_count_func_num = func_num;
 }
 
 //回收内存
-static void efree_hp_stats_count() {
-    if (!hp_globals.stats_count
-            || !hp_globals.stats_count_func_num) {
+static void hp_stats_count_free(zend_xhprof_globals *globals) {
+    if (!globals->stats_count_raw) {
+        return;
+    }
+
+    pefree(globals->stats_count_raw, 1);
+    globals->stats_count_raw = NULL;
+    globals->stats_count = NULL;
+    globals->stats_count_capacity = 0;
+}
+
+static zend_always_inline void hp_stats_add_metric(HashTable *ht, const zend_long *row, int key) {
+    zval value;
+
+    ZVAL_LONG(&value, row[key]);
+    zend_hash_add_new(ht, hp_stats_key_names[key], &value);
+}
+
+/**
+ * Build the xhprof_disable() result straight from the counter block:
+ *
+ *     [ "Foo:bar" => ["ct" => 2, "wt" => 31, ...], ... ]
+ *
+ * Keys are the strings from the track list (interned for the INI list), so
+ * no string is copied. Functions that were never called are omitted.
+ */
+static void hp_stats_count_export(zval *result) {
+    hp_track_list *list = hp_globals.track_list;
+    uint32_t i, metric_num = 2;
+
+    if (!list || !hp_globals.stats_count) {
+        array_init(result);
         return;
     }
 
-    int i = 0;
-    
-    for (i = 0; i < hp_globals.stats_count_func_num; i++) {
-        efree(hp_globals.stats_count[i]);
+    if (hp_globals.xhprof_flags & XHPROF_FLAGS_CPU) {
+        metric_num++;
+    }
+    if (hp_globals.xhprof_flags & XHPROF_FLAGS_MEMORY) {
+        metric_num += 2;
+    }
+    if (hp_globals.xhprof_flags & XHPROF_FLAGS_EXCLUSIVE) {
+        metric_num += 2;
+    }
+    if ((hp_globals.xhprof_flags & XHPROF_FLAGS_PERF) && hp_globals.perf_counters_num) {
+        metric_num += HP_PERF_COUNTER_NUM;
+    }
+
+    array_init_size(result, list->func_num - 1);
+
+    for (i = 1; i < hp_globals.stats_count_func_num; i++) {
+        const zend_long *row = &HP_STATS(i, 0);
+        zval metrics;
+
+        if (!row[HP_STATS_COUNT_CT]) {
+            continue;
+        }
+
+        array_init_size(&metrics, metric_num);
+        hp_stats_add_metric(Z_ARRVAL(metrics), row, HP_STATS_COUNT_CT);
+        hp_stats_add_metric(Z_ARRVAL(metrics), row, HP_STATS_COUNT_WT);
+
+        if (hp_globals.xhprof_flags & XHPROF_FLAGS_CPU) {
+            hp_stats_add_metric(Z_ARRVAL(metrics), row, HP_STATS_COUNT_CPU);
+        }
+
+        if (hp_globals.xhprof_flags & XHPROF_FLAGS_EXCLUSIVE) {
+            hp_stats_add_metric(Z_ARRVAL(metrics), row, HP_STATS_COUNT_EWT);
+            if (hp_globals.xhprof_flags & XHPROF_FLAGS_CPU) {
+                hp_stats_add_metric(Z_ARRVAL(metrics), row, HP_STATS_COUNT_ECPU);
+            }
+        }
+
+        if (hp_globals.xhprof_flags & XHPROF_FLAGS_MEMORY) {
+            hp_stats_add_metric(Z_ARRVAL(metrics), row, HP_STATS_COUNT_MU);
+            hp_stats_add_metric(Z_ARRVAL(metrics), row, HP_STATS_COUNT_PMU);
+        }
+
+        if ((hp_globals.xhprof_flags & XHPROF_FLAGS_PERF) && hp_globals.perf_counters_num) {
+            int j;
+            for (j = 0; j < HP_PERF_COUNTER_NUM; j++) {
+                if (hp_globals.perf_counters[j].fd >= 0) {
+                    hp_stats_add_metric(Z_ARRVAL(metrics), row, HP_STATS_COUNT_INSTRUCTIONS + j);
+                }
+            }
+        }
+
+        if ((hp_globals.xhprof_flags & XHPROF_FLAGS_HISTOGRAM) && hp_globals.hists[i]) {
+            hp_hist_export(Z_ARRVAL(metrics), hp_globals.hists[i]);
+        }
+
+        zend_hash_add_new(Z_ARRVAL_P(result), hp_row_name(i), &metrics);
+    }
+
+    if ((hp_globals.xhprof_flags & XHPROF_FLAGS_EDGES) && hp_globals.edges) {
+        hp_edges_export(result);
+    }
+}
+
+/**
+ * Add the wall time distribution of one function to its metrics:
+ *
+ *     "wt_p50", "wt_p90", "wt_p99", "wt_max"  microseconds
+ *     "wt_hist" => [bucket => count, ...]     nanosecond buckets, see hist.h
+ *
+ * Only non-empty buckets are listed. The bucket layout is fixed, so the
+ * raw buckets of many requests can be summed offline.
+ */
+static void hp_hist_export(HashTable *metrics, const hp_hist *hist) {
+    zval value, buckets;
+    uint32 i;
+
+    ZVAL_LONG(&value, (zend_long)(hp_hist_percentile(hist, 0.50) / 1000));
+    zend_hash_str_add(metrics, "wt_p50", sizeof("wt_p50") - 1, &value);
+    ZVAL_LONG(&value, (zend_long)(hp_hist_percentile(hist, 0.90) / 1000));
+    zend_hash_str_add(metrics, "wt_p90", sizeof("wt_p90") - 1, &value);
+    ZVAL_LONG(&value, (zend_long)(hp_hist_percentile(hist, 0.99) / 1000));
+    zend_hash_str_add(metrics, "wt_p99", sizeof("wt_p99") - 1, &value);
+    ZVAL_LONG(&value, (zend_long)(hist->max / 1000));
+    zend_hash_str_add(metrics, "wt_max", sizeof("wt_max") - 1, &value);
+
+    array_init(&buckets);
+    for (i = 0; i < HP_HIST_BUCKETS; i++) {
+        if (hist->counts[i]) {
+            add_index_long(&buckets, i, hist->counts[i]);
+        }
+    }
+    zend_hash_str_add(metrics, "wt_hist", sizeof("wt_hist") - 1, &buckets);
+}
+
+/**
+ * Add the edges to the result next to the functions, keyed like the
+ * original xhprof: "Foo:bar==>baz", "main()==>Foo:bar". Calls dropped
+ * because the table was full are reported under "(dropped edges)".
+ */
+static void hp_edges_export(zval *result) {
+    smart_str key = {0};
+    uint32 i;
+
+    for (i = 0; i < HP_EDGE_TABLE_SIZE; i++) {
+        const hp_edge *edge = &hp_globals.edges[i];
+        uint32 parent = (uint32)(edge->key >> 32);
+        zval metrics, value;
+
+        if (!edge->key) {
+            continue;
+        }
+
+        if (parent) {
+            smart_str_append(&key, hp_row_name(parent));
+        } else {
+            smart_str_appendl(&key, "main()", sizeof("main()") - 1);
+        }
+        smart_str_appendl(&key, "==>", sizeof("==>") - 1);
+        smart_str_append(&key, hp_row_name((uint32)edge->key));
+        smart_str_0(&key);
+
+        array_init_size(&metrics, 2);
+        ZVAL_LONG(&value, edge->ct);
+        zend_hash_add_new(Z_ARRVAL(metrics), hp_stats_key_names[HP_STATS_COUNT_CT], &value);
+        ZVAL_LONG(&value, edge->wt);
+        zend_hash_add_new(Z_ARRVAL(metrics), hp_stats_key_names[HP_STATS_COUNT_WT], &value);
+
+        zend_hash_str_update(Z_ARRVAL_P(result), ZSTR_VAL(key.s), ZSTR_LEN(key.s), &metrics);
+        ZSTR_LEN(key.s) = 0;
+    }
+    smart_str_free(&key);
+
+    if (hp_globals.edges_dropped) {
+        zval metrics, value;
+
+        array_init_size(&metrics, 1);
+        ZVAL_LONG(&value, hp_globals.edges_dropped);
+        zend_hash_add_new(Z_ARRVAL(metrics), hp_stats_key_names[HP_STATS_COUNT_CT], &value);
+        zend_hash_str_update(Z_ARRVAL_P(result), "(dropped edges)", sizeof("(dropped edges)") - 1, &metrics);
     }
+}
 
-    efree(hp_globals.stats_count);
+//每个函数一个直方图指针, 直方图本身在函数第一次返回时分配
+static void hp_hists_prepare(uint32_t func_num) {
+    hp_globals.hists = (hp_hist **)ecalloc(func_num, sizeof(hp_hist *));
+    hp_globals.hists_num = func_num;
 }
 
+static void hp_hists_free() {
+    uint32_t i;
+
+    if (!hp_globals.hists) {
+        return;
+    }
+
+    for (i = 0; i < hp_globals.hists_num; i++) {
+        if (hp_globals.hists[i]) {
+            efree(hp_globals.hists[i]);
+        }
+    }
+    efree(hp_globals.hists);
+    hp_globals.hists = NULL;
+    hp_globals.hists_num = 0;
+}